@@ -0,0 +1,116 @@
+#include "admission.h"
+#include "peers.h"
+#include "stats.h"
+#include "throttle.h"
+#include "config.h"
+
+
+static size_t max_conns = 0, max_conns_ip = 0, max_memory = 0;
+static long active_conns = 0;
+
+
+void
+init_limits(size_t max_conns_conf, size_t max_conns_ip_conf, size_t max_memory_conf)
+{
+    max_conns = max_conns_conf;
+    max_conns_ip = max_conns_ip_conf;
+    max_memory = max_memory_conf;
+
+    if (max_conns_ip) {
+        init_peers();
+    }
+}
+
+
+enum shed_reason
+admit_connection(const struct in6_addr *addr)
+{
+    struct peer *peer;
+    enum shed_reason reason = SHED_NONE;
+
+    if (max_memory && (size_t)stats_get(ST_MEMORY_USED) >= max_memory) {
+        stats_inc(ST_SHED_MEMORY);
+        return SHED_MEMORY;
+    }
+
+    if (max_conns &&
+        (size_t)__atomic_add_fetch(&active_conns, 1, __ATOMIC_RELAXED) > max_conns)
+    {
+        __atomic_sub_fetch(&active_conns, 1, __ATOMIC_RELAXED);
+        stats_inc(ST_SHED_CONNS);
+        return SHED_CONNS;
+    }
+
+    if (max_conns_ip && (peer = lock_peer(addr, monotonic_ms()))) {
+        if ((size_t)peer->conns >= max_conns_ip) {
+            reason = SHED_CONNS_IP;
+        } else {
+            peer->conns++;
+        }
+        unlock_peer(peer);
+    }
+
+    if (reason) {
+        if (max_conns) {
+            __atomic_sub_fetch(&active_conns, 1, __ATOMIC_RELAXED);
+        }
+        stats_inc(ST_SHED_CONNS_IP);
+    }
+
+    return reason;
+}
+
+
+void
+release_connection(const struct in6_addr *addr)
+{
+    struct peer *peer;
+
+    if (max_conns) {
+        __atomic_sub_fetch(&active_conns, 1, __ATOMIC_RELAXED);
+    }
+
+    if (max_conns_ip && (peer = lock_peer(addr, monotonic_ms()))) {
+        if (peer->conns > 0) {
+            peer->conns--;
+        }
+        unlock_peer(peer);
+    }
+}
+
+
+/* past LIMITS_HIGH_WATER of either budget idle keep-alive connections
+ * should make room for new ones
+ */
+int
+near_limits(void)
+{
+    if (max_conns &&
+        (size_t)__atomic_load_n(&active_conns, __ATOMIC_RELAXED) * 100
+        >= max_conns * LIMITS_HIGH_WATER)
+    {
+        return 1;
+    }
+
+    if (max_memory &&
+        (size_t)stats_get(ST_MEMORY_USED) * 100 >= max_memory * LIMITS_HIGH_WATER)
+    {
+        return 1;
+    }
+
+    return 0;
+}
+
+
+void
+mem_charge(size_t size)
+{
+    stats_max(ST_MEMORY_PEAK, stats_add(ST_MEMORY_USED, size));
+}
+
+
+void
+mem_release(size_t size)
+{
+    stats_add(ST_MEMORY_USED, -(long)size);
+}
@@ -0,0 +1,20 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stddef.h>
+#include <netinet/in.h>
+
+
+enum shed_reason {SHED_NONE, SHED_CONNS, SHED_CONNS_IP, SHED_MEMORY};
+
+
+void init_limits(size_t max_conns, size_t max_conns_ip, size_t max_memory);
+
+enum shed_reason admit_connection(const struct in6_addr *addr);
+void release_connection(const struct in6_addr *addr);
+int near_limits(void);
+
+void mem_charge(size_t size);
+void mem_release(size_t size);
+
+#endif
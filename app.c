@@ -0,0 +1,308 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "rockepoll.h"
+#include "app.h"
+#include "completion.h"
+#include "arena.h"
+#include "admission.h"
+#include "stats.h"
+#include "utils.h"
+#include "config.h"
+
+
+/* Routes of a program built on librockepoll. Their handlers run in the
+ * worker that read the request. A deferred answer is handed back to it
+ * as a completion, the way the I/O pool hands back its lookups.
+ */
+
+#define APP_MAX_PREFIX_SIZE 256
+#define APP_HEADERS_FORMAT                                                    \
+    "HTTP/1.1 %d %s\r\n"                                                      \
+    "Server: rockepoll\r\n"                                                   \
+    "Content-Type: %s\r\n"                                                    \
+    "Content-Length: %zu\r\n"                                                 \
+    "Connection: %s\r\n\r\n"
+
+
+struct route {
+    char prefix[APP_MAX_PREFIX_SIZE];
+    size_t prefix_size;
+    rockepoll_handler handler;
+    void *arg;
+};
+
+
+/* done comes first, a completion of the queue is its pending */
+struct rockepoll_pending {
+    struct completion done;
+    enum http_status status;
+    const struct http_request *req;
+    char *answer, *content_type, *body;
+    size_t size;
+};
+
+
+static struct route routes[APP_MAX_ROUTES];
+static int routes_count = 0;
+
+static __thread struct completion_queue *worker = NULL;
+
+
+void
+rockepoll_route(const char *prefix, rockepoll_handler handler, void *arg)
+{
+    struct route *r = &routes[routes_count];
+
+    if (routes_count == APP_MAX_ROUTES) {
+        errx(1, "too many routes, at most %d", APP_MAX_ROUTES);
+    }
+    /* targets are matched without their leading slash */
+    if (*prefix != '/' || strlen(prefix) >= APP_MAX_PREFIX_SIZE) {
+        errx(1, "invalid route `%s'", prefix);
+    }
+
+    r->prefix_size = strlen(prefix) - 1;
+    memcpy(r->prefix, prefix + 1, r->prefix_size + 1);
+    r->handler = handler;
+    r->arg = arg;
+
+    routes_count++;
+}
+
+
+/* returns the eventfd the worker's loop waits on, -1 without routes */
+int
+init_app_worker(void)
+{
+    if (!routes_count) {
+        return -1;
+    }
+
+    worker = completion_queue_new();
+
+    return worker->fd;
+}
+
+
+/* Routes are tried in the order they were registered */
+int
+app_route(const char *target)
+{
+    int i;
+
+    for (i = 0; i < routes_count; i++) {
+        if (!strncmp(target, routes[i].prefix, routes[i].prefix_size)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+
+/* the program's statuses, one without a reason phrase is answered as 500 */
+static enum http_status
+checked_status(int st)
+{
+    if (st < 0 ||
+        (size_t)st >= sizeof(http_status_str) / sizeof(*http_status_str) ||
+        !http_status_str[st])
+    {
+        warnx("unknown HTTP status %d, answered with 500", st);
+        return S_INTERNAL_ERROR;
+    }
+
+    return st;
+}
+
+
+int
+app_request(struct connection *conn, int route, struct http_request *req)
+{
+    int st;
+
+    stats_inc(ST_APP_REQUESTS);
+
+    st = routes[route].handler(conn, req, routes[route].arg);
+
+    return st ? checked_status(st) : 0;
+}
+
+
+/* the headers in the arena, with room for body_room bytes after them;
+ * st is a checked one
+ */
+static char *
+build_headers(struct connection *conn, enum http_status st,
+              const char *content_type, size_t content_length,
+              size_t body_room, size_t *size)
+{
+    char *data;
+    const char *reason = http_status_str[st];
+    const char *connection = conn->keep_alive ? "keep-alive" : "close";
+
+    if (!content_type) {
+        content_type = DEFAULT_MIMETYPE;
+    }
+
+    *size = snprintf(NULL, 0, APP_HEADERS_FORMAT, st, reason, content_type,
+                     content_length, connection);
+    data = arena_alloc(&conn->arena, *size + 1 + body_room);
+    sprintf(data, APP_HEADERS_FORMAT, st, reason, content_type,
+            content_length, connection);
+
+    return data;
+}
+
+
+void
+rockepoll_respond(struct connection *conn, const struct http_request *req,
+                  enum http_status st, const char *content_type,
+                  const char *body, size_t size)
+{
+    char *data;
+    size_t headers_size;
+
+    st = checked_status(st);
+    data = build_headers(conn, st, content_type, size,
+                         req->method == M_HEAD ? 0 : size, &headers_size);
+    if (req->method != M_HEAD) {
+        memcpy(data + headers_size, body, size);
+        headers_size += size;
+    }
+
+    setup_write_io_step(conn, data, 0, headers_size, close_on_keep_alive);
+    log_new_connection(conn, req, st, size);
+}
+
+
+void
+rockepoll_respond_file(struct connection *conn, const struct http_request *req,
+                       enum http_status st, const char *content_type,
+                       int fd, off_t offset, size_t size)
+{
+    char *data;
+    size_t headers_size;
+
+    st = checked_status(st);
+    data = build_headers(conn, st, content_type, size, 0, &headers_size);
+
+    if (req->method == M_HEAD || !size) {
+        close(fd);
+        setup_write_io_step(conn, data, 0, headers_size, close_on_keep_alive);
+    } else {
+        setup_write_io_step(conn, data, 1, headers_size, NULL);
+        setup_sendfile_io_step(conn, fd, 0, offset, offset + size, size,
+                               close_on_keep_alive);
+    }
+    log_new_connection(conn, req, st, size);
+}
+
+
+enum conn_status
+rockepoll_request_done(struct connection *conn)
+{
+    return close_on_keep_alive(conn);
+}
+
+
+struct rockepoll_pending *
+rockepoll_defer(struct connection *conn, const struct http_request *req)
+{
+    struct rockepoll_pending *pending;
+
+    pending = xmalloc(sizeof(struct rockepoll_pending));
+    mem_charge(sizeof(struct rockepoll_pending));
+    completion_init(&pending->done, worker, conn);
+    pending->req = copy_request(conn, req);
+    pending->answer = pending->content_type = pending->body = NULL;
+    pending->size = 0;
+
+    setup_app_io_step(conn, pending, app_completed);
+    stats_inc(ST_APP_DEFERRED);
+
+    return pending;
+}
+
+
+static void
+free_pending(struct rockepoll_pending *pending)
+{
+    mem_release(sizeof(struct rockepoll_pending) + pending->size);
+    free(pending->answer);
+    free(pending);
+}
+
+
+void
+rockepoll_complete(struct rockepoll_pending *pending, enum http_status st,
+                   const char *content_type, const char *body, size_t size)
+{
+    size_t type_size = content_type ? strlen(content_type) + 1 : 0;
+
+    /* nobody else reads the answer before completion_done */
+    pending->answer = xmalloc(type_size + size + 1);
+    pending->body = pending->answer + type_size;
+    if (content_type) {
+        pending->content_type = memcpy(pending->answer, content_type, type_size);
+    }
+    memcpy(pending->body, body, size);
+    pending->size = size;
+    pending->status = checked_status(st);
+    mem_charge(size);
+
+    if (!completion_done(&pending->done)) {
+        /* the connection is gone, app_release left it to us */
+        free_pending(pending);
+    }
+}
+
+
+/* Called until it returns NULL after the eventfd fired */
+struct connection *
+app_next_done(void)
+{
+    struct completion *c;
+
+    while ((c = completion_next(worker))) {
+        if (!c->conn) {
+            free_pending((struct rockepoll_pending *)c);
+            continue;
+        }
+        return c->conn;
+    }
+
+    return NULL;
+}
+
+
+int
+app_ready(const struct rockepoll_pending *pending)
+{
+    return pending->done.state == CP_RECEIVED;
+}
+
+
+enum conn_status
+app_completed(struct connection *conn)
+{
+    struct rockepoll_pending *pending = conn->steps->meta;
+
+    rockepoll_respond(conn, pending->req, pending->status,
+                      pending->content_type, pending->body, pending->size);
+
+    return C_RUN;
+}
+
+
+void
+app_release(struct rockepoll_pending *pending)
+{
+    if (completion_release(&pending->done)) {
+        free_pending(pending);
+    }
+}
@@ -0,0 +1,21 @@
+#ifndef APP_H
+#define APP_H
+
+#include "io.h"
+#include "parser.h"
+
+
+struct rockepoll_pending;
+
+
+int init_app_worker(void);
+
+int app_route(const char *target);
+int app_request(struct connection *conn, int route, struct http_request *req);
+
+struct connection *app_next_done(void);
+int app_ready(const struct rockepoll_pending *pending);
+enum conn_status app_completed(struct connection *conn);
+void app_release(struct rockepoll_pending *pending);
+
+#endif
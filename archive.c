@@ -0,0 +1,351 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <err.h>
+
+#include "archive.h"
+#include "handler.h"
+#include "utils.h"
+#include "config.h"
+
+
+#define TAR_BLOCK 512
+#define TAR_ROUND(size) (((size) + TAR_BLOCK - 1) & ~(size_t)(TAR_BLOCK - 1))
+
+
+struct archive_entry {
+    char *name;
+    size_t name_size;
+    off_t offset;
+    size_t size;
+    char *mime;
+    time_t mtime;
+    char etag[ETAG_SIZE];
+};
+
+
+/* Every file of the archive, open addressed by the hash of its path. The
+ * table is built before the workers start and only read afterwards.
+ */
+static struct archive_entry *entries = NULL;
+static size_t entries_mask = 0;
+
+static int archive_fd = -1;
+static const char *archive_map = NULL;
+
+
+static struct archive_entry *
+find_entry(const char *name, size_t size)
+{
+    uint32_t i = hash_bytes(HASH_INIT, name, size) & entries_mask;
+
+    while (entries[i].name) {
+        if (entries[i].name_size == size && !memcmp(entries[i].name, name, size)) {
+            return &entries[i];
+        }
+        i = (i + 1) & entries_mask;
+    }
+
+    return &entries[i];
+}
+
+
+static size_t
+parse_octal(const char *p, size_t size)
+{
+    size_t v = 0;
+
+    while (size && (*p == ' ' || *p == '\0')) {
+        p++;
+        size--;
+    }
+
+    while (size-- && *p >= '0' && *p <= '7') {
+        v = v * 8 + (*p++ - '0');
+    }
+
+    return v;
+}
+
+
+static int
+valid_header(const unsigned char *h)
+{
+    size_t i, sum = 0;
+
+    for (i = 0; i < TAR_BLOCK; i++) {
+        sum += (i >= 148 && i < 156) ? ' ' : h[i];
+    }
+
+    return sum == parse_octal((const char *)h + 148, 8);
+}
+
+
+static int
+goes_up(const char *name)
+{
+    const char *p = name;
+
+    for (;;) {
+        if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || !p[2])) {
+            return 1;
+        }
+        if (!(p = strchr(p, '/'))) {
+            return 0;
+        }
+        p++;
+    }
+}
+
+
+/* "./a/b" and "/a/b" become "a/b", paths with a ".." segment are dropped */
+static char *
+normalize_name(const char *name, size_t *size)
+{
+    char *p;
+
+    while (*name == '.' && name[1] == '/') {
+        name += 2;
+    }
+    while (*name == '/') {
+        name++;
+    }
+
+    if (!*name) {
+        return NULL;
+    }
+    if (goes_up(name)) {
+        warnx("archive member `%s' goes up, skipped", name);
+        return NULL;
+    }
+
+    p = xmalloc(strlen(name) + 1);
+    strcpy(p, name);
+    *size = strlen(p);
+
+    return p;
+}
+
+
+/* path=... record of a pax extended header */
+static char *
+pax_path(const char *data, size_t size)
+{
+    char *p, *end;
+    const char *value, *rec = data;
+    size_t len;
+
+    while (rec < data + size) {
+        len = strtoul(rec, &end, 10);
+        if (!len || *end != ' ' || rec + len > data + size) {
+            break;
+        }
+        if (!strncmp(end + 1, "path=", sizeof("path=") - 1)) {
+            value = end + sizeof(" path=") - 1;
+            len = rec + len - value - 1; /* without the '\n' */
+            p = xmalloc(len + 1);
+            memcpy(p, value, len);
+            p[len] = '\0';
+            return p;
+        }
+        rec += len;
+    }
+
+    return NULL;
+}
+
+
+static void
+add_entry(const char *name, off_t offset, size_t size, long mtime)
+{
+    struct archive_entry *e, tmp;
+
+    if (!(tmp.name = normalize_name(name, &tmp.name_size))) {
+        return;
+    }
+
+    e = find_entry(tmp.name, tmp.name_size);
+    if (e->name) {
+        /* a later member replaces an earlier one, like tar -x does */
+        free(e->name);
+    }
+
+    e->name = tmp.name;
+    e->name_size = tmp.name_size;
+    e->offset = offset;
+    e->size = size;
+    e->mime = get_url_mimetype(e->name);
+    e->mtime = mtime;
+    snprintf(e->etag, sizeof(e->etag), "%ld-%ld", mtime, (long)size);
+}
+
+
+static size_t
+count_members(size_t map_size)
+{
+    size_t off = 0, count = 0;
+    const unsigned char *h;
+
+    while (off + TAR_BLOCK <= map_size) {
+        h = (const unsigned char *)archive_map + off;
+        if (!h[0] || !valid_header(h)) {
+            break;
+        }
+        count++;
+        off += TAR_BLOCK + TAR_ROUND(parse_octal((const char *)h + 124, 12));
+    }
+
+    return count;
+}
+
+
+/* ustar, with GNU long names and pax paths */
+static void
+index_archive(const char *path, size_t map_size)
+{
+    size_t off = 0, size, capacity = 16;
+    char name[155 + 1 + 100 + 1], *long_name = NULL;
+    const char *h;
+
+    while (capacity < count_members(map_size) * 2) {
+        capacity *= 2;
+    }
+    entries = xmalloc(capacity * sizeof(struct archive_entry));
+    memset(entries, 0, capacity * sizeof(struct archive_entry));
+    entries_mask = capacity - 1;
+
+    while (off + TAR_BLOCK <= map_size) {
+        h = archive_map + off;
+        if (!h[0]) {
+            break;
+        }
+        if (!valid_header((const unsigned char *)h)) {
+            errx(1, "`%s' is not a tar archive", path);
+        }
+
+        size = parse_octal(h + 124, 12);
+        if (off + TAR_BLOCK + size > map_size) {
+            errx(1, "`%s' is truncated", path);
+        }
+
+        switch (h[156]) {
+        case 'L':
+            free(long_name);
+            long_name = xmalloc(size + 1);
+            memcpy(long_name, h + TAR_BLOCK, size);
+            long_name[size] = '\0';
+            break;
+        case 'x':
+            free(long_name);
+            long_name = pax_path(h + TAR_BLOCK, size);
+            break;
+        case '0':
+        case '\0':
+            if (long_name) {
+                add_entry(long_name, off + TAR_BLOCK, size, parse_octal(h + 136, 12));
+            } else {
+                if (h[345] && !memcmp(h + 257, "ustar", 5)) {
+                    snprintf(name, sizeof(name), "%.155s/%.100s", h + 345, h);
+                } else {
+                    snprintf(name, sizeof(name), "%.100s", h);
+                }
+                add_entry(name, off + TAR_BLOCK, size, parse_octal(h + 136, 12));
+            }
+            /* fallthrough */
+        default:
+            free(long_name);
+            long_name = NULL;
+            break;
+        }
+
+        off += TAR_BLOCK + TAR_ROUND(size);
+    }
+
+    free(long_name);
+}
+
+
+void
+init_archive(const char *path)
+{
+    struct stat st;
+
+    if ((archive_fd = open(path, O_RDONLY | O_LARGEFILE)) < 0) {
+        err(1, "open(), `%s'", path);
+    }
+    if (fstat(archive_fd, &st) < 0) {
+        err(1, "fstat(), `%s'", path);
+    }
+    if (st.st_size < TAR_BLOCK) {
+        errx(1, "`%s' is not a tar archive", path);
+    }
+
+    archive_map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, archive_fd, 0);
+    if (archive_map == MAP_FAILED) {
+        err(1, "mmap(), `%s'", path);
+    }
+
+    index_archive(path, st.st_size);
+}
+
+
+int
+archive_enabled(void)
+{
+    return archive_fd >= 0;
+}
+
+
+/* No filesystem calls: the body stays in the archive, served by sendfile
+ * from its fd or copied from the mapping. A directory is served through
+ * its index page, as gather_file_meta does.
+ */
+enum file_status
+archive_lookup(const char *target, struct file_meta *file_meta)
+{
+    size_t size;
+    struct archive_entry *e;
+    char name[MAX_TARGET_SIZE + sizeof("/" INDEX_PAGE)];
+
+    size = strlen(target);
+    if (size == 1 && *target == '.') {
+        size = 0;
+    }
+    while (size && target[size - 1] == '/') {
+        size--;
+    }
+    if (size >= MAX_TARGET_SIZE) {
+        return F_NOT_FOUND;
+    }
+
+    e = find_entry(target, size);
+    if (!size || !e->name) {
+        memcpy(name, target, size);
+        if (size) {
+            name[size++] = '/';
+        }
+        memcpy(name + size, INDEX_PAGE, sizeof(INDEX_PAGE) - 1);
+        size += sizeof(INDEX_PAGE) - 1;
+
+        if (!(e = find_entry(name, size))->name) {
+            return F_NOT_FOUND;
+        }
+    }
+
+    file_meta->fd = archive_fd;
+    file_meta->is_directory = 0;
+    file_meta->inode = 0;
+    file_meta->mime = e->mime;
+    file_meta->size = e->size;
+    file_meta->offset = e->offset;
+    file_meta->mtime = e->mtime;
+    file_meta->data = archive_map + e->offset;
+    memcpy(file_meta->etag, e->etag, sizeof(e->etag));
+
+    return F_EXISTS;
+}
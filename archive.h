@@ -0,0 +1,11 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include "handler.h"
+
+
+void init_archive(const char *path);
+int archive_enabled(void);
+enum file_status archive_lookup(const char *target, struct file_meta *file_meta);
+
+#endif
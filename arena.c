@@ -0,0 +1,94 @@
+#include <stdlib.h>
+
+#include "arena.h"
+#include "admission.h"
+#include "stats.h"
+#include "utils.h"
+#include "config.h"
+
+
+#define ARENA_ALIGN(size) (((size) + 15) & ~(size_t)15)
+#define ARENA_HEADER_SIZE ARENA_ALIGN(sizeof(struct arena_block))
+
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size, used;
+};
+
+
+/* blocks of ARENA_BLOCK_SIZE released by the worker's connections */
+static __thread struct arena_block *pool = NULL;
+static __thread int pool_size = 0;
+
+
+static struct arena_block *
+new_block(size_t size)
+{
+    struct arena_block *block;
+
+    if (size <= ARENA_BLOCK_SIZE - ARENA_HEADER_SIZE && pool) {
+        block = pool;
+        pool = pool->next;
+        pool_size--;
+    } else {
+        /* oversized requests get a block of their own, never pooled */
+        size = MAX(size + ARENA_HEADER_SIZE, ARENA_BLOCK_SIZE);
+        block = xmalloc(size);
+        block->size = size;
+    }
+
+    block->used = ARENA_HEADER_SIZE;
+    mem_charge(block->size);
+
+    return block;
+}
+
+
+void *
+arena_alloc(struct arena_block **arena, size_t size)
+{
+    void *ptr;
+    struct arena_block *block = *arena;
+
+    size = ARENA_ALIGN(size);
+
+    if (!block || block->size - block->used < size) {
+        block = new_block(size);
+        block->next = *arena;
+        *arena = block;
+    }
+
+    ptr = (char *)block + block->used;
+    block->used += size;
+
+    return ptr;
+}
+
+
+void
+arena_reset(struct arena_block **arena)
+{
+    size_t used = 0;
+    struct arena_block *block, *next;
+
+    for (block = *arena; block; block = next) {
+        next = block->next;
+        used += block->used - ARENA_HEADER_SIZE;
+        mem_release(block->size);
+
+        if (block->size == ARENA_BLOCK_SIZE && pool_size < ARENA_POOL_SIZE) {
+            block->next = pool;
+            pool = block;
+            pool_size++;
+        } else {
+            free(block);
+        }
+    }
+
+    if (*arena) {
+        stats_max(ST_ARENA_PEAK, used);
+    }
+
+    *arena = NULL;
+}
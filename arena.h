@@ -0,0 +1,17 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+
+/* Request scoped memory of a connection. Allocations are a pointer bump,
+ * everything is given back at once by arena_reset when the response is
+ * sent. An arena is a list of blocks, NULL while the connection is idle.
+ */
+struct arena_block;
+
+
+void *arena_alloc(struct arena_block **arena, size_t size);
+void arena_reset(struct arena_block **arena);
+
+#endif
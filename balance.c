@@ -0,0 +1,186 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <err.h>
+
+#include "balance.h"
+#include "stats.h"
+#include "utils.h"
+#include "config.h"
+
+
+/* Workers publish how busy they were over the last interval. A worker
+ * well above the idlest one hands some of its idle keep-alive connections
+ * over, they are pushed on the target's inbox and the target is woken up
+ * through its eventfd to put them in its own epoll.
+ */
+
+struct worker {
+    int fd;
+    long load;                /* published, relaxed */
+    struct connection *inbox; /* linked through run_next, lock-free */
+};
+
+
+static struct worker *workers = NULL;
+static int workers_count = 0, workers_registered = 0;
+
+static __thread struct worker *self = NULL;
+static __thread long ready_acc = 0, bytes_acc = 0;
+static __thread int64_t next_check = 0;
+
+
+/* Every slot is set up before any worker runs, a worker that sees another
+ * one registered never reads a slot still being filled in.
+ */
+void
+init_balance(int threads)
+{
+    int i;
+
+    /* a single worker has nobody to hand off to */
+    if (threads < 2) {
+        return;
+    }
+
+    if (!(workers = calloc(threads, sizeof(struct worker)))) {
+        err(1, "calloc()");
+    }
+    for (i = 0; i < threads; i++) {
+        if ((workers[i].fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+            err(1, "eventfd()");
+        }
+    }
+    workers_count = threads;
+}
+
+
+int
+init_balance_worker(void)
+{
+    int i;
+
+    if (!workers) {
+        return -1;
+    }
+
+    i = __atomic_fetch_add(&workers_registered, 1, __ATOMIC_RELAXED);
+    if (i >= workers_count) {
+        errx(1, "more workers than registry slots");
+    }
+
+    self = &workers[i];
+
+    return self->fd;
+}
+
+
+void
+balance_account(long ready, long bytes)
+{
+    ready_acc += ready;
+    bytes_acc += bytes;
+}
+
+
+/* Once per interval, publishes this worker's load and returns the worker
+ * to hand connections to, if this one is the busiest by far.
+ */
+struct worker *
+balance_target(void)
+{
+    int i, n;
+    long load, max_load, min_load;
+    int64_t now;
+    struct worker *idlest = NULL;
+
+    if (!self) {
+        return NULL;
+    }
+
+    now = monotonic_ms();
+    if (now < next_check) {
+        return NULL;
+    }
+    next_check = now + BALANCE_INTERVAL;
+
+    load = ready_acc + bytes_acc / BALANCE_BYTES;
+    ready_acc = bytes_acc = 0;
+    __atomic_store_n(&self->load, load, __ATOMIC_RELAXED);
+
+    n = __atomic_load_n(&workers_registered, __ATOMIC_RELAXED);
+    max_load = min_load = 0;
+    for (i = 0; i < n; i++) {
+        load = __atomic_load_n(&workers[i].load, __ATOMIC_RELAXED);
+        max_load = MAX(max_load, load);
+        if (!idlest || load < min_load) {
+            min_load = load;
+            idlest = &workers[i];
+        }
+    }
+    stats_set(ST_LOAD_IMBALANCE, max_load - min_load);
+
+    load = self->load;
+    if (idlest == self || load < max_load || load < BALANCE_MIN_LOAD ||
+        load < BALANCE_RATIO * min_load)
+    {
+        return NULL;
+    }
+
+    return idlest;
+}
+
+
+/* the connection must be out of this worker's epoll and lists already */
+void
+balance_handoff(struct worker *to, struct connection *conn)
+{
+    uint64_t one = 1;
+    struct connection *head = __atomic_load_n(&to->inbox, __ATOMIC_RELAXED);
+
+    do {
+        conn->run_next = head;
+    } while (!__atomic_compare_exchange_n(&to->inbox, &head, conn, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if (write(to->fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        warn("write(), eventfd");
+    }
+    stats_inc(ST_MIGRATED);
+}
+
+
+/* connections handed to this worker, linked through run_next */
+struct connection *
+balance_received(void)
+{
+    uint64_t count;
+
+    if (read(self->fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        warn("read(), eventfd");
+    }
+
+    return __atomic_exchange_n(&self->inbox, NULL, __ATOMIC_ACQUIRE);
+}
+
+
+/* once all workers are gone, connections handed off too late */
+struct connection *
+balance_leftovers(void)
+{
+    int i;
+    struct connection *conn, *head = NULL;
+
+    for (i = 0; i < workers_registered; i++) {
+        while ((conn = workers[i].inbox)) {
+            workers[i].inbox = conn->run_next;
+            conn->run_next = head;
+            head = conn;
+        }
+        close(workers[i].fd);
+    }
+
+    return head;
+}
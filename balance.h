@@ -0,0 +1,19 @@
+#ifndef BALANCE_H
+#define BALANCE_H
+
+#include "io.h"
+
+
+struct worker;
+
+
+void init_balance(int threads);
+int init_balance_worker(void);
+
+void balance_account(long ready, long bytes);
+struct worker *balance_target(void);
+void balance_handoff(struct worker *to, struct connection *conn);
+struct connection *balance_received(void);
+struct connection *balance_leftovers(void);
+
+#endif
@@ -0,0 +1,263 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <err.h>
+
+#include "io.h"
+#include "log.h"
+#include "utils.h"
+#include "handler.h"
+#include "h2.h"
+#include "throttle.h"
+#include "admission.h"
+#include "arena.h"
+#include "memio.h"
+#include "stats.h"
+#include "config.h"
+
+
+/* Drives requests through process_connection over the in-memory transport,
+ * one keep-alive connection, no sockets and no event loop. What is left is
+ * the CPU the io_step pipeline and build_response spend per request.
+ */
+
+#define BENCH_MAX_TURNS  100000
+#define BENCH_OUT_SIZE   64
+
+
+static size_t conf_requests = 1000000;
+static size_t conf_idle = 0;
+static char *conf_target = "index.html";
+static char conf_headers[MAX_REQ_SIZE / 2] = "";
+static struct memio_script conf_script = {0, 0, 0};
+
+
+static void
+usage(const char *argv0)
+{
+    printf("usage: %s path "
+           "[--requests n] "
+           "[--target path] "
+           "[--header 'Name: value']... "
+           "[--read-chunk bytes] "
+           "[--send-chunk bytes] "
+           "[--eagain-every n] "
+           "[--idle n]\n", argv0);
+}
+
+
+static size_t
+parse_size_arg(int argc, char *argv[], int *i)
+{
+    size_t value;
+    char *next = NULL;
+
+    if (++*i >= argc) {
+        errx(1, "missing number after %s", argv[*i - 1]);
+    }
+
+    value = strtoull(argv[*i], &next, 10);
+    if (next == argv[*i] || *next != '\0') {
+        errx(1, "invalid argument `%s'", argv[*i]);
+    }
+
+    return value;
+}
+
+
+static void
+parse_args(int argc, char *argv[])
+{
+    int i;
+    size_t len;
+
+    if (argc < 2 || (argc == 2 && !strcmp(argv[1], "--help"))) {
+        usage(argv[0]);
+        exit(0);
+    }
+
+    for (i = 2; i < argc; i++) {
+        if (!strcmp(argv[i], "--requests")) {
+            conf_requests = parse_size_arg(argc, argv, &i);
+        }
+        else if (!strcmp(argv[i], "--target")) {
+            if (++i >= argc) {
+                errx(1, "missing path after --target");
+            }
+            conf_target = argv[i] + (argv[i][0] == '/');
+        }
+        else if (!strcmp(argv[i], "--header")) {
+            if (++i >= argc) {
+                errx(1, "missing header after --header");
+            }
+            len = strlen(conf_headers);
+            if (len + strlen(argv[i]) + 3 > sizeof(conf_headers)) {
+                errx(1, "too many headers");
+            }
+            sprintf(conf_headers + len, "%s\r\n", argv[i]);
+        }
+        else if (!strcmp(argv[i], "--read-chunk")) {
+            conf_script.read_chunk = parse_size_arg(argc, argv, &i);
+        }
+        else if (!strcmp(argv[i], "--send-chunk")) {
+            conf_script.send_chunk = parse_size_arg(argc, argv, &i);
+        }
+        else if (!strcmp(argv[i], "--eagain-every")) {
+            conf_script.eagain_every = parse_size_arg(argc, argv, &i);
+        }
+        else if (!strcmp(argv[i], "--idle")) {
+            conf_idle = parse_size_arg(argc, argv, &i);
+        }
+        else {
+            errx(1, "unknown argument `%s'", argv[i]);
+        }
+    }
+}
+
+
+static void
+setup_connection(struct memio *m, char *out, size_t out_size)
+{
+    memio_init(m, &conf_script, out, out_size);
+    m->conn.status = C_RUN;
+    m->conn.keep_alive = 1;
+    throttle_init_connection(&m->conn);
+    setup_read_io_step(&m->conn.steps, build_response);
+}
+
+
+static size_t
+run_request(struct memio *m, const char *request, size_t request_size, size_t i)
+{
+    size_t turn;
+    struct connection *conn = &m->conn;
+
+    memio_feed(m, request, request_size);
+
+    /* every turn stands for an event the loop would have got */
+    for (turn = 0; m->in_offset < m->in_size || !connection_is_idle(conn); turn++) {
+        if (conn->status == C_CLOSE) {
+            errx(1, "connection closed on request %zu", i);
+        }
+        if (turn == BENCH_MAX_TURNS) {
+            errx(1, "request %zu is stuck", i);
+        }
+        process_connection(conn);
+    }
+
+    return turn;
+}
+
+
+/* Parks conf_idle connections after one request each, the way keep-alive
+ * clients sit between requests, and reports what they hold. The connection
+ * struct is charged as on accept, so memory_used covers all of it.
+ */
+static void
+run_idle(const char *request, size_t request_size)
+{
+    size_t i;
+    long before;
+    char out[BENCH_OUT_SIZE];
+    struct memio *idle;
+
+    if ((idle = calloc(conf_idle, sizeof(*idle))) == NULL) {
+        err(1, "calloc");
+    }
+
+    before = stats_get(ST_MEMORY_USED);
+    for (i = 0; i < conf_idle; i++) {
+        mem_charge(sizeof(struct connection));
+        setup_connection(&idle[i], out, sizeof(out));
+        run_request(&idle[i], request, request_size, i);
+    }
+
+    printf("idle_connections %zu\n", conf_idle);
+    printf("idle_memory_used %ld\n", stats_get(ST_MEMORY_USED) - before);
+    printf("bytes_per_idle_connection %.0f\n",
+           (double)(stats_get(ST_MEMORY_USED) - before) / conf_idle);
+
+    for (i = 0; i < conf_idle; i++) {
+        cleanup_steps(idle[i].conn.steps);
+        arena_reset(&idle[i].conn.arena);
+        mem_release(sizeof(struct connection));
+    }
+    free(idle);
+}
+
+
+static double
+elapsed(clockid_t clock, const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(clock, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    int request_size;
+    size_t i, turns = 0, errors = 0;
+    double cpu, wall;
+    char request[MAX_REQ_SIZE], out[BENCH_OUT_SIZE];
+    struct timespec cpu_start, wall_start;
+    struct memio m;
+    struct connection *conn = &m.conn;
+
+    parse_args(argc, argv);
+
+    request_size = snprintf(request, sizeof(request),
+                            "GET /%s HTTP/1.1\r\n"
+                            "Host: bench\r\n"
+                            "User-Agent: rockepoll-bench\r\n"
+                            "%s\r\n", conf_target, conf_headers);
+    if (request_size >= (int)sizeof(request)) {
+        errx(1, "request too large");
+    }
+
+    init_logger(1);
+    init_h2();
+    init_throttle(0, 0, 0);
+    init_limits(0, 0, 0);
+    init_handler(argv[1], 0);
+
+    setup_connection(&m, out, sizeof(out));
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_start);
+    clock_gettime(CLOCK_MONOTONIC, &wall_start);
+
+    for (i = 0; i < conf_requests; i++) {
+        turns += run_request(&m, request, request_size, i);
+
+        if (m.out_size < sizeof("HTTP/1.1 200") - 1 ||
+            (out[9] != '2' && out[9] != '3'))
+        {
+            errors++;
+        }
+    }
+
+    cpu = elapsed(CLOCK_PROCESS_CPUTIME_ID, &cpu_start);
+    wall = elapsed(CLOCK_MONOTONIC, &wall_start);
+
+    cleanup_steps(conn->steps);
+    arena_reset(&conn->arena);
+
+    printf("requests %zu\n", conf_requests);
+    printf("errors %zu\n", errors);
+    printf("cpu_seconds %.3f\n", cpu);
+    printf("wall_seconds %.3f\n", wall);
+    printf("requests_per_cpu_second %.0f\n", conf_requests / cpu);
+    printf("ns_per_request %.0f\n", cpu * 1e9 / conf_requests);
+    printf("turns_per_request %.2f\n", (double)turns / conf_requests);
+    printf("bytes_out %zu\n", m.out_bytes);
+
+    if (conf_idle) {
+        run_idle(request, request_size);
+    }
+
+    return errors != 0;
+}
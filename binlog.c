@@ -0,0 +1,216 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <err.h>
+
+#include "binlog.h"
+#include "utils.h"
+#include "config.h"
+
+
+/* Every worker appends to its own segment, named after the process, the
+ * worker and a sequence number, and starts the next one when it is full.
+ * Strings are interned per segment through a small table of recent ones,
+ * a string pushed out of it is written again the next time it comes.
+ */
+
+#define INTERN_PROBES 8
+
+
+struct segment {
+    char *base;
+    size_t size;
+    struct binlog_header *header;
+    struct binlog_record *records;
+    char *strings;
+    uint32_t hashes[BINLOG_INTERN_SLOTS];
+    uint32_t slots[BINLOG_INTERN_SLOTS];  /* offset + 1, 0 when free */
+};
+
+
+static int dir_fd = -1;
+static int workers = 0;
+
+static __thread struct segment *segment = NULL;
+static __thread int worker_id = -1, sequence = 0, broken = 0;
+
+
+/* the directory is opened before a chroot */
+void
+init_binlog(const char *dir)
+{
+    if (!dir) {
+        return;
+    }
+
+    if ((dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        err(1, "open(%s)", dir);
+    }
+}
+
+
+int
+binlog_enabled(void)
+{
+    return dir_fd >= 0;
+}
+
+
+static int
+open_segment(struct segment *s)
+{
+    int fd;
+    char name[64];
+
+    if (worker_id < 0) {
+        worker_id = __atomic_fetch_add(&workers, 1, __ATOMIC_RELAXED);
+    }
+
+    snprintf(name, sizeof(name), "rockepoll-%ld-%d-%d.rlog",
+             (long)getpid(), worker_id, sequence++);
+
+    s->size = BINLOG_HEADER_SIZE + sizeof(struct binlog_record) * BINLOG_RECORDS +
+              BINLOG_STRINGS;
+    if ((fd = openat(dir_fd, name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644)) < 0) {
+        warn("open(%s)", name);
+        return -1;
+    }
+    /* the file stays sparse where nothing was written */
+    if (ftruncate(fd, s->size) < 0) {
+        warn("ftruncate(%s)", name);
+        close(fd);
+        return -1;
+    }
+    s->base = mmap(NULL, s->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (s->base == MAP_FAILED) {
+        warn("mmap(%s)", name);
+        return -1;
+    }
+
+    s->header = (struct binlog_header *)s->base;
+    s->records = (struct binlog_record *)(s->base + BINLOG_HEADER_SIZE);
+    s->strings = (char *)(s->records + BINLOG_RECORDS);
+    memcpy(s->header->magic, BINLOG_MAGIC, sizeof(s->header->magic));
+    s->header->record_size = sizeof(struct binlog_record);
+    s->header->records_capacity = BINLOG_RECORDS;
+    s->header->strings_offset = s->strings - s->base;
+    s->header->strings_capacity = BINLOG_STRINGS;
+    memset(s->slots, 0, sizeof(s->slots));
+
+    return 0;
+}
+
+
+/* Returns 0 when the segment has room for a record and size bytes of
+ * strings, or a new one was started
+ */
+static int
+reserve(size_t size)
+{
+    if (segment &&
+        segment->header->records < BINLOG_RECORDS &&
+        segment->header->strings_size + size <= BINLOG_STRINGS)
+    {
+        return 0;
+    }
+
+    if (broken) {
+        return -1;
+    }
+
+    if (segment) {
+        munmap(segment->base, segment->size);
+    } else {
+        segment = xmalloc(sizeof(struct segment));
+    }
+
+    if (open_segment(segment)) {
+        /* one warning per worker, its records are dropped from now on */
+        free(segment);
+        segment = NULL;
+        broken = 1;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static uint32_t
+intern(const char *str)
+{
+    int i;
+    uint32_t hash, slot, offset, *free_slot = NULL;
+    size_t size;
+
+    if (!str) {
+        return BINLOG_NO_STRING;
+    }
+
+    hash = hash_string(HASH_INIT, str);
+    size = strlen(str) + 1;
+
+    for (i = 0; i < INTERN_PROBES; i++) {
+        slot = (hash + i) & (BINLOG_INTERN_SLOTS - 1);
+        if (!segment->slots[slot]) {
+            free_slot = free_slot ? free_slot : &segment->slots[slot];
+            continue;
+        }
+        offset = segment->slots[slot] - 1;
+        if (segment->hashes[slot] == hash && !strcmp(segment->strings + offset, str)) {
+            return offset;
+        }
+    }
+
+    offset = segment->header->strings_size;
+    memcpy(segment->strings + offset, str, size);
+    __atomic_store_n(&segment->header->strings_size, offset + size, __ATOMIC_RELEASE);
+
+    if (!free_slot) {
+        free_slot = &segment->slots[hash & (BINLOG_INTERN_SLOTS - 1)];
+    }
+    *free_slot = offset + 1;
+    segment->hashes[free_slot - segment->slots] = hash;
+
+    return offset;
+}
+
+
+void
+binlog_request(const struct in6_addr *addr, const struct http_request *req,
+               int status, size_t bytes, int64_t latency_us)
+{
+    size_t size = 0;
+    const char *user_agent = NULL;
+    struct timespec ts;
+    struct binlog_record r;
+
+    if (req) {
+        user_agent = req->headers[H_USER_AGENT];
+        size = strlen(req->target) + 1 + (user_agent ? strlen(user_agent) + 1 : 0);
+    }
+    if (reserve(size)) {
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    r.time_us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    memcpy(r.addr, addr, sizeof(r.addr));
+    r.bytes = bytes;
+    r.target = req ? intern(req->target) : BINLOG_NO_STRING;
+    r.user_agent = intern(user_agent);
+    r.latency_us = latency_us < 0 ? 0 : MIN(latency_us, (int64_t)UINT32_MAX);
+    r.status = status;
+    r.method = req ? req->method : UINT8_MAX;
+    r.version = req ? req->version : 0;
+
+    memcpy(&segment->records[segment->header->records], &r, sizeof(r));
+    __atomic_store_n(&segment->header->records, segment->header->records + 1,
+                     __ATOMIC_RELEASE);
+}
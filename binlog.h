@@ -0,0 +1,51 @@
+#ifndef BINLOG_H
+#define BINLOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+#include "parser.h"
+
+
+/* A segment is a header, BINLOG_RECORDS fixed size records and a table
+ * of the strings they refer to, NUL terminated and named by their offset
+ * in the table. The file is mapped whole, records and strings counts are
+ * stored after what they count so a reader never sees half a record.
+ */
+
+#define BINLOG_MAGIC        "RKLOG01\n"
+#define BINLOG_HEADER_SIZE  64
+#define BINLOG_NO_STRING    UINT32_MAX
+
+
+struct binlog_header {
+    char magic[8];
+    uint32_t record_size;
+    uint32_t records_capacity;
+    uint64_t strings_offset;
+    uint64_t strings_capacity;
+    uint64_t records;
+    uint64_t strings_size;
+};
+
+
+struct binlog_record {
+    uint64_t time_us;       /* since the epoch */
+    uint8_t addr[16];       /* IPv4 is mapped into IPv6 */
+    uint64_t bytes;
+    uint32_t target;        /* in the string table, without the leading / */
+    uint32_t user_agent;
+    uint32_t latency_us;    /* from the first byte of the request to the response */
+    uint16_t status;
+    uint8_t method;         /* enum http_method, UINT8_MAX without a request */
+    uint8_t version;        /* enum http_version */
+};
+
+
+void init_binlog(const char *dir);
+int binlog_enabled(void);
+void binlog_request(const struct in6_addr *addr, const struct http_request *req,
+                    int status, size_t bytes, int64_t latency_us);
+
+#endif
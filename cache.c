@@ -0,0 +1,328 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+#include "cache.h"
+#include "utils.h"
+#include "config.h"
+
+
+/* Rules are compiled into three tries at startup: path prefixes and
+ * exact paths, path suffixes walked from the end and mime types. A lookup
+ * walks each at most once along the path or the mime type, an exact path
+ * wins over the longest prefix, then the longest suffix, then the mime.
+ */
+
+enum trie_root {T_PATH, T_SUFFIX, T_MIME, TRIES_COUNT};
+
+
+struct cache_rule {
+    long max_age;
+    size_t size;
+    char header[CACHE_CONTROL_SIZE];  /* the whole Cache-Control line */
+};
+
+
+struct cache_node {
+    unsigned char c;
+    signed char prefix_rule, exact_rule;
+    int child, sibling;
+};
+
+
+static struct cache_rule rules[CACHE_MAX_RULES];
+static int rules_count = 0;
+
+static struct cache_node *nodes = NULL;
+static int nodes_count = 0, nodes_size = 0;
+
+static __thread time_t expires_at[CACHE_MAX_RULES];
+static __thread char expires[CACHE_MAX_RULES][HTTP_DATE_SIZE];
+
+
+static int
+new_node(unsigned char c)
+{
+    if (nodes_count == nodes_size) {
+        nodes_size = nodes_size ? nodes_size * 2 : 64;
+        nodes = xrealloc(nodes, sizeof(struct cache_node) * nodes_size);
+    }
+
+    nodes[nodes_count].c = c;
+    nodes[nodes_count].prefix_rule = -1;
+    nodes[nodes_count].exact_rule = -1;
+    nodes[nodes_count].child = -1;
+    nodes[nodes_count].sibling = -1;
+
+    return nodes_count++;
+}
+
+
+static int
+find_child(int node, unsigned char c)
+{
+    int i;
+
+    for (i = nodes[node].child; i >= 0; i = nodes[i].sibling) {
+        if (nodes[i].c == c) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+
+/* a suffix key is inserted back to front */
+static void
+insert_key(enum trie_root root, const char *key, size_t size, int rule, int exact)
+{
+    int node = root, next;
+    size_t i;
+    unsigned char c;
+
+    for (i = 0; i < size; i++) {
+        c = (root == T_SUFFIX) ? key[size - 1 - i] : key[i];
+        if ((next = find_child(node, c)) < 0) {
+            next = new_node(c);
+            nodes[next].sibling = nodes[node].child;
+            nodes[node].child = next;
+        }
+        node = next;
+    }
+
+    if (exact) {
+        nodes[node].exact_rule = rule;
+    } else {
+        nodes[node].prefix_rule = rule;
+    }
+}
+
+
+static void
+compile_policy(struct cache_rule *rule, const char *policy, const char *spec)
+{
+    char *token, *save, *next, buf[CACHE_CONTROL_SIZE];
+
+    if (strlen(policy) >= sizeof(buf)) {
+        errx(1, "cache policy too long `%s'", spec);
+    }
+
+    rule->max_age = -1;
+    rule->size = sprintf(rule->header, "Cache-Control: ");
+
+    strcpy(buf, policy);
+    for (token = strtok_r(buf, ",", &save); token;
+         token = strtok_r(NULL, ",", &save))
+    {
+        while (*token == ' ') {
+            token++;
+        }
+
+        if (!strncmp(token, "max-age=", sizeof("max-age=") - 1)) {
+            rule->max_age = strtol(token + sizeof("max-age=") - 1, &next, 10);
+            if (rule->max_age < 0 || *next != '\0' ||
+                next == token + sizeof("max-age=") - 1)
+            {
+                errx(1, "invalid max-age in `%s'", spec);
+            }
+        } else if (strcmp(token, "immutable") && strcmp(token, "public") &&
+                   strcmp(token, "private") && strcmp(token, "no-cache") &&
+                   strcmp(token, "no-store") && strcmp(token, "must-revalidate"))
+        {
+            errx(1, "unknown cache directive `%s' in `%s'", token, spec);
+        }
+
+        if (rule->size + strlen(token) + 4 >= CACHE_CONTROL_SIZE) {
+            errx(1, "cache policy too long `%s'", spec);
+        }
+        rule->size += sprintf(rule->header + rule->size, "%s%s",
+                              rule->header[rule->size - 2] == ':' ? "" : ", ",
+                              token);
+    }
+
+    rule->size += sprintf(rule->header + rule->size, "\r\n");
+}
+
+
+/* pattern=policy, the pattern is a path, exact or with a * at its start
+ * or end, or a mime type, exact or ending in a *; the policy is a list of
+ * Cache-Control directives
+ */
+void
+cache_add_rule(const char *spec)
+{
+    int rule;
+    char *star;
+    const char *policy = strchr(spec, '=');
+    size_t size;
+
+    if (rules_count == CACHE_MAX_RULES) {
+        errx(1, "too many cache rules, at most %d", CACHE_MAX_RULES);
+    }
+    if (!policy || policy == spec || !policy[1]) {
+        errx(1, "invalid cache rule `%s'", spec);
+    }
+
+    if (!nodes) {
+        for (rule = 0; rule < TRIES_COUNT; rule++) {
+            new_node(0);
+        }
+    }
+
+    rule = rules_count++;
+    compile_policy(&rules[rule], policy + 1, spec);
+
+    size = policy - spec;
+    star = memchr(spec, '*', size);
+    if (star && memchr(star + 1, '*', policy - star - 1)) {
+        errx(1, "a single * is supported in `%s'", spec);
+    }
+
+    if (*spec == '*') {
+        insert_key(T_SUFFIX, spec + 1, size - 1, rule, 0);
+    } else if (*spec == '/') {
+        /* targets come without the leading slash */
+        if (star && star != policy - 1) {
+            errx(1, "* goes first or last in `%s'", spec);
+        }
+        insert_key(T_PATH, spec + 1, size - 1 - (star != NULL), rule, !star);
+    } else {
+        if (star && star != policy - 1) {
+            errx(1, "* goes last in `%s'", spec);
+        }
+        insert_key(T_MIME, spec, size - (star != NULL), rule, !star);
+    }
+}
+
+
+/* the longest prefix of key with a rule, or its exact rule; the key ends
+ * at end or at the first of stop
+ */
+static int
+match_forward(enum trie_root root, const char *key, char stop)
+{
+    int node = root, rule = nodes[root].prefix_rule;
+
+    for (; *key && *key != stop; key++) {
+        if ((node = find_child(node, *key)) < 0) {
+            return rule;
+        }
+        if (nodes[node].prefix_rule >= 0) {
+            rule = nodes[node].prefix_rule;
+        }
+    }
+
+    return (nodes[node].exact_rule >= 0) ? nodes[node].exact_rule : rule;
+}
+
+
+static int
+match_suffix(const char *key)
+{
+    int node = T_SUFFIX, rule = nodes[T_SUFFIX].prefix_rule;
+    const char *p = key + strlen(key);
+
+    while (p-- > key) {
+        if ((node = find_child(node, *p)) < 0) {
+            break;
+        }
+        if (nodes[node].prefix_rule >= 0) {
+            rule = nodes[node].prefix_rule;
+        }
+    }
+
+    return rule;
+}
+
+
+const struct cache_rule *
+cache_match(const char *target, const char *mime)
+{
+    int rule;
+
+    if (!rules_count) {
+        return NULL;
+    }
+
+    if (!strcmp(target, ".")) {
+        target = "";
+    }
+
+    if ((rule = match_forward(T_PATH, target, '\0')) < 0 &&
+        (rule = match_suffix(target)) < 0 &&
+        (rule = match_forward(T_MIME, mime, ';')) < 0)
+    {
+        return NULL;
+    }
+
+    return &rules[rule];
+}
+
+
+/* the value alone, for HPACK */
+const char *
+cache_control(const struct cache_rule *rule, size_t *size)
+{
+    *size = rule->size - (sizeof("Cache-Control: ") - 1) - 2;
+    return rule->header + sizeof("Cache-Control: ") - 1;
+}
+
+
+/* NULL without max-age, formatted once a second per worker */
+const char *
+cache_expires(const struct cache_rule *rule)
+{
+    int i = rule - rules;
+    time_t now;
+
+    if (rule->max_age < 0) {
+        return NULL;
+    }
+
+    now = time(NULL);
+    if (expires_at[i] != now) {
+        expires_at[i] = now;
+        format_http_date(now + rule->max_age, expires[i]);
+    }
+
+    return expires[i];
+}
+
+
+size_t
+format_http_date(time_t t, char *buf)
+{
+    struct tm tm;
+
+    return strftime(buf, HTTP_DATE_SIZE, "%a, %d %b %Y %H:%M:%S GMT",
+                    gmtime_r(&t, &tm));
+}
+
+
+/* Last-Modified always, Cache-Control and Expires when a rule matches */
+size_t
+cache_headers(const char *target, const struct file_meta *file, char *buf)
+{
+    size_t size;
+    const char *date;
+    const struct cache_rule *rule;
+
+    size = sprintf(buf, "Last-Modified: ");
+    size += format_http_date(file->mtime, buf + size);
+    size += sprintf(buf + size, "\r\n");
+
+    if (!(rule = cache_match(target, file->mime))) {
+        return size;
+    }
+
+    memcpy(buf + size, rule->header, rule->size);
+    size += rule->size;
+
+    if ((date = cache_expires(rule))) {
+        size += sprintf(buf + size, "Expires: %s\r\n", date);
+    }
+
+    return size;
+}
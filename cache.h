@@ -0,0 +1,26 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <time.h>
+
+#include "handler.h"
+
+
+#define HTTP_DATE_SIZE      30
+#define CACHE_HEADERS_SIZE  (CACHE_CONTROL_SIZE + 2 * HTTP_DATE_SIZE + 64)
+
+
+struct cache_rule;
+
+
+void cache_add_rule(const char *spec);
+
+const struct cache_rule *cache_match(const char *target, const char *mime);
+const char *cache_control(const struct cache_rule *rule, size_t *size);
+const char *cache_expires(const struct cache_rule *rule);
+size_t format_http_date(time_t t, char *buf);
+
+size_t cache_headers(const char *target, const struct file_meta *file, char *buf);
+
+#endif
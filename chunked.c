@@ -0,0 +1,97 @@
+#include <ctype.h>
+
+#include "chunked.h"
+#include "utils.h"
+
+
+/* Feeds framing bytes, chunk sizes, line ends and trailers, through the
+ * decoder. Stops at the first byte of chunk data and returns how many
+ * bytes were framing.
+ */
+size_t
+chunked_frame(struct chunked *ch, const char *data, size_t size)
+{
+    size_t i = 0;
+    char c;
+
+    while (i < size && ch->state != CH_DONE && ch->state != CH_DATA &&
+           ch->state != CH_ERROR)
+    {
+        c = data[i++];
+
+        switch (ch->state) {
+        case CH_SIZE:
+            if (isxdigit((unsigned char)c) &&
+                ch->left >> (sizeof(ch->left) * 8 - 4))
+            {
+                ch->state = CH_ERROR;
+            } else if (c >= '0' && c <= '9') {
+                ch->left = ch->left * 16 + c - '0';
+            } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+                ch->left = ch->left * 16 + (c | 0x20) - 'a' + 10;
+            } else if (c == '\n') {
+                ch->state = ch->left ? CH_DATA : CH_TRAILER;
+                ch->line_empty = 1;
+            } else if (c != '\r') {
+                ch->state = CH_EXTENSION;
+            }
+            break;
+        case CH_EXTENSION:
+            /* chunk extensions are skipped, up to the end of the line */
+            if (c == '\n') {
+                ch->state = ch->left ? CH_DATA : CH_TRAILER;
+                ch->line_empty = 1;
+            }
+            break;
+        case CH_DATA_END:
+            if (c == '\n') {
+                ch->state = CH_SIZE;
+            }
+            break;
+        case CH_TRAILER:
+            if (c == '\n') {
+                if (ch->line_empty) {
+                    ch->state = CH_DONE;
+                }
+                ch->line_empty = 1;
+            } else if (c != '\r') {
+                ch->line_empty = 0;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    return i;
+}
+
+
+/* size bytes of chunk data went by, at most what is left of the chunk */
+void
+chunked_data(struct chunked *ch, size_t size)
+{
+    if (!(ch->left -= size)) {
+        ch->state = CH_DATA_END;
+    }
+}
+
+
+/* framing and data alike, returns how many bytes belong to the body */
+size_t
+chunked_scan(struct chunked *ch, const char *data, size_t size)
+{
+    size_t n, i = 0;
+
+    while (i < size && ch->state != CH_DONE && ch->state != CH_ERROR) {
+        i += chunked_frame(ch, data + i, size - i);
+
+        if (ch->state == CH_DATA) {
+            n = MIN(ch->left, size - i);
+            chunked_data(ch, n);
+            i += n;
+        }
+    }
+
+    return i;
+}
@@ -0,0 +1,25 @@
+#ifndef CHUNKED_H
+#define CHUNKED_H
+
+#include <stddef.h>
+
+
+enum chunk_state {CH_SIZE, CH_EXTENSION, CH_DATA, CH_DATA_END, CH_TRAILER, CH_DONE,
+                  CH_ERROR};
+
+
+/* decoder of the chunked transfer coding, starts zeroed; CH_ERROR is a
+ * chunk size that does not fit in size_t
+ */
+struct chunked {
+    enum chunk_state state;
+    size_t left;
+    int line_empty;
+};
+
+
+size_t chunked_frame(struct chunked *ch, const char *data, size_t size);
+void chunked_data(struct chunked *ch, size_t size);
+size_t chunked_scan(struct chunked *ch, const char *data, size_t size);
+
+#endif
@@ -0,0 +1,121 @@
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <err.h>
+
+#include "completion.h"
+#include "utils.h"
+
+
+/* One lock for every queue, it is only held to move a pointer */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+struct completion_queue *
+completion_queue_new(void)
+{
+    struct completion_queue *queue;
+
+    queue = xmalloc(sizeof(struct completion_queue));
+    queue->done = queue->ready = NULL;
+    if ((queue->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        err(1, "eventfd()");
+    }
+
+    return queue;
+}
+
+
+void
+completion_init(struct completion *c, struct completion_queue *queue,
+                struct connection *conn)
+{
+    c->state = CP_WAITING;
+    c->conn = conn;
+    c->queue = queue;
+    c->done_next = NULL;
+}
+
+
+/* Hands c over to its worker. Returns 0 when the connection went away
+ * meanwhile, the caller drops c then.
+ */
+int
+completion_done(struct completion *c)
+{
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&lock);
+
+    if (!c->conn) {
+        pthread_mutex_unlock(&lock);
+        return 0;
+    }
+
+    c->state = CP_DONE;
+    c->done_next = c->queue->done;
+    c->queue->done = c;
+    if (write(c->queue->fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        warn("write(), eventfd");
+    }
+
+    pthread_mutex_unlock(&lock);
+
+    return 1;
+}
+
+
+/* Called until it returns NULL after the eventfd fired. The counter is
+ * drained before the list is taken, a completion that comes in between
+ * fires it again. One without a connection is the caller's to drop.
+ */
+struct completion *
+completion_next(struct completion_queue *queue)
+{
+    uint64_t count;
+    struct completion *c;
+
+    if (!queue->ready) {
+        if (read(queue->fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+            warn("read(), eventfd");
+        }
+
+        pthread_mutex_lock(&lock);
+        queue->ready = queue->done;
+        queue->done = NULL;
+        pthread_mutex_unlock(&lock);
+    }
+
+    if ((c = queue->ready)) {
+        queue->ready = c->done_next;
+        c->state = CP_RECEIVED;
+    }
+
+    return c;
+}
+
+
+/* The connection lets go of c. Returns 1 when the caller frees it, else
+ * completion_done or completion_next hand it back to be dropped.
+ */
+int
+completion_release(struct completion *c)
+{
+    pthread_mutex_lock(&lock);
+    if (c->state == CP_WAITING) {
+        c->conn = NULL;
+        pthread_mutex_unlock(&lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (c->state == CP_DONE) {
+        /* still on the worker's queue */
+        c->conn = NULL;
+        return 0;
+    }
+
+    return 1;
+}
@@ -0,0 +1,41 @@
+#ifndef COMPLETION_H
+#define COMPLETION_H
+
+#include "io.h"
+
+
+/* Work that another thread finishes for a connection of a worker. The
+ * completing thread puts it on the worker's queue and the queue's eventfd
+ * wakes the worker's loop, which runs the connection again.
+ */
+
+enum completion_state {CP_WAITING, CP_DONE, CP_RECEIVED};
+
+
+/* belongs to the worker of its connection as soon as it is CP_DONE,
+ * before only the completing thread may touch what it is part of
+ */
+struct completion {
+    enum completion_state state;
+    struct connection *conn;  /* NULL once the connection is gone */
+    struct completion_queue *queue;
+    struct completion *done_next;
+};
+
+
+struct completion_queue {
+    int fd;
+    struct completion *done;   /* under the lock */
+    struct completion *ready;  /* taken from done, the worker's own */
+};
+
+
+struct completion_queue *completion_queue_new(void);
+
+void completion_init(struct completion *c, struct completion_queue *queue,
+                     struct connection *conn);
+int completion_done(struct completion *c);
+struct completion *completion_next(struct completion_queue *queue);
+int completion_release(struct completion *c);
+
+#endif
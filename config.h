@@ -0,0 +1,136 @@
+
+#define MAXFDS 128
+#define KEEP_ALIVE_TIMEOUT 5 /* in seconds */
+#define H2_MAX_CONCURRENT_STREAMS 128
+
+/* work a connection or the listener may do before others get a turn */
+#define CONN_BYTE_BUDGET  (1024 * 256)
+#define CONN_STEP_BUDGET  16
+#define ACCEPT_BUDGET     64
+
+/* bandwidth throttling, rates themselves are given on the command line */
+#define THROTTLE_BURST_MS   250
+#define THROTTLE_MIN_BURST  (1024 * 16)
+
+/* per client address state (throttling, connection caps) */
+#define PEER_SLOTS          4096 /* power of two */
+
+/* admission control, limits themselves are given on the command line */
+#define LIMITS_HIGH_WATER     90  /* % of a limit where idle connections get evicted */
+#define EVICT_SCAN_LIMIT      64
+#define OVERLOAD_RETRY_AFTER  5   /* in seconds */
+
+/* request scoped allocations, blocks are kept per worker thread */
+#define ARENA_BLOCK_SIZE    (1024 * 16)
+#define ARENA_POOL_SIZE     256
+
+/* reverse proxy, routes are given on the command line */
+#define PROXY_MAX_ROUTES    16
+#define PROXY_POOL_SIZE     64  /* idle upstream connections per worker and route */
+#define PROXY_IDLE_TIMEOUT  4   /* in seconds, below the upstream's own */
+#define PROXY_TIMEOUT       30  /* in seconds without progress */
+#define PROXY_RETRIES       2
+
+/* open directory fds paths are resolved beneath, kept per worker thread */
+#define DIR_CACHE_SLOTS     64  /* power of two */
+#define DIR_CACHE_PATH      256
+#define DIR_CACHE_TTL       2   /* in seconds */
+
+/* lookups that would block the event loop, threads are set with --io-threads */
+#define FILEIO_QUEUE_SIZE   1024
+#define FILEIO_SLOTS        256  /* power of two */
+
+/* ranges closer than this are sent as one part of a multipart/byteranges */
+#define RANGE_MERGE_GAP     80
+
+/* virtual hosts, given on the command line */
+#define VHOST_SLOTS         64  /* power of two */
+
+/* Cache-Control rules, given on the command line */
+#define CACHE_MAX_RULES     32
+#define CACHE_CONTROL_SIZE  128
+
+/* idle keep-alive connections move off busy workers, with --threads > 1 */
+#define BALANCE_INTERVAL    100  /* in milliseconds */
+#define BALANCE_BYTES       (1024 * 64)  /* moved bytes weighing as much as a ready connection */
+#define BALANCE_MIN_LOAD    64   /* per interval, below it no worker is busy */
+#define BALANCE_RATIO       2    /* busiest over idlest load before anything moves */
+#define BALANCE_BATCH       8    /* connections handed off per interval */
+#define BALANCE_SCAN        64
+
+/* routes of programs built on librockepoll */
+#define APP_MAX_ROUTES      16
+#define APP_TIMEOUT         30  /* in seconds for a deferred answer */
+
+/* handing over to a new binary, with --upgrade */
+#define UPGRADE_DRAIN_TIMEOUT 30  /* in seconds the old process serves what it has */
+#define UPGRADE_READY_TIMEOUT 60  /* in seconds for the new one to start */
+#define HOT_PATH_SLOTS      1024  /* power of two */
+#define HOT_PATH_SAMPLE     8     /* one in so many static responses is counted */
+#define HOT_PATH_SNAPSHOT   256   /* paths the new process warms up */
+#define HOT_PATH_READAHEAD  (1024 * 1024 * 4)
+
+/* segments of the binary access log, with --binlog */
+#define BINLOG_RECORDS      65536
+#define BINLOG_STRINGS      (1024 * 1024 * 4)
+#define BINLOG_INTERN_SLOTS 4096  /* power of two */
+
+/* snapshots of the workers on SIGUSR1 */
+#define DUMP_MAX_CONNECTIONS 1000 /* listed per worker, the rest are counted */
+
+/* PUT and POST uploads, enabled with --upload */
+#define UPLOAD_FILE_MODE    0644
+
+
+#define DEFAULT_CONF_PORT         7887
+#define DEFAULT_CONF_TLS_PORT     7443
+#define DEFAULT_CONF_KEEP_ALIVE   0
+#define DEFAULT_CONF_QUIET        0
+#define DEFAULT_CONF_CHROOT       0
+#define DEFAULT_CONF_IO_THREADS   4
+#define DEFAULT_CONF_MAX_UPLOAD   (1024 * 1024 * 64)
+#define DEFAULT_CONF_LISTEN_ADDR  "127.0.0.1"
+#define MAX_LISTENERS             16
+#define DEFAULT_CONF_ROOT_DIR     "."
+
+
+#define INDEX_PAGE          "index.html"
+#define DEFAULT_MIMETYPE    "application/octet-stream"
+#define INDEX_MIMETYPE      "text/html; charset=utf-8"
+#define HTTP_STATUS_FORMAT  "<h1>%s</h1>"  // <h1>Not Found</h1>
+
+
+/* mime-types */
+static const struct {
+    char *ext;
+    char *type;
+} mimes[] = {
+    { "xml",   "application/xml; charset=utf-8" },
+    { "xhtml", "application/xhtml+xml; charset=utf-8" },
+    { "html",  "text/html; charset=utf-8" },
+    { "htm",   "text/html; charset=utf-8" },
+    { "css",   "text/css; charset=utf-8" },
+    { "txt",   "text/plain; charset=utf-8" },
+    { "vtt",   "text/plain; charset=utf-8" },
+    { "md",    "text/plain; charset=utf-8" },
+    { "c",     "text/plain; charset=utf-8" },
+    { "h",     "text/plain; charset=utf-8" },
+    { "log",   "text/plain; charset=utf-8" },
+    { "py",    "text/plain; charset=utf-8" },
+    { "gz",    "application/x-gtar" },
+    { "tar",   "application/tar" },
+    { "pdf",   "application/pdf" },
+    { "png",   "image/png" },
+    { "gif",   "image/gif" },
+    { "jpeg",  "image/jpg" },
+    { "jpg",   "image/jpg" },
+    { "iso",   "application/x-iso9660-image" },
+    { "webp",  "image/webp" },
+    { "svg",   "image/svg+xml; charset=utf-8" },
+    { "flac",  "audio/flac" },
+    { "mp3",   "audio/mpeg" },
+    { "ogg",   "audio/ogg" },
+    { "mp4",   "video/mp4" },
+    { "ogv",   "video/ogg" },
+    { "webm",  "video/webm" },
+};
\ No newline at end of file
@@ -2,7 +2,24 @@
 
 VERSION = 0.1
 
-CPPFLAGS = -DVERSION=\"$(VERSION)\" -D_FILE_OFFSET_BITS=64 -D_GNU_SOURCE
-CFLAGS   = -std=c99 -pedantic -Wall -Wno-deprecated-declarations -Wextra -Os ${CPPFLAGS} -g -ggdb -O3
+# TLS, comment out to build without OpenSSL
+TLSSRC      = tls.c
+TLSCPPFLAGS = -DUSE_TLS
+TLSLIBS     = -lssl -lcrypto
+
+# Static linking, comment in for builds without TLS. Static libcrypto calls
+# dlopen and gethostbyname, which need glibc's shared libraries at runtime
+# all the same, so with TLS the binaries are linked dynamically.
+#STATIC      = -static
+
+# USDT probes, comment out to build without them
+TRACECPPFLAGS = -DUSE_TRACE
+
+CPPFLAGS = -DVERSION=\"$(VERSION)\" -D_FILE_OFFSET_BITS=64 -D_GNU_SOURCE ${TLSCPPFLAGS} ${TRACECPPFLAGS}
+# profile feedback and LTO flags, set by make pgo
+PGOFLAGS =
+
+CFLAGS   = -std=c99 -pedantic -Wall -Wno-deprecated-declarations -Wextra -Os ${CPPFLAGS} -g -ggdb -O3 ${PGOFLAGS}
+LIBS     = ${TLSLIBS} -lpthread
 
 CC       = gcc
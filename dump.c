@@ -0,0 +1,209 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <err.h>
+
+#include "dump.h"
+#include "stats.h"
+#include "utils.h"
+#include "config.h"
+
+
+/* SIGUSR1 bumps the requested generation and wakes every worker through
+ * the eventfd they all watch. Each worker writes its own snapshot as a
+ * line of JSON at the end of its loop turn, where no step is running, and
+ * lists at most DUMP_MAX_CONNECTIONS connections so the loop is not held
+ * up for long. The counters are shared, the first worker adds them to its
+ * line.
+ */
+
+static const char *const step_names[] = {
+    [S_HANDSHAKE] = "handshake",
+    [S_READ]      = "read",
+    [S_WRITE]     = "write",
+    [S_SENDFILE]  = "sendfile",
+    [S_H2]        = "h2",
+    [S_PROXY]     = "proxy",
+    [S_FILE]      = "file",
+    [S_UPLOAD]    = "upload",
+    [S_APP]       = "app",
+};
+
+
+static int dump_fd = -1, out_fd = STDERR_FILENO;
+static unsigned long requested = 0;
+static int workers_registered = 0;
+
+static __thread int worker_id;
+static __thread unsigned long dumped = 0;
+
+
+void
+init_dump(const char *path)
+{
+    if (path &&
+        (out_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600)) < 0)
+    {
+        err(1, "open(%s)", path);
+    }
+
+    if ((dump_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        err(1, "eventfd()");
+    }
+}
+
+
+int
+init_dump_worker(void)
+{
+    worker_id = __atomic_fetch_add(&workers_registered, 1, __ATOMIC_RELAXED);
+    dumped = __atomic_load_n(&requested, __ATOMIC_RELAXED);
+
+    return dump_fd;
+}
+
+
+/* Called from the signal handler */
+void
+dump_request(void)
+{
+    int saved_errno = errno;
+    uint64_t one = 1;
+
+    __atomic_add_fetch(&requested, 1, __ATOMIC_RELAXED);
+    if (write(dump_fd, &one, sizeof(one)) < 0) {
+        /* the counter is full, the workers are woken up regardless */
+    }
+    errno = saved_errno;
+}
+
+
+int
+dump_pending(void)
+{
+    return dumped != __atomic_load_n(&requested, __ATOMIC_RELAXED);
+}
+
+
+/* Bytes a step has left to send, -1 when it does not say */
+static long long
+step_remaining(const struct io_step *step)
+{
+    const struct send_meta *send;
+    const struct sendfile_meta *file;
+
+    switch (step->type) {
+    case S_WRITE:
+        send = step->meta;
+        return send->size - send->offset;
+    case S_SENDFILE:
+        file = step->meta;
+        return file->end_offset - file->start_offset;
+    default:
+        return -1;
+    }
+}
+
+
+static void
+dump_connection(FILE *f, const struct connection *conn, time_t now)
+{
+    long long remaining;
+    char addr[ADDR_STR_SIZE];
+    const struct io_step *step;
+
+    fprintf(f, "{\"fd\":%d,\"peer\":\"%s\",\"tls\":%s,\"status\":\"%s\","
+            "\"age\":%ld,\"idle\":%ld,\"served\":%d,\"queued\":%s,\"parked\":%s,"
+            "\"steps\":[",
+            conn->fd, format_addr(&conn->addr, addr), conn->tls ? "true" : "false",
+            conn->status == C_RUN ? "run" : "close",
+            (long)(now - conn->accepted), (long)(now - conn->last_active),
+            conn->served, conn->queued ? "true" : "false",
+            conn->parked ? "true" : "false");
+
+    for (step = conn->steps; step; step = step->next) {
+        fprintf(f, "%s{\"type\":\"%s\"", step == conn->steps ? "" : ",",
+                step_names[step->type]);
+        if ((remaining = step_remaining(step)) >= 0) {
+            fprintf(f, ",\"remaining\":%lld", remaining);
+        }
+        /* a partial request waiting for the rest */
+        if (step->type == S_READ && step->meta) {
+            fprintf(f, ",\"buffered\":%zu", ((struct read_meta *)step->meta)->size);
+        }
+        if (step->type == S_SENDFILE) {
+            fprintf(f, ",\"offset\":%lld",
+                    (long long)((struct sendfile_meta *)step->meta)->start_offset);
+        }
+        fputc('}', f);
+    }
+
+    fputs("]}", f);
+}
+
+
+void
+dump_worker(const struct connection *connections, time_t now)
+{
+    int i, count = 0, listed = 0;
+    char *buf = NULL;
+    size_t size = 0, offset;
+    ssize_t len;
+    FILE *f;
+    const struct connection *conn;
+
+    dumped = __atomic_load_n(&requested, __ATOMIC_RELAXED);
+
+    if (!(f = open_memstream(&buf, &size))) {
+        warn("open_memstream()");
+        return;
+    }
+
+    fprintf(f, "{\"dump\":%lu,\"worker\":%d,\"time\":%ld,\"list\":[",
+            dumped, worker_id, (long)now);
+    for (conn = connections; conn; conn = conn->next) {
+        count++;
+        if (listed == DUMP_MAX_CONNECTIONS) {
+            continue;
+        }
+        if (listed++) {
+            fputc(',', f);
+        }
+        dump_connection(f, conn, now);
+    }
+    fprintf(f, "],\"connections\":%d,\"truncated\":%d", count, count - listed);
+
+    if (!worker_id) {
+        fputs(",\"stats\":{", f);
+        for (i = 0; i < STATS_COUNT; i++) {
+            fprintf(f, "%s\"%s\":%ld", i ? "," : "", stat_names[i].name,
+                    stats_get(i));
+        }
+        fputc('}', f);
+    }
+    fputs("}\n", f);
+
+    if (fclose(f)) {
+        warn("fclose()");
+        free(buf);
+        return;
+    }
+
+    /* O_APPEND keeps the lines of the workers from interleaving */
+    for (offset = 0; offset < size; offset += len) {
+        if ((len = write(out_fd, buf + offset, size - offset)) < 0) {
+            if (errno == EINTR) {
+                len = 0;
+                continue;
+            }
+            warn("write()");
+            break;
+        }
+    }
+
+    free(buf);
+}
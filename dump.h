@@ -0,0 +1,16 @@
+#ifndef DUMP_H
+#define DUMP_H
+
+#include <time.h>
+
+#include "io.h"
+
+
+void init_dump(const char *path);
+int init_dump_worker(void);
+
+void dump_request(void);
+int dump_pending(void);
+void dump_worker(const struct connection *connections, time_t now);
+
+#endif
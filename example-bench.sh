@@ -0,0 +1,56 @@
+#!/bin/sh
+# Compares a JSON endpoint answered in-process by rockepoll-example with the
+# same endpoint reached through a rockepoll proxy route in front of it.
+# Run through make example-bench; BENCH_PORT, BENCH_REQUESTS and
+# BENCH_CONNECTIONS tune it.
+
+set -e
+
+PORT=${BENCH_PORT:-7997}
+PROXY_PORT=$((PORT + 1))
+REQUESTS=${BENCH_REQUESTS:-100000}
+CONNECTIONS=${BENCH_CONNECTIONS:-8}
+
+work=$(mktemp -d)
+pids=
+trap 'kill $pids 2> /dev/null; rm -rf "$work"' EXIT INT TERM
+
+mkdir -p "$work/site"
+
+# wait until something answers on port $1
+wait_port() {
+    tries=50
+    until ./rockepoll-load "$1" 1 1 > /dev/null 2>&1; do
+        tries=$((tries - 1))
+        if [ "$tries" -eq 0 ]; then
+            echo "nothing came up on port $1" >&2
+            exit 1
+        fi
+        sleep 0.1
+    done
+}
+
+# puts $REQUESTS requests for $2 through port $1, prints requests per second
+run() {
+    echo "[Sun, 18/Oct/2026 00:00:00 GMT] 127.0.0.1 \"GET $2 HTTP/1.1\" 200 0 \"-\"" \
+        > "$work/load.log"
+    ./rockepoll-load "$1" "$REQUESTS" "$CONNECTIONS" --replay "$work/load.log" \
+        2> /dev/null | awk '
+        /^requests_per_second / { rps = $2 }
+        /^latency_p99_us / { p99 = $2 }
+        END { printf "%s requests/s, p99 %s us\n", rps, p99 }'
+}
+
+./rockepoll-example "$work/site" --port "$PORT" --quiet --keep-alive \
+    --threads 2 > /dev/null 2>&1 &
+pids="$pids $!"
+./rockepoll "$work/site" --port "$PROXY_PORT" --quiet --keep-alive --threads 2 \
+    --proxy "/api/=127.0.0.1:$PORT" > /dev/null 2>&1 &
+pids="$pids $!"
+
+wait_port "$PORT"
+wait_port "$PROXY_PORT"
+
+echo "in-process /api/hello:  $(run "$PORT" /api/hello)"
+echo "in-process /api/later:  $(run "$PORT" /api/later)"
+echo "proxied /api/hello:     $(run "$PROXY_PORT" /api/hello)"
@@ -0,0 +1,93 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <err.h>
+#include <pthread.h>
+
+#include "rockepoll.h"
+#include "utils.h"
+
+
+/* rockepoll with two JSON endpoints next to the static files. /api/hello
+ * answers right in the worker, /api/later is answered by another thread,
+ * the way a handler waiting on a database or a queue would do it.
+ */
+
+#define JOBS_SIZE 1024
+
+
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+static struct rockepoll_pending *jobs[JOBS_SIZE];
+static size_t jobs_head = 0, jobs_tail = 0;
+
+
+static int
+hello(struct connection *conn, struct http_request *req, void *arg UNUSED)
+{
+    char body[128];
+    int size;
+
+    size = snprintf(body, sizeof(body), "{\"hello\":\"world\",\"time\":%ld}\n",
+                    (long)time(NULL));
+    rockepoll_respond(conn, req, S_OK, "application/json", body, size);
+
+    return 0;
+}
+
+
+static int
+later(struct connection *conn, struct http_request *req, void *arg UNUSED)
+{
+    pthread_mutex_lock(&jobs_lock);
+    if (jobs_tail - jobs_head == JOBS_SIZE) {
+        pthread_mutex_unlock(&jobs_lock);
+        return S_INTERNAL_ERROR;
+    }
+    jobs[jobs_tail++ % JOBS_SIZE] = rockepoll_defer(conn, req);
+    pthread_cond_signal(&jobs_cond);
+    pthread_mutex_unlock(&jobs_lock);
+
+    return 0;
+}
+
+
+static void *
+run_jobs(void *arg UNUSED)
+{
+    char body[128];
+    int size;
+    unsigned long answered = 0;
+    struct rockepoll_pending *pending;
+
+    for (;;) {
+        pthread_mutex_lock(&jobs_lock);
+        while (jobs_head == jobs_tail) {
+            pthread_cond_wait(&jobs_cond, &jobs_lock);
+        }
+        pending = jobs[jobs_head++ % JOBS_SIZE];
+        pthread_mutex_unlock(&jobs_lock);
+
+        size = snprintf(body, sizeof(body), "{\"answered\":%lu}\n", ++answered);
+        rockepoll_complete(pending, S_OK, "application/json", body, size);
+    }
+
+    return NULL;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    pthread_t tid;
+
+    rockepoll_route("/api/hello", hello, NULL);
+    rockepoll_route("/api/later", later, NULL);
+
+    if ((errno = pthread_create(&tid, NULL, run_jobs, NULL))) {
+        err(1, "pthread_create()");
+    }
+
+    return rockepoll_main(argc, argv);
+}
@@ -0,0 +1,354 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <err.h>
+
+#include "fileio.h"
+#include "completion.h"
+#include "admission.h"
+#include "stats.h"
+#include "utils.h"
+#include "utlist.h"
+#include "config.h"
+
+
+/* Lookups that would block the event loop are done here. Everything that
+ * asks for the same path while a lookup is in flight waits for that one,
+ * each waiter gets its own fd back, small files are read once and shared.
+ */
+
+struct file_job {
+    enum file_status status;
+    struct file_meta file;
+    char *body;
+    int refs, done;
+    uint32_t hash;
+    const struct vhost *host;
+    struct file_waiter *waiters;
+    struct file_job *next;
+    struct file_job *hash_next;
+    char target[];
+};
+
+
+/* done comes first, a completion of the queue is its waiter */
+struct file_waiter {
+    struct completion done;
+    enum file_status status;
+    struct file_meta file;
+    void *arg;
+    struct file_job *job;
+    struct file_waiter *next;
+};
+
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+static int pool_threads = 0;
+static size_t queued = 0;
+static struct file_job *queue_head = NULL, *queue_tail = NULL;
+static struct file_job *in_flight[FILEIO_SLOTS];
+
+static __thread struct completion_queue *worker = NULL;
+
+
+static uint32_t
+hash_target(const struct vhost *host, const char *target)
+{
+    return hash_string(hash_bytes(HASH_INIT, &host, sizeof(host)), target);
+}
+
+
+/* under the lock, the last waiter frees a finished job */
+static void
+put_job(struct file_job *job)
+{
+    if (--job->refs || !job->done) {
+        return;
+    }
+
+    free(job->body);
+    free(job);
+}
+
+
+static void
+free_waiter(struct file_waiter *waiter)
+{
+    if (waiter->done.state != CP_WAITING && waiter->status == F_EXISTS) {
+        release_file(&waiter->file);
+    }
+
+    pthread_mutex_lock(&lock);
+    put_job(waiter->job);
+    pthread_mutex_unlock(&lock);
+
+    free(waiter);
+    mem_release(sizeof(struct file_waiter));
+}
+
+
+/* the whole body of a small file is read here, so the worker does not
+ * have to touch the disk for it
+ */
+static void
+read_body(struct file_job *job)
+{
+    ssize_t len;
+    size_t size = 0;
+
+    job->body = xmalloc(job->file.size + 1);
+    while (size < job->file.size) {
+        len = pread(job->file.fd, job->body + size, job->file.size - size, size);
+        if (len <= 0) {
+            if (len < 0 && errno == EINTR) {
+                continue;
+            }
+            free(job->body);
+            job->body = NULL;
+            return;
+        }
+        size += len;
+    }
+
+    close(job->file.fd);
+    job->file.fd = -1;
+    job->file.data = job->body;
+}
+
+
+static void
+finish_job(struct file_job *job)
+{
+    struct file_job **link;
+    struct file_waiter *waiter, *tmp_waiter;
+
+    pthread_mutex_lock(&lock);
+
+    for (link = &in_flight[job->hash & (FILEIO_SLOTS - 1)]; *link != job;
+         link = &(*link)->hash_next) ;
+    *link = job->hash_next;
+
+    LL_FOREACH_SAFE(job->waiters, waiter, tmp_waiter) {
+        waiter->status = job->status;
+        waiter->file = job->file;
+        if (job->status == F_EXISTS && !job->file.data &&
+            (waiter->file.fd = dup(job->file.fd)) < 0)
+        {
+            waiter->status = F_INTERNAL_ERROR;
+        }
+
+        if (!completion_done(&waiter->done)) {
+            /* the connection is gone, fileio_release left it to us */
+            if (waiter->status == F_EXISTS) {
+                release_file(&waiter->file);
+            }
+            put_job(job);
+            free(waiter);
+            mem_release(sizeof(struct file_waiter));
+        }
+    }
+    job->waiters = NULL;
+
+    if (job->status == F_EXISTS && !job->file.data) {
+        close(job->file.fd);
+    }
+
+    job->done = 1;
+    job->refs++;
+    put_job(job);
+
+    pthread_mutex_unlock(&lock);
+}
+
+
+static void *
+run_fileio(void *arg UNUSED)
+{
+    struct file_job *job;
+
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        while (!queue_head) {
+            pthread_cond_wait(&queue_cond, &lock);
+        }
+        job = queue_head;
+        LL_DELETE(queue_head, job);
+        if (!queue_head) {
+            queue_tail = NULL;
+        }
+        queued--;
+        pthread_mutex_unlock(&lock);
+
+        job->status = gather_file_meta(job->host, job->target, &job->file, 0);
+        if (job->status == F_EXISTS && !job->file.data &&
+            job->file.size < SENDFILE_MIN_SIZE)
+        {
+            read_body(job);
+        }
+
+        finish_job(job);
+    }
+
+    return NULL;
+}
+
+
+void
+init_fileio(int threads)
+{
+    int i;
+    pthread_t tid;
+
+    for (i = 0; i < threads; i++) {
+        if ((errno = pthread_create(&tid, NULL, &run_fileio, NULL))) {
+            err(1, "pthread_create()");
+        }
+        pthread_detach(tid);
+    }
+
+    pool_threads = threads;
+}
+
+
+/* returns the eventfd the worker's loop waits on, -1 without a pool */
+int
+init_fileio_worker(void)
+{
+    if (!pool_threads) {
+        return -1;
+    }
+
+    worker = completion_queue_new();
+
+    return worker->fd;
+}
+
+
+/* NULL when the caller has to do the lookup itself, the pool is off or
+ * its queue is full
+ */
+struct file_waiter *
+fileio_submit(const struct vhost *host, const char *target,
+              struct connection *conn, void *arg)
+{
+    size_t size;
+    uint32_t hash;
+    struct file_job *job;
+    struct file_waiter *waiter;
+
+    if (!worker) {
+        return NULL;
+    }
+
+    hash = hash_target(host, target);
+
+    pthread_mutex_lock(&lock);
+
+    for (job = in_flight[hash & (FILEIO_SLOTS - 1)]; job; job = job->hash_next) {
+        if (job->hash == hash && job->host == host && !strcmp(job->target, target)) {
+            break;
+        }
+    }
+
+    if (job) {
+        stats_inc(ST_FILEIO_COALESCED);
+    } else if (queued >= FILEIO_QUEUE_SIZE) {
+        pthread_mutex_unlock(&lock);
+        stats_inc(ST_FILEIO_INLINE);
+        return NULL;
+    } else {
+        size = strlen(target) + 1;
+        job = xmalloc(sizeof(struct file_job) + size);
+        memcpy(job->target, target, size);
+        job->hash = hash;
+        job->host = host;
+        job->body = NULL;
+        job->refs = job->done = 0;
+        job->waiters = NULL;
+        job->next = NULL;
+        job->hash_next = in_flight[hash & (FILEIO_SLOTS - 1)];
+        in_flight[hash & (FILEIO_SLOTS - 1)] = job;
+
+        if (queue_tail) {
+            queue_tail->next = job;
+        } else {
+            queue_head = job;
+        }
+        queue_tail = job;
+        queued++;
+        pthread_cond_signal(&queue_cond);
+        stats_inc(ST_FILEIO_JOBS);
+    }
+
+    waiter = xmalloc(sizeof(struct file_waiter));
+    mem_charge(sizeof(struct file_waiter));
+    completion_init(&waiter->done, worker, conn);
+    waiter->arg = arg;
+    waiter->job = job;
+    waiter->next = job->waiters;
+    job->waiters = waiter;
+    job->refs++;
+
+    pthread_mutex_unlock(&lock);
+
+    return waiter;
+}
+
+
+/* Called until it returns NULL after the eventfd fired */
+struct connection *
+fileio_next_done(void)
+{
+    struct completion *c;
+
+    while ((c = completion_next(worker))) {
+        if (!c->conn) {
+            free_waiter((struct file_waiter *)c);
+            continue;
+        }
+        return c->conn;
+    }
+
+    return NULL;
+}
+
+
+int
+fileio_ready(const struct file_waiter *waiter)
+{
+    return waiter->done.state == CP_RECEIVED;
+}
+
+
+void *
+fileio_arg(const struct file_waiter *waiter)
+{
+    return waiter->arg;
+}
+
+
+/* the file goes over to the caller, data stays valid until the release */
+enum file_status
+fileio_result(struct file_waiter *waiter, struct file_meta *file)
+{
+    enum file_status status = waiter->status;
+
+    *file = waiter->file;
+    waiter->status = F_NOT_FOUND;
+
+    return status;
+}
+
+
+void
+fileio_release(struct file_waiter *waiter)
+{
+    if (completion_release(&waiter->done)) {
+        free_waiter(waiter);
+    }
+}
@@ -0,0 +1,22 @@
+#ifndef FILEIO_H
+#define FILEIO_H
+
+#include "io.h"
+#include "handler.h"
+
+
+struct file_waiter;
+
+
+void init_fileio(int threads);
+int init_fileio_worker(void);
+
+struct file_waiter *fileio_submit(const struct vhost *host, const char *target,
+                                  struct connection *conn, void *arg);
+struct connection *fileio_next_done(void);
+int fileio_ready(const struct file_waiter *waiter);
+void *fileio_arg(const struct file_waiter *waiter);
+enum file_status fileio_result(struct file_waiter *waiter, struct file_meta *file);
+void fileio_release(struct file_waiter *waiter);
+
+#endif
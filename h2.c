@@ -0,0 +1,1091 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "h2.h"
+#include "hpack.h"
+#include "handler.h"
+#include "admission.h"
+#include "utils.h"
+#include "utlist.h"
+#include "cache.h"
+#include "proxy.h"
+#include "app.h"
+#include "fileio.h"
+#include "config.h"
+
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_SIZE (sizeof(H2_PREFACE) - 1)
+#define H2_FRAME_HEADER_SIZE 9
+#define H2_MAX_FRAME_SIZE 16384
+#define H2_MAX_WINDOW 0x7fffffff
+#define H2_DEFAULT_WINDOW 65535
+#define H2_HEADER_BLOCK_SIZE MAX_REQ_SIZE
+#define H2_HEADERS_SIZE 512
+#define H2_OUT_BACKLOG 1024 * 64
+
+
+enum h2_frame_type {
+    FR_DATA, FR_HEADERS, FR_PRIORITY, FR_RST_STREAM, FR_SETTINGS,
+    FR_PUSH_PROMISE, FR_PING, FR_GOAWAY, FR_WINDOW_UPDATE, FR_CONTINUATION,
+};
+
+enum h2_frame_flag {
+    FL_END_STREAM  = 0x01,
+    FL_ACK         = 0x01,
+    FL_END_HEADERS = 0x04,
+    FL_PADDED      = 0x08,
+    FL_PRIORITY    = 0x20,
+};
+
+enum h2_error {
+    E_NO_ERROR        = 0x0,
+    E_PROTOCOL        = 0x1,
+    E_FLOW_CONTROL    = 0x3,
+    E_FRAME_SIZE      = 0x6,
+    E_REFUSED_STREAM  = 0x7,
+    E_COMPRESSION     = 0x9,
+};
+
+enum h2_setting {
+    SET_HEADER_TABLE_SIZE      = 0x1,
+    SET_MAX_CONCURRENT_STREAMS = 0x3,
+    SET_INITIAL_WINDOW_SIZE    = 0x4,
+    SET_MAX_FRAME_SIZE         = 0x5,
+};
+
+
+struct h2_stream {
+    uint32_t id;
+    long window;
+    int fd, shared_fd, reset;
+    char *data;
+    off_t offset;
+    size_t remaining;
+    struct h2_stream *next;
+    struct h2_stream *prev;
+};
+
+
+/* A stream whose file the I/O pool looks up, the request is copied
+ * behind it
+ */
+struct h2_lookup {
+    uint32_t id;
+    int reset;
+    size_t size;
+    struct file_waiter *waiter;
+    struct http_request req;
+    struct h2_lookup *next;
+};
+
+
+struct h2_session {
+    struct hpack_table hpack;
+
+    /* partially received frame */
+    unsigned char in[H2_FRAME_HEADER_SIZE + H2_MAX_FRAME_SIZE];
+    size_t in_size, preface_left;
+
+    /* control and HEADERS frames waiting to be sent */
+    unsigned char *out;
+    size_t out_size, out_offset, out_capacity;
+
+    /* header block split into CONTINUATION frames */
+    unsigned char block[H2_HEADER_BLOCK_SIZE];
+    size_t block_size;
+    uint32_t block_stream;
+    int block_flags;
+
+    /* DATA frame being sent, it's never interleaved with anything */
+    struct h2_stream *current;
+    unsigned char current_header[H2_FRAME_HEADER_SIZE];
+    size_t current_header_left, current_left;
+
+    long window, peer_initial_window;
+    size_t peer_max_frame;
+    uint32_t last_stream_id;
+    int streams_count, closing;
+    struct h2_stream *streams;
+    struct h2_lookup *lookups;
+};
+
+
+struct h2_request {
+    struct http_request req;
+    char *path;
+    int has_method;
+};
+
+
+void
+init_h2(void)
+{
+    init_hpack();
+}
+
+
+int
+is_h2_preface(const char *data, size_t size)
+{
+    return size >= H2_PREFACE_SIZE && !memcmp(data, H2_PREFACE, H2_PREFACE_SIZE);
+}
+
+
+/* the first bytes of a preface that is still being received */
+int
+is_h2_preface_start(const char *data, size_t size)
+{
+    return size < H2_PREFACE_SIZE && !memcmp(data, H2_PREFACE, size);
+}
+
+
+static inline uint32_t
+read_u32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+
+static inline void
+write_frame_header(unsigned char *p, size_t size, int type, int flags,
+                   uint32_t stream_id)
+{
+    p[0] = size >> 16;
+    p[1] = size >> 8;
+    p[2] = size;
+    p[3] = type;
+    p[4] = flags;
+    p[5] = stream_id >> 24 & 0x7f;
+    p[6] = stream_id >> 16;
+    p[7] = stream_id >> 8;
+    p[8] = stream_id;
+}
+
+
+static void
+queue_frame(struct h2_session *s, int type, int flags, uint32_t stream_id,
+            const void *payload, size_t size)
+{
+    if (s->out_offset == s->out_size) {
+        s->out_offset = s->out_size = 0;
+    }
+
+    if (s->out_size + H2_FRAME_HEADER_SIZE + size > s->out_capacity) {
+        s->out_capacity = MAX(s->out_capacity * 2,
+                              s->out_size + H2_FRAME_HEADER_SIZE + size);
+        s->out = xrealloc(s->out, s->out_capacity);
+    }
+
+    write_frame_header(s->out + s->out_size, size, type, flags, stream_id);
+    s->out_size += H2_FRAME_HEADER_SIZE;
+
+    if (size) {
+        memcpy(s->out + s->out_size, payload, size);
+        s->out_size += size;
+    }
+}
+
+
+static void
+queue_u32_frame(struct h2_session *s, int type, uint32_t stream_id, uint32_t value)
+{
+    unsigned char payload[4];
+
+    payload[0] = value >> 24;
+    payload[1] = value >> 16;
+    payload[2] = value >> 8;
+    payload[3] = value;
+
+    queue_frame(s, type, 0, stream_id, payload, sizeof(payload));
+}
+
+
+static void
+free_stream(struct h2_session *s, struct h2_stream *stream)
+{
+    DL_DELETE(s->streams, stream);
+    if (stream->fd >= 0 && !stream->shared_fd) {
+        close(stream->fd);
+    }
+    free(stream->data);
+    free(stream);
+    s->streams_count--;
+}
+
+
+static struct h2_stream *
+find_stream(struct h2_session *s, uint32_t id)
+{
+    struct h2_stream *stream, *tmp;
+
+    DL_FOREACH_SAFE(s->streams, stream, tmp) {
+        if (stream->id == id) {
+            return stream;
+        }
+    }
+
+    return NULL;
+}
+
+
+static void
+connection_error(struct h2_session *s, enum h2_error error)
+{
+    unsigned char payload[8];
+    struct h2_stream *stream, *tmp;
+
+    payload[0] = s->last_stream_id >> 24;
+    payload[1] = s->last_stream_id >> 16;
+    payload[2] = s->last_stream_id >> 8;
+    payload[3] = s->last_stream_id;
+    payload[4] = payload[5] = payload[6] = 0;
+    payload[7] = error;
+
+    DL_FOREACH_SAFE(s->streams, stream, tmp) {
+        if (stream != s->current) {
+            free_stream(s, stream);
+        } else {
+            stream->reset = 1;
+        }
+    }
+
+    queue_frame(s, FR_GOAWAY, 0, 0, payload, sizeof(payload));
+    s->closing = 1;
+}
+
+
+static int
+apply_settings(struct h2_session *s, const unsigned char *p, size_t size)
+{
+    long delta;
+    uint32_t value;
+    struct h2_stream *stream, *tmp;
+
+    for (; size >= 6; p += 6, size -= 6) {
+        value = read_u32(p + 2);
+
+        switch (p[0] << 8 | p[1]) {
+        case SET_INITIAL_WINDOW_SIZE:
+            if (value > H2_MAX_WINDOW) {
+                return E_FLOW_CONTROL;
+            }
+            delta = (long)value - s->peer_initial_window;
+            s->peer_initial_window = value;
+            DL_FOREACH_SAFE(s->streams, stream, tmp) {
+                stream->window += delta;
+            }
+            break;
+        case SET_MAX_FRAME_SIZE:
+            if (value < H2_MAX_FRAME_SIZE || value > 0xffffff) {
+                return E_PROTOCOL;
+            }
+            s->peer_max_frame = value;
+            break;
+        default:
+            /* the decoder table size is the one we advertise */
+            break;
+        }
+    }
+
+    return size ? E_FRAME_SIZE : E_NO_ERROR;
+}
+
+
+static void
+collect_header(void *ctx, const char *name, const char *value)
+{
+    int i;
+    struct h2_request *r = ctx;
+
+    if (*name == ':') {
+        if (!strcmp(name, ":method")) {
+            for (i = M_GET; i < HTTP_METHODS_COUNT; i++) {
+                if (!strcmp(value, http_methods[i].name)) {
+                    r->req.method = i;
+                    r->has_method = 1;
+                    break;
+                }
+            }
+        } else if (!strcmp(name, ":path")) {
+            r->path = (char *)value;
+        } else if (!strcmp(name, ":authority")) {
+            r->req.headers[H_HOST] = (char *)value;
+        }
+        return;
+    }
+
+    for (i = 0; i < HEADERS_COUNT; i++) {
+        if (!strcasecmp(name, http_headers[i].name)) {
+            r->req.headers[i] = (char *)value;
+            break;
+        }
+    }
+}
+
+
+/* Returns 0 when the body of a small file is not in the page cache and
+ * nowait is set, the file is released then and the stream has to wait for
+ * the I/O pool.
+ */
+static int
+send_response(struct h2_session *s, struct connection *conn,
+              uint32_t stream_id, struct http_request *req,
+              enum http_status st, struct response *resp, int nowait)
+{
+    char *body = NULL, value[ETAG_SIZE + 64];
+    const char *cache_value;
+    const struct cache_rule *rule;
+    size_t size = 0, value_size, content_length = 0;
+    unsigned char headers[H2_HEADERS_SIZE];
+    struct h2_stream *stream;
+    struct iovec iov;
+    ssize_t len;
+    int fd = -1;
+
+    size += hpack_encode_status(headers + size, st);
+    size += hpack_encode_header(headers + size, HPACK_SERVER, "rockepoll",
+                                sizeof("rockepoll") - 1);
+
+    if (st == S_OK || st == S_PARTIAL_CONTENT) {
+        content_length = resp->content_length;
+
+        size += hpack_encode_header(headers + size, HPACK_ACCEPT_RANGES,
+                                    "bytes", sizeof("bytes") - 1);
+        size += hpack_encode_header(headers + size, HPACK_CONTENT_TYPE,
+                                    resp->file.mime, strlen(resp->file.mime));
+        value_size = sprintf(value, "\"%s\"", resp->file.etag);
+        size += hpack_encode_header(headers + size, HPACK_ETAG, value, value_size);
+
+        value_size = format_http_date(resp->file.mtime, value);
+        size += hpack_encode_header(headers + size, HPACK_LAST_MODIFIED,
+                                    value, value_size);
+        if ((rule = cache_match(req->target, resp->file.mime))) {
+            cache_value = cache_control(rule, &value_size);
+            size += hpack_encode_header(headers + size, HPACK_CACHE_CONTROL,
+                                        cache_value, value_size);
+            if ((cache_value = cache_expires(rule))) {
+                size += hpack_encode_header(headers + size, HPACK_EXPIRES,
+                                            cache_value, strlen(cache_value));
+            }
+        }
+
+        if (st == S_PARTIAL_CONTENT) {
+            value_size = sprintf(value, "bytes %zu-%zu/%zu",
+                                 resp->lower, resp->upper, resp->file.size);
+            size += hpack_encode_header(headers + size, HPACK_CONTENT_RANGE,
+                                        value, value_size);
+        }
+
+        if (req->method == M_HEAD || !content_length) {
+            release_file(&resp->file);
+        } else if (content_length < SENDFILE_MIN_SIZE) {
+            body = xmalloc(content_length);
+            if (resp->file.data) {
+                memcpy(body, resp->file.data + resp->lower, content_length);
+            } else {
+                iov.iov_base = body;
+                iov.iov_len = content_length;
+                len = preadv2(resp->file.fd, &iov, 1, resp->lower,
+                              nowait ? RWF_NOWAIT : 0);
+                if (nowait && (size_t)len != content_length) {
+                    free(body);
+                    release_file(&resp->file);
+                    return 0;
+                }
+                if ((size_t)len != content_length) {
+                    content_length = 0;
+                }
+            }
+            release_file(&resp->file);
+        } else {
+            fd = resp->file.fd;
+        }
+    } else if (st != S_NOT_MODIFIED) {
+        content_length = strlen(http_status_str[st]) + HTTP_STATUS_FORMAT_SIZE;
+        body = xmalloc(content_length + 1);
+        sprintf(body, HTTP_STATUS_FORMAT, http_status_str[st]);
+
+        size += hpack_encode_header(headers + size, HPACK_CONTENT_TYPE,
+                                    INDEX_MIMETYPE, sizeof(INDEX_MIMETYPE) - 1);
+    }
+
+    value_size = sprintf(value, "%zu", content_length);
+    size += hpack_encode_header(headers + size, HPACK_CONTENT_LENGTH,
+                                value, value_size);
+
+    log_new_connection(conn, req, st, content_length);
+
+    if (req->method == M_HEAD || !content_length) {
+        queue_frame(s, FR_HEADERS, FL_END_HEADERS | FL_END_STREAM, stream_id,
+                    headers, size);
+        free(body);
+        return 1;
+    }
+
+    queue_frame(s, FR_HEADERS, FL_END_HEADERS, stream_id, headers, size);
+
+    stream = xmalloc(sizeof(struct h2_stream));
+    stream->id = stream_id;
+    stream->window = s->peer_initial_window;
+    stream->reset = 0;
+    stream->fd = fd;
+    stream->shared_fd = resp->file.data != NULL;
+    stream->data = body;
+    stream->offset = (fd >= 0) ? resp->file.offset + (off_t)resp->lower : 0;
+    stream->remaining = content_length;
+    DL_APPEND(s->streams, stream);
+    s->streams_count++;
+
+    return 1;
+}
+
+
+static void
+free_lookup(struct h2_lookup *lookup)
+{
+    fileio_release(lookup->waiter);
+    mem_release(lookup->size);
+    free(lookup);
+}
+
+
+/* the request is on the stack of handle_header_block, it's copied for the
+ * wait
+ */
+static int
+wait_for_file(struct h2_session *s, struct connection *conn,
+              uint32_t stream_id, const struct http_request *req)
+{
+    int i;
+    char *p;
+    size_t size = sizeof(struct h2_lookup) + strlen(req->target) + 1;
+    struct h2_lookup *lookup;
+
+    for (i = 0; i < HEADERS_COUNT; i++) {
+        if (req->headers[i]) {
+            size += strlen(req->headers[i]) + 1;
+        }
+    }
+
+    lookup = xmalloc(size);
+    lookup->id = stream_id;
+    lookup->reset = 0;
+    lookup->size = size;
+    lookup->req = *req;
+
+    p = (char *)(lookup + 1);
+    lookup->req.target = strcpy(p, req->target);
+    p += strlen(p) + 1;
+    for (i = 0; i < HEADERS_COUNT; i++) {
+        if (req->headers[i]) {
+            lookup->req.headers[i] = strcpy(p, req->headers[i]);
+            p += strlen(p) + 1;
+        }
+    }
+
+    if (!(lookup->waiter = fileio_submit(req->host, lookup->req.target, conn,
+                                         lookup)))
+    {
+        free(lookup);
+        return 0;
+    }
+
+    mem_charge(size);
+    LL_APPEND(s->lookups, lookup);
+    s->streams_count++;
+
+    return 1;
+}
+
+
+/* A lookup, and the body of a small file, that would block the worker are
+ * left to the I/O pool, the stream waits for it as an h1 request does.
+ */
+static void
+respond(struct h2_session *s, struct connection *conn,
+        uint32_t stream_id, struct http_request *req, enum http_status st)
+{
+    struct response resp = {0};
+    enum file_status file_status;
+
+    /* proxy and library routes answer HTTP/1.1 only, their prefixes are
+     * not served from disk over h2 either
+     */
+    if (st == S_OK &&
+        (proxy_match(req->target) >= 0 || app_route(req->target) >= 0))
+    {
+        st = S_MISDIRECTED_REQUEST;
+    }
+    if (st == S_OK) {
+        st = prepare_request(req);
+    }
+    if (st != S_OK) {
+        send_response(s, conn, stream_id, req, st, &resp, 0);
+        return;
+    }
+
+    file_status = gather_file_meta(req->host, req->target, &resp.file, 1);
+    if (file_status != F_AGAIN &&
+        send_response(s, conn, stream_id, req,
+                      prepare_response(req, file_status, &resp), &resp, 1))
+    {
+        return;
+    }
+
+    if (wait_for_file(s, conn, stream_id, req)) {
+        return;
+    }
+
+    /* the pool is off or its queue is full */
+    memset(&resp, 0, sizeof(resp));
+    file_status = gather_file_meta(req->host, req->target, &resp.file, 0);
+    send_response(s, conn, stream_id, req,
+                  prepare_response(req, file_status, &resp), &resp, 0);
+}
+
+
+/* streams whose file the I/O pool is done with get their response */
+static void
+finish_lookups(struct h2_session *s, struct connection *conn)
+{
+    struct response resp;
+    enum file_status file_status;
+    struct h2_lookup *lookup, *tmp;
+
+    LL_FOREACH_SAFE(s->lookups, lookup, tmp) {
+        if (!fileio_ready(lookup->waiter)) {
+            continue;
+        }
+
+        LL_DELETE(s->lookups, lookup);
+        s->streams_count--;
+
+        memset(&resp, 0, sizeof(resp));
+        file_status = fileio_result(lookup->waiter, &resp.file);
+        if (lookup->reset) {
+            if (file_status == F_EXISTS) {
+                release_file(&resp.file);
+            }
+        } else {
+            send_response(s, conn, lookup->id, &lookup->req,
+                          prepare_response(&lookup->req, file_status, &resp),
+                          &resp, 0);
+        }
+        free_lookup(lookup);
+    }
+}
+
+
+static void
+handle_header_block(struct h2_session *s, struct connection *conn)
+{
+    char buf[H2_HEADER_BLOCK_SIZE * 2];
+    struct h2_request r = {0};
+    uint32_t id = s->block_stream;
+
+    if (hpack_decode(&s->hpack, s->block, s->block_size, buf, sizeof(buf),
+                     collect_header, &r))
+    {
+        connection_error(s, E_COMPRESSION);
+        return;
+    }
+
+    /* trailers and other blocks on known streams only keep HPACK in sync */
+    if (id <= s->last_stream_id) {
+        return;
+    }
+    s->last_stream_id = id;
+
+    if (!r.has_method || !r.path) {
+        queue_u32_frame(s, FR_RST_STREAM, id, E_PROTOCOL);
+        return;
+    }
+
+    if (s->streams_count >= H2_MAX_CONCURRENT_STREAMS) {
+        queue_u32_frame(s, FR_RST_STREAM, id, E_REFUSED_STREAM);
+        return;
+    }
+
+    r.req.version = V20;
+    /* the same limit as a request line, the handlers size buffers by it */
+    if (*r.path != '/' || strlen(r.path) >= MAX_TARGET_SIZE ||
+        parse_target(r.path, &r.req))
+    {
+        respond(s, conn, id, &r.req, S_BAD_REQUEST);
+        return;
+    }
+
+    respond(s, conn, id, &r.req, S_OK);
+}
+
+
+static void
+handle_frame(struct h2_session *s, struct connection *conn,
+             int type, int flags, uint32_t id,
+             const unsigned char *p, size_t size)
+{
+    int error;
+    size_t pad = 0;
+    uint32_t increment;
+    struct h2_stream *stream;
+    struct h2_lookup *lookup;
+
+    if (s->block_stream && (type != FR_CONTINUATION || id != s->block_stream)) {
+        connection_error(s, E_PROTOCOL);
+        return;
+    }
+
+    switch (type) {
+    case FR_DATA:
+        if (!id) {
+            connection_error(s, E_PROTOCOL);
+            return;
+        }
+        /* request bodies are not consumed, just give the window back */
+        if (size) {
+            queue_u32_frame(s, FR_WINDOW_UPDATE, 0, size);
+        }
+        break;
+    case FR_HEADERS:
+        if (!id || !(id & 1)) {
+            connection_error(s, E_PROTOCOL);
+            return;
+        }
+        if (flags & FL_PADDED) {
+            if (!size) {
+                connection_error(s, E_PROTOCOL);
+                return;
+            }
+            pad = *p++;
+            size--;
+        }
+        if (flags & FL_PRIORITY) {
+            if (size < 5) {
+                connection_error(s, E_PROTOCOL);
+                return;
+            }
+            p += 5;
+            size -= 5;
+        }
+        if (pad > size) {
+            connection_error(s, E_PROTOCOL);
+            return;
+        }
+        size -= pad;
+
+        s->block_size = 0;
+        s->block_flags = flags;
+        /* fall through */
+    case FR_CONTINUATION:
+        if (!id || (type == FR_CONTINUATION && !s->block_stream)) {
+            connection_error(s, E_PROTOCOL);
+            return;
+        }
+        if (s->block_size + size > sizeof(s->block)) {
+            connection_error(s, E_PROTOCOL);
+            return;
+        }
+        memcpy(s->block + s->block_size, p, size);
+        s->block_size += size;
+        s->block_stream = id;
+
+        if (flags & FL_END_HEADERS) {
+            handle_header_block(s, conn);
+            s->block_stream = 0;
+        }
+        break;
+    case FR_RST_STREAM:
+        if (!id || size != 4) {
+            connection_error(s, id ? E_FRAME_SIZE : E_PROTOCOL);
+            return;
+        }
+        if ((stream = find_stream(s, id))) {
+            if (stream == s->current) {
+                stream->reset = 1;
+            } else {
+                free_stream(s, stream);
+            }
+        }
+        for (lookup = s->lookups; lookup; lookup = lookup->next) {
+            if (lookup->id == id) {
+                lookup->reset = 1;
+            }
+        }
+        break;
+    case FR_SETTINGS:
+        if (id) {
+            connection_error(s, E_PROTOCOL);
+            return;
+        }
+        if (flags & FL_ACK) {
+            break;
+        }
+        if ((error = apply_settings(s, p, size))) {
+            connection_error(s, error);
+            return;
+        }
+        queue_frame(s, FR_SETTINGS, FL_ACK, 0, NULL, 0);
+        break;
+    case FR_PING:
+        if (id || size != 8) {
+            connection_error(s, id ? E_PROTOCOL : E_FRAME_SIZE);
+            return;
+        }
+        if (!(flags & FL_ACK)) {
+            queue_frame(s, FR_PING, FL_ACK, 0, p, size);
+        }
+        break;
+    case FR_GOAWAY:
+        s->closing = 1;
+        break;
+    case FR_WINDOW_UPDATE:
+        if (size != 4) {
+            connection_error(s, E_FRAME_SIZE);
+            return;
+        }
+        increment = read_u32(p) & 0x7fffffff;
+        if (!id) {
+            if (!increment || s->window + increment > H2_MAX_WINDOW) {
+                connection_error(s, increment ? E_FLOW_CONTROL : E_PROTOCOL);
+                return;
+            }
+            s->window += increment;
+        } else if ((stream = find_stream(s, id))) {
+            stream->window += increment;
+        }
+        break;
+    case FR_PUSH_PROMISE:
+        connection_error(s, E_PROTOCOL);
+        break;
+    default:
+        /* PRIORITY and unknown frame types are ignored */
+        break;
+    }
+}
+
+
+static void
+handle_input(struct h2_session *s, struct connection *conn)
+{
+    size_t size, offset = 0;
+    unsigned char *p;
+
+    if (s->preface_left) {
+        size = MIN(s->preface_left, s->in_size);
+        if (memcmp(s->in, H2_PREFACE + H2_PREFACE_SIZE - s->preface_left, size)) {
+            connection_error(s, E_PROTOCOL);
+            return;
+        }
+        s->preface_left -= size;
+        offset = size;
+    }
+
+    while (!s->closing && s->in_size - offset >= H2_FRAME_HEADER_SIZE) {
+        p = s->in + offset;
+        size = p[0] << 16 | p[1] << 8 | p[2];
+
+        if (size > H2_MAX_FRAME_SIZE) {
+            connection_error(s, E_FRAME_SIZE);
+            return;
+        }
+
+        if (s->in_size - offset < H2_FRAME_HEADER_SIZE + size) {
+            break;
+        }
+
+        handle_frame(s, conn, p[3], p[4], read_u32(p + 5) & 0x7fffffff,
+                     p + H2_FRAME_HEADER_SIZE, size);
+        offset += H2_FRAME_HEADER_SIZE + size;
+    }
+
+    memmove(s->in, s->in + offset, s->in_size - offset);
+    s->in_size -= offset;
+}
+
+
+static struct h2_stream *
+next_data_frame(struct h2_session *s)
+{
+    size_t size;
+    struct h2_stream *stream, *tmp;
+
+    /* after an upgrade wait for the client preface (and its SETTINGS) */
+    if (s->window <= 0 || s->preface_left) {
+        return NULL;
+    }
+
+    DL_FOREACH_SAFE(s->streams, stream, tmp) {
+        if (stream->window <= 0) {
+            continue;
+        }
+
+        size = MIN(stream->remaining, s->peer_max_frame);
+        size = MIN(size, (size_t)MIN(stream->window, s->window));
+
+        stream->window -= size;
+        stream->remaining -= size;
+        s->window -= size;
+
+        write_frame_header(s->current_header, size, FR_DATA,
+                           stream->remaining ? 0 : FL_END_STREAM, stream->id);
+        s->current_header_left = H2_FRAME_HEADER_SIZE;
+        s->current_left = size;
+
+        /* round robin: the stream goes behind every other ready one */
+        DL_DELETE(s->streams, stream);
+        DL_APPEND(s->streams, stream);
+
+        return stream;
+    }
+
+    return NULL;
+}
+
+
+static enum io_step_status
+flush_session(struct connection *conn, struct h2_session *s)
+{
+    ssize_t sent;
+    struct h2_stream *stream;
+
+    for (;;) {
+        if (conn->budget <= 0) {
+            return IO_YIELD;
+        }
+
+        if ((stream = s->current)) {
+            if (s->current_header_left) {
+                sent = conn_send(conn,
+                                 s->current_header + H2_FRAME_HEADER_SIZE
+                                 - s->current_header_left,
+                                 s->current_header_left, MSG_MORE);
+                if (sent < 0) {
+                    break;
+                }
+                s->current_header_left -= sent;
+                continue;
+            }
+
+            if (s->current_left) {
+                if (stream->fd >= 0) {
+                    sent = conn_sendfile(conn, stream->fd, &stream->offset,
+                                         MIN(s->current_left, (size_t)conn->budget));
+                } else {
+                    sent = conn_send(conn, stream->data + stream->offset,
+                                     s->current_left, 0);
+                    if (sent > 0) {
+                        stream->offset += sent;
+                    }
+                }
+                if (sent <= 0) {
+                    if (!sent) {
+                        errno = EIO;
+                    }
+                    break;
+                }
+                s->current_left -= sent;
+                continue;
+            }
+
+            s->current = NULL;
+            if (!stream->remaining || stream->reset) {
+                free_stream(s, stream);
+            }
+            continue;
+        }
+
+        if (s->out_offset < s->out_size) {
+            sent = conn_send(conn, s->out + s->out_offset,
+                             s->out_size - s->out_offset, 0);
+            if (sent < 0) {
+                break;
+            }
+            s->out_offset += sent;
+            continue;
+        }
+
+        if (!(s->current = next_data_frame(s))) {
+            return IO_OK;
+        }
+    }
+
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? IO_AGAIN : IO_ERROR;
+}
+
+
+static enum io_step_status
+read_session(struct connection *conn, struct h2_session *s)
+{
+    ssize_t read_size;
+
+    read_size = conn_read(conn, s->in + s->in_size, sizeof(s->in) - s->in_size);
+    if (read_size < 1) {
+        if (read_size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return IO_AGAIN;
+        }
+        return IO_ERROR;
+    }
+
+    s->in_size += read_size;
+    handle_input(s, conn);
+
+    return IO_OK;
+}
+
+
+static int
+decode_base64url(const char *src, unsigned char *dst, size_t dst_size)
+{
+    int value;
+    size_t len = 0;
+    unsigned int acc = 0, bits = 0;
+
+    for (; *src && *src != '='; src++) {
+        if (*src >= 'A' && *src <= 'Z') {
+            value = *src - 'A';
+        } else if (*src >= 'a' && *src <= 'z') {
+            value = *src - 'a' + 26;
+        } else if (*src >= '0' && *src <= '9') {
+            value = *src - '0' + 52;
+        } else if (*src == '-') {
+            value = 62;
+        } else if (*src == '_') {
+            value = 63;
+        } else {
+            return -1;
+        }
+
+        acc = (acc << 6) | value;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (len == dst_size) {
+                return -1;
+            }
+            dst[len++] = acc >> bits;
+        }
+    }
+
+    return len;
+}
+
+
+struct h2_session *
+h2_session_new(struct connection *conn, const char *data, size_t size,
+               struct http_request *upgrade_req)
+{
+    int settings_size;
+    struct h2_session *s;
+    unsigned char settings[6 * 16];
+    static const unsigned char our_settings[] = {
+        0, SET_MAX_CONCURRENT_STREAMS,
+        H2_MAX_CONCURRENT_STREAMS >> 24 & 0xff, H2_MAX_CONCURRENT_STREAMS >> 16 & 0xff,
+        H2_MAX_CONCURRENT_STREAMS >> 8 & 0xff, H2_MAX_CONCURRENT_STREAMS & 0xff,
+    };
+
+    s = xmalloc(sizeof(struct h2_session));
+    mem_charge(sizeof(struct h2_session));
+    hpack_table_init(&s->hpack);
+    s->in_size = 0;
+    s->preface_left = H2_PREFACE_SIZE;
+    s->out = NULL;
+    s->out_size = s->out_offset = s->out_capacity = 0;
+    s->block_size = 0;
+    s->block_stream = 0;
+    s->block_flags = 0;
+    s->current = NULL;
+    s->current_header_left = s->current_left = 0;
+    s->window = s->peer_initial_window = H2_DEFAULT_WINDOW;
+    s->peer_max_frame = H2_MAX_FRAME_SIZE;
+    s->last_stream_id = 0;
+    s->streams_count = 0;
+    s->closing = 0;
+    s->streams = NULL;
+    s->lookups = NULL;
+
+    /* the server connection preface */
+    queue_frame(s, FR_SETTINGS, 0, 0, our_settings, sizeof(our_settings));
+
+    if (upgrade_req) {
+        /* HTTP2-Settings carries the client's SETTINGS payload, and the
+         * request that asked for the upgrade becomes stream 1
+         */
+        settings_size = decode_base64url(upgrade_req->headers[H_HTTP2_SETTINGS],
+                                         settings, sizeof(settings));
+        if (settings_size < 0 || apply_settings(s, settings, settings_size)) {
+            connection_error(s, E_PROTOCOL);
+            return s;
+        }
+
+        s->last_stream_id = 1;
+        respond(s, conn, 1, upgrade_req, S_OK);
+    }
+
+    if (size) {
+        size = MIN(size, sizeof(s->in));
+        memcpy(s->in, data, size);
+        s->in_size = size;
+        handle_input(s, conn);
+    }
+
+    return s;
+}
+
+
+enum io_step_status
+make_h2_step(struct connection *conn, struct h2_session *s)
+{
+    enum io_step_status st;
+
+    for (;;) {
+        if (s->lookups) {
+            finish_lookups(s, conn);
+        }
+
+        st = flush_session(conn, s);
+        if (st == IO_ERROR || st == IO_YIELD) {
+            return st;
+        }
+
+        /* GOAWAY went out (or the peer said goodbye), close once drained */
+        if (s->closing) {
+            return st;
+        }
+
+        if (st == IO_AGAIN && s->out_size - s->out_offset > H2_OUT_BACKLOG) {
+            return IO_AGAIN;
+        }
+
+        if ((st = read_session(conn, s)) != IO_OK) {
+            return st;
+        }
+    }
+}
+
+
+void
+cleanup_h2_session(struct h2_session *s)
+{
+    struct h2_stream *stream, *tmp;
+    struct h2_lookup *lookup, *tmp_lookup;
+
+    DL_FOREACH_SAFE(s->streams, stream, tmp) {
+        free_stream(s, stream);
+    }
+    LL_FOREACH_SAFE(s->lookups, lookup, tmp_lookup) {
+        free_lookup(lookup);
+    }
+
+    hpack_table_cleanup(&s->hpack);
+    free(s->out);
+    free(s);
+    mem_release(sizeof(struct h2_session));
+}
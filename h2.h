@@ -0,0 +1,24 @@
+#ifndef H2_H
+#define H2_H
+
+#include <stddef.h>
+
+#include "io.h"
+#include "parser.h"
+
+
+struct h2_session;
+
+
+void init_h2(void);
+int is_h2_preface(const char *data, size_t size);
+int is_h2_preface_start(const char *data, size_t size);
+
+struct h2_session *h2_session_new(struct connection *conn,
+                                  const char *data, size_t size,
+                                  struct http_request *upgrade_req);
+enum io_step_status make_h2_step(struct connection *conn,
+                                 struct h2_session *session);
+void cleanup_h2_session(struct h2_session *session);
+
+#endif
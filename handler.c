@@ -1,68 +1,49 @@
+#include <ctype.h>
+#include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <libgen.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 
 #include "io.h"
 #include "log.h"
 #include "utils.h"
 #include "parser.h"
 #include "handler.h"
+#include "h2.h"
+#include "arena.h"
+#include "archive.h"
+#include "proxy.h"
+#include "resolve.h"
+#include "fileio.h"
+#include "upload.h"
+#include "cache.h"
+#include "vhost.h"
+#include "app.h"
+#include "upgrade.h"
+#include "binlog.h"
+#include "throttle.h"
+#include "trace.h"
 #include "config.h"
 
 
-#define ETAG_SIZE 64
-#define SENDFILE_MIN_SIZE 1024 * 8
 #define HEADERS_SIZE 256
-#define HTTP_STATUS_FORMAT_SIZE (sizeof(HTTP_STATUS_FORMAT) - 2 - 1)
+#define BOUNDARY_SIZE 17
 #define LOG_MESSAGE_FORMAT "%s \"%s\" %d %lu \"%s\"\n"
 #define REQUEST_LINE_FORMAT "%s /%s HTTP/%s"
 
 
-enum http_status {
-    S_OK                     = 200,
-    S_PARTIAL_CONTENT        = 206,
-    S_NOT_FOUND              = 404,
-    S_METHOD_NOT_ALLOWED     = 405,
-    S_RANGE_NOT_SATISFIABLE  = 416,
-    S_BAD_REQUEST            = 400,
-    S_FORBIDDEN              = 403,
-    S_REQUEST_TOO_LARGE      = 413,
-    S_INTERNAL_ERROR         = 500,
-    S_VERSION_NOT_SUPPORTED  = 505,
-    S_NOT_MODIFIED           = 304,
-};
-
-enum file_status {F_EXISTS, F_FORBIDDEN, F_NOT_FOUND, F_INTERNAL_ERROR};
-
-struct file_meta {
-    int fd, is_directory;
-    ino_t inode;
-    char *mime;
-    size_t size;
-    char etag[ETAG_SIZE];
-};
-
 
-static const char *http_status_str[] = {
-    [S_OK]                     = "OK",
-    [S_NOT_FOUND]              = "Not Found",
-    [S_METHOD_NOT_ALLOWED]     = "Method Not Allowed",
-    [S_PARTIAL_CONTENT]        = "Partial Content",
-    [S_RANGE_NOT_SATISFIABLE]  = "Range Not Satisfiable",
-    [S_BAD_REQUEST]            = "Bad Request",
-    [S_FORBIDDEN]              = "Forbidden",
-    [S_REQUEST_TOO_LARGE]      = "Request Too Large",
-    [S_INTERNAL_ERROR]         = "Internal Server Error",
-    [S_VERSION_NOT_SUPPORTED]  = "HTTP Version not supported",
-    [S_NOT_MODIFIED]           = "Not Modified",
-};
 
-
-static void
+void
 log_new_connection(const struct connection *conn,
                    const struct http_request *req,
                    enum http_status status,
@@ -70,31 +51,43 @@ log_new_connection(const struct connection *conn,
 {
     char *user_agent = "-";
     char *request_line = "-";
+    char request_line_buf[MAX_TARGET_SIZE + 32];
+    char addr[ADDR_STR_SIZE];
+    int64_t latency = 0;
+
+    TRACE4(response, conn->fd, status, content_lenght,
+           status != S_BAD_REQUEST ? req->target : NULL);
+
+    if (binlog_enabled()) {
+        /* an h2 connection reads no request on its own */
+        if (conn->steps && conn->steps->type != S_H2) {
+            latency = monotonic_us() - conn->request_start;
+        }
+        binlog_request(&conn->addr, status != S_BAD_REQUEST ? req : NULL,
+                       status, content_lenght, latency);
+        return;
+    }
 
     if (status != S_BAD_REQUEST) {
         if (req->headers[H_USER_AGENT]) {
             user_agent = req->headers[H_USER_AGENT];
         }
 
-        request_line = xmalloc(strlen(req->target) + 32);
-        sprintf(request_line, REQUEST_LINE_FORMAT,
-                http_methods[req->method].name,
-                req->target,
-                http_versions[req->version].name);
+        request_line = request_line_buf;
+        snprintf(request_line, sizeof(request_line_buf), REQUEST_LINE_FORMAT,
+                 http_methods[req->method].name,
+                 req->target,
+                 http_versions[req->version].name);
     }
 
     log_log(&conn->last_active,
             LOG_MESSAGE_FORMAT,
-            conn->ip, request_line,
+            format_addr(&conn->addr, addr), request_line,
             status, content_lenght,user_agent);
-
-    if (status != S_BAD_REQUEST) {
-        free(request_line);
-    }
 }
 
 
-static char *
+char *
 get_url_mimetype(const char *url)
 {
     size_t i;
@@ -120,56 +113,98 @@ get_url_mimetype(const char *url)
 
 
 static enum file_status
-gather_file_meta(const char *target, struct file_meta *file_meta)
+open_file_meta(const struct vhost *host, const char *target,
+               struct file_meta *file_meta, int nowait)
 {
-    char *mimetype;
-    int fd, is_dir;
-    size_t target_size, orig_target_size;
+    int fd, dirfd, is_index = 0;
     struct stat st_buf;
-    char target_tmp[MAX_TARGET_SIZE] = {0};
+    char index_path[MAX_TARGET_SIZE + VHOST_INDEX_SIZE + 1];
 
-    target_size = orig_target_size = strlen(target);
-    memcpy(target_tmp, target, target_size + 1);
+    if (archive_enabled()) {
+        return archive_lookup(target, file_meta);
+    }
+
+    fd = open_target(host->root_fd, target, O_LARGEFILE | O_RDONLY | O_NONBLOCK,
+                     nowait);
 
     for (;;) {
-        fd = open(target_tmp, O_LARGEFILE | O_RDONLY | O_NONBLOCK);
         if (fd < 0) {
-            return (errno == EACCES) ? F_FORBIDDEN : F_NOT_FOUND;
+            if (errno == EAGAIN) {
+                return F_AGAIN;
+            }
+            return (errno == EACCES || errno == EXDEV || errno == ELOOP)
+                   ? F_FORBIDDEN : F_NOT_FOUND;
         } else if (fstat(fd, &st_buf) < 0) {
+            close(fd);
             return F_INTERNAL_ERROR;
         }
 
-        is_dir = S_ISDIR(st_buf.st_mode);
-
-        if (!S_ISREG(st_buf.st_mode) && !is_dir) {
+        if (S_ISREG(st_buf.st_mode)) {
+            break;
+        } else if (!S_ISDIR(st_buf.st_mode)) {
+            close(fd);
             return F_FORBIDDEN;
+        } else if (is_index) {
+            close(fd);
+            return F_NOT_FOUND;
         }
 
-        if (!is_dir) {
-            mimetype = get_url_mimetype(target_tmp);
-            break;
+        /* the index page is opened from the directory itself, not walked
+         * to again from the root
+         */
+        dirfd = fd;
+        fd = open_beneath(dirfd, host->index, O_LARGEFILE | O_RDONLY | O_NONBLOCK,
+                          nowait);
+        close(dirfd);
+
+        if (fd < 0 && errno == EXDEV) {
+            if (snprintf(index_path, sizeof(index_path), "%s/%s", target,
+                         host->index) >= (int)sizeof(index_path))
+            {
+                return F_NOT_FOUND;
+            }
+            fd = open_target(host->root_fd, index_path,
+                             O_LARGEFILE | O_RDONLY | O_NONBLOCK, nowait);
         }
-
-        memcpy(target_tmp + target_size, "/" INDEX_PAGE, sizeof("/" INDEX_PAGE));
-        target_size += sizeof("/" INDEX_PAGE) - 1;
-        close(fd);
+        is_index = 1;
     }
 
     file_meta->fd = fd;
-    file_meta->is_directory = is_dir;
-    file_meta->mime = mimetype;
+    file_meta->is_directory = 0;
+    file_meta->mime = get_url_mimetype(is_index ? host->index : target);
     file_meta->size = st_buf.st_size;
+    file_meta->offset = 0;
+    file_meta->data = NULL;
     file_meta->inode = st_buf.st_ino;
+    file_meta->mtime = st_buf.st_mtim.tv_sec;
     sprintf(file_meta->etag, "%ld-%ld", st_buf.st_mtim.tv_sec, st_buf.st_size);
 
     return F_EXISTS;
 }
 
 
-static inline enum conn_status
+/* With nowait nothing may block on the disk, F_AGAIN then means the
+ * lookup has to be done by the I/O pool.
+ */
+enum file_status
+gather_file_meta(const struct vhost *host, const char *target,
+                 struct file_meta *file_meta, int nowait)
+{
+    enum file_status st;
+
+    TRACE2(file_start, target, nowait);
+    st = open_file_meta(host, target, file_meta, nowait);
+    TRACE3(file_done, target, st, st == F_EXISTS ? (int64_t)file_meta->size : -1);
+
+    return st;
+}
+
+
+enum conn_status
 close_on_keep_alive(struct connection *conn)
 {
     if (conn->keep_alive) {
+        conn->served = 1;
         setup_read_io_step(&conn->steps, build_response);
         return C_RUN;
     }
@@ -178,15 +213,17 @@ close_on_keep_alive(struct connection *conn)
 }
 
 
+/* header is an extra header line, a Location or a Content-Range */
 static void
 build_http_status_step(enum http_status st, struct connection *conn,
-                       const struct http_request *req)
+                       const struct http_request *req, const char *header)
 {
     char *data;
     size_t content_length, size;
 
     content_length = strlen(http_status_str[st]) + HTTP_STATUS_FORMAT_SIZE;
-    data = xmalloc(HEADERS_SIZE);
+    data = arena_alloc(&conn->arena,
+                       HEADERS_SIZE + (header ? strlen(header) : 0));
 
     size = sprintf(
         data,
@@ -195,6 +232,10 @@ build_http_status_step(enum http_status st, struct connection *conn,
         "Accept-Ranges: bytes\r\n"
         "Content-Length: %zu\r\n", st, http_status_str[st], content_length);
 
+    if (header) {
+        size += sprintf(data + size, "%s\r\n", header);
+    }
+
     if (conn->keep_alive) {
         size += sprintf(data + size, "Connection: keep-alive\r\n\r\n");
     } else {
@@ -203,7 +244,7 @@ build_http_status_step(enum http_status st, struct connection *conn,
 
     size += sprintf(data + size, HTTP_STATUS_FORMAT, http_status_str[st]);
 
-    setup_write_io_step(&conn->steps, data, 0, size, close_on_keep_alive);
+    setup_write_io_step(conn, data, 0, size, close_on_keep_alive);
 
     log_new_connection(conn, req, st, content_length);
 }
@@ -212,111 +253,366 @@ build_http_status_step(enum http_status st, struct connection *conn,
 void
 init_handler(const char *conf_root_dir, int conf_chroot)
 {
+    char *dir;
+    struct stat st_buf;
+
+    /* a regular file as the root is a tar archive of the whole site, the
+     * chroot then goes to the directory holding it
+     */
+    if (!stat(conf_root_dir, &st_buf) && S_ISREG(st_buf.st_mode)) {
+        if (vhosts_enabled()) {
+            errx(1, "virtual hosts need a directory as the root");
+        }
+        init_archive(conf_root_dir);
+        if (conf_chroot) {
+            dir = xmalloc(strlen(conf_root_dir) + 1);
+            dir = dirname(strcpy(dir, conf_root_dir));
+            xchdir(dir);
+            xchroot(dir);
+        }
+        return;
+    }
+
     xchdir(conf_root_dir);
     if (conf_chroot) {
         xchroot(conf_root_dir);
     }
+    init_vhosts(init_resolver());
 }
 
 
-enum conn_status
-build_response(struct connection *conn)
+/* Byte ranges of RFC 9110 14.1.2, sorted with the overlapping or nearly
+ * adjacent ones coalesced. Returns how many of them are satisfiable, -1
+ * when the header is to be ignored: another unit, bad syntax or more
+ * ranges than MAX_RANGES.
+ */
+static int
+parse_ranges(const char *data, size_t size, struct byte_range *ranges)
 {
-    int st;
-    char *data, *p;
-    struct http_request req = {0};
-    struct file_meta file_meta = {0};
-    size_t lower, upper, content_length, size;
+    int i, j, count = 0;
+    char *end;
+    size_t first, last;
+    struct byte_range range;
 
-    st = parse_request(((struct read_meta *)conn->steps->meta)->data, &req);
-    if (st) {
-        build_http_status_step(S_BAD_REQUEST, conn, &req);
-        return C_RUN;
+    if (strncasecmp(data, "bytes=", sizeof("bytes=") - 1)) {
+        return -1;
     }
+    data += sizeof("bytes=") - 1;
 
-    if (req.method != M_GET && req.method != M_HEAD) {
-        build_http_status_step(S_METHOD_NOT_ALLOWED, conn, &req);
-        return C_RUN;
-    }
+    for (;;) {
+        while (*data == ' ' || *data == '\t' || *data == ',') {
+            data++;
+        }
+        if (!*data) {
+            break;
+        }
 
-    if (req.headers[H_CONNECTION] && !strcmp(req.headers[H_CONNECTION], "close")) {
-        conn->keep_alive = 0;
+        if (*data == '-') {
+            /* the last bytes of the file, a suffix of 0 is unsatisfiable */
+            if (!isdigit((unsigned char)*++data)) {
+                return -1;
+            }
+            last = strtoull(data, &end, 10);
+            first = (last < size) ? size - last : 0;
+            last = (last && size) ? size - 1 : 0;
+            if (last < first) {
+                first = size;
+            }
+        } else {
+            if (!isdigit((unsigned char)*data)) {
+                return -1;
+            }
+            first = strtoull(data, &end, 10);
+            if (*end++ != '-') {
+                return -1;
+            }
+            last = SIZE_MAX;
+            if (isdigit((unsigned char)*end)) {
+                last = strtoull(end, &end, 10);
+            }
+            if (last < first) {
+                return -1;
+            }
+        }
+
+        data = end;
+        while (*data == ' ' || *data == '\t') {
+            data++;
+        }
+        if (*data && *data != ',') {
+            return -1;
+        }
+
+        if (first >= size) {
+            continue;
+        }
+        if (count == MAX_RANGES) {
+            return -1;
+        }
+
+        range.lower = first;
+        range.upper = MIN(last, size - 1);
+        for (i = count++; i > 0 && ranges[i - 1].lower > range.lower; i--) {
+            ranges[i] = ranges[i - 1];
+        }
+        ranges[i] = range;
     }
 
-    if (*req.target == '\0') {
-        req.target = ".";
+    /* a gap smaller than a part's headers is cheaper to send along */
+    for (i = 0, j = 1; j < count; j++) {
+        if (ranges[j].lower <= ranges[i].upper + RANGE_MERGE_GAP) {
+            ranges[i].upper = MAX(ranges[i].upper, ranges[j].upper);
+        } else {
+            ranges[++i] = ranges[j];
+        }
     }
 
-    switch (gather_file_meta(req.target, &file_meta)) {
+    return count ? i + 1 : 0;
+}
+
+
+/* The Range header is left as it is, a request waiting on the I/O pool
+ * goes through here once more.
+ */
+static enum http_status
+check_file(enum file_status file_status, struct http_request *req,
+           struct response *resp)
+{
+    struct file_meta *file_meta = &resp->file;
+
+    switch (file_status) {
     case F_FORBIDDEN:
-        build_http_status_step(S_FORBIDDEN, conn, &req);
-        return C_RUN;
-        break;
+        return S_FORBIDDEN;
     case F_NOT_FOUND:
-        build_http_status_step(S_NOT_FOUND, conn, &req);
-        return C_RUN;
-        break;
+        return S_NOT_FOUND;
     case F_INTERNAL_ERROR:
-        build_http_status_step(S_INTERNAL_ERROR, conn, &req);
-        return C_RUN;
-        break;
+    case F_AGAIN:
+        return S_INTERNAL_ERROR;
     default:
         break;
     }
 
-    if (file_meta.is_directory) {
-        close(file_meta.fd);
+    if (file_meta->is_directory) {
+        release_file(file_meta);
         // TODO: create files listings
-        build_http_status_step(S_NOT_FOUND, conn, &req);
-        return C_RUN;
+        return S_NOT_FOUND;
     }
 
-    if (req.headers[H_IF_MATCH] && !strcmp(file_meta.etag, req.headers[H_IF_MATCH])) {
-        build_http_status_step(S_NOT_MODIFIED, conn, &req);
-        return C_RUN;
+    if (req->headers[H_IF_MATCH] && !strcmp(file_meta->etag, req->headers[H_IF_MATCH])) {
+        release_file(file_meta);
+        return S_NOT_MODIFIED;
     }
 
-    lower = 0;
-    upper = file_meta.size - 1;
-    content_length = file_meta.size;
-    st = S_OK;
-    if (req.headers[H_RANGE]) {
-        data = req.headers[H_RANGE];
+    resp->lower = 0;
+    resp->upper = file_meta->size - 1;
+    resp->content_length = file_meta->size;
+    resp->ranges_count = 0;
 
-        if (strncmp(data, "bytes=", sizeof("bytes=") - 1)) {
-            build_http_status_step(S_BAD_REQUEST, conn, &req);
-            return C_RUN;
-        }
+    if (!req->headers[H_RANGE]) {
+        return S_OK;
+    }
 
-        data += sizeof("bytes=") - 1;
+    resp->ranges_count = parse_ranges(req->headers[H_RANGE], file_meta->size,
+                                      resp->ranges);
+    if (resp->ranges_count < 0) {
+        resp->ranges_count = 0;
+        return S_OK;
+    }
 
-        if (!(p = strchr(data, '-'))) {
-            build_http_status_step(S_BAD_REQUEST, conn, &req);
-            return C_RUN;
-        }
+    if (!resp->ranges_count) {
+        release_file(file_meta);
+        return S_RANGE_NOT_SATISFIABLE;
+    }
 
-        *(p++) = '\0';
+    /* the length of a multipart body is only known with its boundary */
+    resp->lower = resp->ranges[0].lower;
+    resp->upper = resp->ranges[0].upper;
+    resp->content_length = resp->upper - resp->lower + 1;
 
-        if (*data) {
-            lower = strtoull(data, NULL, 10);
-        }
+    return S_PARTIAL_CONTENT;
+}
+
+
+/* An h2 stream's request before its file is looked up */
+enum http_status
+prepare_request(struct http_request *req)
+{
+    if (req->method != M_GET && req->method != M_HEAD) {
+        return S_METHOD_NOT_ALLOWED;
+    }
+
+    if (*req->target == '\0') {
+        req->target = ".";
+    }
+
+    req->host = vhost_lookup(req->headers[H_HOST]);
+
+    return S_OK;
+}
+
+
+enum http_status
+prepare_response(struct http_request *req, enum file_status file_status,
+                 struct response *resp)
+{
+    enum http_status st = check_file(file_status, req, resp);
+
+    /* a stream carries a single range, several of them get the whole file */
+    if (st == S_PARTIAL_CONTENT && resp->ranges_count > 1) {
+        resp->lower = 0;
+        resp->upper = resp->file.size - 1;
+        resp->content_length = resp->file.size;
+        st = S_OK;
+    }
+
+    return st;
+}
+
+
+/* not a secret, only unlikely to show up in the file */
+static void
+make_boundary(char *boundary)
+{
+    static __thread uint64_t seq = 0;
+    uint64_t x;
+
+    if (!seq) {
+        seq = ((uint64_t)time(NULL) << 20) ^ (uintptr_t)&seq;
+    }
+
+    x = (seq += 0x9e3779b97f4a7c15);
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    x ^= x >> 31;
 
-        if (*p) {
-            upper = strtoull(p, NULL, 10);
+    sprintf(boundary, "%016llx", (unsigned long long)x);
+}
+
+
+/* Each part's headers are a write step, its bytes a sendfile step, only
+ * parts of a file already in memory are copied when they are small. The
+ * last sendfile step owns the fd.
+ */
+static void
+send_multipart_response(struct connection *conn, struct http_request *req,
+                        struct response *resp)
+{
+    int i, last = resp->ranges_count - 1;
+    char boundary[BOUNDARY_SIZE], *data, *parts[MAX_RANGES + 1];
+    size_t size, part_size, sizes[MAX_RANGES + 1], content_length = 0;
+    struct byte_range *r;
+
+    make_boundary(boundary);
+
+    for (i = 0; i <= last; i++) {
+        r = &resp->ranges[i];
+        parts[i] = arena_alloc(&conn->arena, HEADERS_SIZE + strlen(resp->file.mime));
+        sizes[i] = sprintf(parts[i],
+                           "\r\n--%s\r\n"
+                           "Content-Type: %s\r\n"
+                           "Content-Range: bytes %zu-%zu/%zu\r\n\r\n",
+                           boundary, resp->file.mime,
+                           r->lower, r->upper, resp->file.size);
+        content_length += sizes[i] + r->upper - r->lower + 1;
+    }
+    parts[i] = arena_alloc(&conn->arena, BOUNDARY_SIZE + 8);
+    sizes[i] = sprintf(parts[i], "\r\n--%s--\r\n", boundary);
+    content_length += sizes[i];
+    resp->content_length = content_length;
+
+    data = arena_alloc(&conn->arena, HEADERS_SIZE + CACHE_HEADERS_SIZE + sizes[0]);
+    size = sprintf(
+        data,
+        "HTTP/1.1 %d %s\r\n"
+        "Server: rockepoll\r\n"
+        "Accept-Ranges: bytes\r\n"
+        "Content-Type: multipart/byteranges; boundary=%s\r\n"
+        "Content-Length: %zu\r\n"
+        "ETag: \"%s\"\r\n"
+        "Connection: %s\r\n",
+        S_PARTIAL_CONTENT, http_status_str[S_PARTIAL_CONTENT], boundary,
+        content_length, resp->file.etag,
+        conn->keep_alive ? "keep-alive" : "close");
+    size += cache_headers(req->target, &resp->file, data + size);
+    size += sprintf(data + size, "\r\n");
+
+    if (req->method != M_GET) {
+        setup_write_io_step(conn, data, 0, size, close_on_keep_alive);
+        release_file(&resp->file);
+        log_new_connection(conn, req, S_PARTIAL_CONTENT, content_length);
+        return;
+    }
+
+    memcpy(data + size, parts[0], sizes[0]);
+    setup_write_io_step(conn, data, 1, size + sizes[0], NULL);
+
+    for (i = 0; i <= last; i++) {
+        r = &resp->ranges[i];
+        part_size = r->upper - r->lower + 1;
+
+        if (i) {
+            setup_write_io_step(conn, parts[i], 1, sizes[i], NULL);
         }
 
-        if (lower > upper) {
-            build_http_status_step(S_RANGE_NOT_SATISFIABLE, conn, &req);
-            return C_RUN;
+        if (resp->file.data && part_size < SENDFILE_MIN_SIZE) {
+            data = memcpy(arena_alloc(&conn->arena, part_size),
+                          resp->file.data + r->lower, part_size);
+            setup_write_io_step(conn, data, 1, part_size, NULL);
+        } else {
+            setup_sendfile_io_step(conn,
+                                   resp->file.fd,
+                                   resp->file.data != NULL || i != last,
+                                   resp->file.offset + r->lower,
+                                   resp->file.offset + r->upper + 1,
+                                   part_size, NULL);
         }
+    }
+
+    setup_write_io_step(conn, parts[i], 0, sizes[i], close_on_keep_alive);
+    if (resp->file.data) {
+        release_file(&resp->file);
+    }
+
+    log_new_connection(conn, req, S_PARTIAL_CONTENT, content_length);
+}
 
-        upper = MIN(upper, file_meta.size - 1);
 
-        content_length = upper - lower + 1;
-        st = S_PARTIAL_CONTENT;
+/* Returns 0 when the body of a small file is not in the page cache and
+ * nowait is set, the file is released then and the request has to wait
+ * for the I/O pool.
+ */
+static int
+send_file_response(struct connection *conn, struct http_request *req,
+                   enum file_status file_status, struct response *resp,
+                   int nowait)
+{
+    int st;
+    char *data, header[64];
+    size_t size;
+    ssize_t len;
+    struct iovec iov;
+
+    st = check_file(file_status, req, resp);
+    if (st == S_RANGE_NOT_SATISFIABLE) {
+        sprintf(header, "Content-Range: bytes */%zu", resp->file.size);
+        build_http_status_step(st, conn, req, header);
+        return 1;
+    }
+    if (st != S_OK && st != S_PARTIAL_CONTENT) {
+        build_http_status_step(st, conn, req, NULL);
+        return 1;
+    }
+
+    upgrade_touch(req->headers[H_HOST], req->target);
+
+    if (resp->ranges_count > 1) {
+        send_multipart_response(conn, req, resp);
+        return 1;
     }
 
-    data = xmalloc(HEADERS_SIZE + (content_length < SENDFILE_MIN_SIZE) * content_length);
+    data = arena_alloc(&conn->arena,
+                       HEADERS_SIZE + CACHE_HEADERS_SIZE +
+                       (resp->content_length < SENDFILE_MIN_SIZE) * resp->content_length);
 
     size = sprintf(
         data,
@@ -327,39 +623,231 @@ build_response(struct connection *conn)
         "Content-Length: %zu\r\n"
         "ETag: \"%s\"\r\n"
         "Connection: %s\r\n",
-        st, http_status_str[st], file_meta.mime,
-        content_length, file_meta.etag,
+        st, http_status_str[st], resp->file.mime,
+        resp->content_length, resp->file.etag,
         conn->keep_alive ? "keep-alive" : "close");
 
     if (st == S_PARTIAL_CONTENT) {
         size += sprintf(data + size,
                         "Content-Range: bytes %zu-%zu/%zu\r\n",
-                        lower, upper, file_meta.size);
+                        resp->lower, resp->upper, resp->file.size);
     }
 
+    size += cache_headers(req->target, &resp->file, data + size);
     size += sprintf(data + size, "\r\n");
 
-    if (req.method == M_GET) {
-        if (content_length < SENDFILE_MIN_SIZE) {
-            if (lower) {
-                lseek(file_meta.fd, lower, SEEK_SET);
+    if (req->method == M_GET) {
+        if (resp->content_length < SENDFILE_MIN_SIZE) {
+            if (resp->file.data) {
+                memcpy(data + size, resp->file.data + resp->lower, resp->content_length);
+                size += resp->content_length;
+            } else {
+                iov.iov_base = data + size;
+                iov.iov_len = resp->content_length;
+                len = preadv2(resp->file.fd, &iov, 1, resp->lower,
+                              nowait ? RWF_NOWAIT : 0);
+                if (nowait && (size_t)len != resp->content_length) {
+                    release_file(&resp->file);
+                    return 0;
+                }
+                size += len;
             }
-            size += read(file_meta.fd, data + size, content_length);
 
-            setup_write_io_step(&conn->steps,
+            setup_write_io_step(conn,
                                 data,
                                 0, size,
                                 close_on_keep_alive);
-            close(file_meta.fd);
+            release_file(&resp->file);
         } else {
-            setup_write_io_step(&conn->steps, data, 1, size, NULL);
-            setup_sendfile_io_step(&conn->steps,
-                                   file_meta.fd, lower, upper + 1, content_length,
+            setup_write_io_step(conn, data, 1, size, NULL);
+            setup_sendfile_io_step(conn,
+                                   resp->file.fd, resp->file.data != NULL,
+                                   resp->file.offset + resp->lower,
+                                   resp->file.offset + resp->upper + 1,
+                                   resp->content_length,
                                    close_on_keep_alive);
         }
+    } else {
+        setup_write_io_step(conn, data, 0, size, close_on_keep_alive);
+        release_file(&resp->file);
+    }
+
+    log_new_connection(conn, req, st, resp->content_length);
+
+    return 1;
+}
+
+
+static enum conn_status
+file_ready(struct connection *conn)
+{
+    struct file_waiter *waiter = conn->steps->meta;
+    struct response resp = {0};
+    enum file_status file_status;
+
+    file_status = fileio_result(waiter, &resp.file);
+    send_file_response(conn, fileio_arg(waiter), file_status, &resp, 0);
+
+    return C_RUN;
+}
+
+
+static enum conn_status
+upload_received(struct connection *conn)
+{
+    const char *location;
+    char *header = NULL;
+    struct upload *upload = conn->steps->meta;
+    enum http_status st = upload_finish(upload, &location);
+
+    if (location) {
+        header = arena_alloc(&conn->arena, strlen(location) + sizeof("Location: "));
+        sprintf(header, "Location: %s", location);
+    }
+    build_http_status_step(st, conn, upload_req(upload), header);
+
+    return C_RUN;
+}
+
+
+/* The request is parsed in the thread's scratch buffer, what is needed
+ * of it after a wait is copied into the arena.
+ */
+struct http_request *
+copy_request(struct connection *conn, const struct http_request *req)
+{
+    int i;
+    size_t size;
+    struct http_request *copy;
+
+    copy = arena_alloc(&conn->arena, sizeof(struct http_request));
+    *copy = *req;
+    size = strlen(req->target) + 1;
+    copy->target = memcpy(arena_alloc(&conn->arena, size), req->target, size);
+    for (i = 0; i < HEADERS_COUNT; i++) {
+        if (req->headers[i]) {
+            size = strlen(req->headers[i]) + 1;
+            copy->headers[i] = memcpy(arena_alloc(&conn->arena, size),
+                                      req->headers[i], size);
+        }
     }
 
-    log_new_connection(conn, &req, st, content_length);
+    return copy;
+}
+
+
+static void
+wait_for_file(struct connection *conn, struct http_request *req)
+{
+    struct http_request *copy = copy_request(conn, req);
+    struct file_waiter *waiter;
+    struct response resp = {0};
+
+    if (!(waiter = fileio_submit(copy->host, copy->target, conn, copy))) {
+        /* the pool is off or its queue is full */
+        send_file_response(conn, copy,
+                           gather_file_meta(copy->host, copy->target, &resp.file, 0),
+                           &resp, 0);
+        return;
+    }
+
+    setup_file_io_step(conn, waiter, file_ready);
+}
+
+
+enum conn_status
+build_response(struct connection *conn)
+{
+    int st, route;
+    char *data;
+    size_t size;
+    enum file_status file_status;
+    struct read_meta *read_meta = conn->steps->meta;
+    struct http_request req = {0};
+    struct response resp = {0};
+    struct proxy *proxy;
+    struct upload *upload;
+
+    if (is_h2_preface(read_meta->data, read_meta->size)) {
+        setup_h2_io_step(&conn->steps,
+                         h2_session_new(conn, read_meta->data, read_meta->size, NULL),
+                         NULL);
+        return C_RUN;
+    }
+
+    if ((route = proxy_route(read_meta->data)) >= 0) {
+        st = proxy_request(conn, route, read_meta, &req, &proxy);
+        if (st != S_OK) {
+            build_http_status_step(st, conn, &req, NULL);
+            return C_RUN;
+        }
+        setup_proxy_io_step(conn, proxy, close_on_keep_alive);
+        return C_RUN;
+    }
+
+    st = parse_request(read_meta->data, &req);
+    TRACE4(request_parse, conn->fd, st, st ? -1 : (int)req.method,
+           st ? NULL : req.target);
+    if (st) {
+        build_http_status_step(S_BAD_REQUEST, conn, &req, NULL);
+        return C_RUN;
+    }
+
+    if (req.headers[H_CONNECTION] && !strcmp(req.headers[H_CONNECTION], "close")) {
+        conn->keep_alive = 0;
+    }
+
+    req.host = vhost_lookup(req.headers[H_HOST]);
+
+    if (req.headers[H_UPGRADE] && !strcmp(req.headers[H_UPGRADE], "h2c") &&
+        req.headers[H_HTTP2_SETTINGS] &&
+        (req.method == M_GET || req.method == M_HEAD))
+    {
+        data = arena_alloc(&conn->arena, HEADERS_SIZE);
+        size = sprintf(data,
+                       "HTTP/1.1 %d %s\r\n"
+                       "Connection: Upgrade\r\n"
+                       "Upgrade: h2c\r\n\r\n",
+                       S_SWITCHING_PROTOCOLS,
+                       http_status_str[S_SWITCHING_PROTOCOLS]);
+        setup_write_io_step(conn, data, 0, size, NULL);
+        setup_h2_io_step(&conn->steps, h2_session_new(conn, NULL, 0, &req), NULL);
+        return C_RUN;
+    }
+
+    if ((route = app_route(req.target)) >= 0) {
+        if ((st = app_request(conn, route, &req))) {
+            build_http_status_step(st, conn, &req, NULL);
+        }
+        return C_RUN;
+    }
+
+    if ((req.method == M_PUT || req.method == M_POST) && upload_enabled()) {
+        st = upload_request(conn, read_meta, &req, &upload);
+        if (st != S_OK) {
+            build_http_status_step(st, conn, &req, NULL);
+            return C_RUN;
+        }
+        setup_upload_io_step(conn, upload, upload_received);
+        return C_RUN;
+    }
+
+    if (req.method != M_GET && req.method != M_HEAD) {
+        build_http_status_step(S_METHOD_NOT_ALLOWED, conn, &req, NULL);
+        return C_RUN;
+    }
+
+    if (*req.target == '\0') {
+        req.target = ".";
+    }
+
+    /* whatever is not in the kernel's caches is left to the I/O pool */
+    file_status = gather_file_meta(req.host, req.target, &resp.file, 1);
+    if (file_status == F_AGAIN ||
+        !send_file_response(conn, &req, file_status, &resp, 1))
+    {
+        wait_for_file(conn, &req);
+    }
 
     return C_RUN;
-}
\ No newline at end of file
+}
@@ -1,10 +1,124 @@
-
 #ifndef HANDLER_H
 #define HANDLER_H
 
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
 #include "io.h"
+#include "parser.h"
+
+
+#define ETAG_SIZE 64
+#define SENDFILE_MIN_SIZE 1024 * 8
+#define MAX_RANGES 16
+#define HTTP_STATUS_FORMAT_SIZE (sizeof(HTTP_STATUS_FORMAT) - 2 - 1)
+
+
+enum http_status {
+    S_SWITCHING_PROTOCOLS    = 101,
+    S_OK                     = 200,
+    S_CREATED                = 201,
+    S_PARTIAL_CONTENT        = 206,
+    S_NOT_FOUND              = 404,
+    S_METHOD_NOT_ALLOWED     = 405,
+    S_RANGE_NOT_SATISFIABLE  = 416,
+    S_BAD_REQUEST            = 400,
+    S_FORBIDDEN              = 403,
+    S_LENGTH_REQUIRED        = 411,
+    S_REQUEST_TOO_LARGE      = 413,
+    S_MISDIRECTED_REQUEST    = 421,
+    S_INTERNAL_ERROR         = 500,
+    S_NOT_IMPLEMENTED        = 501,
+    S_BAD_GATEWAY            = 502,
+    S_GATEWAY_TIMEOUT        = 504,
+    S_VERSION_NOT_SUPPORTED  = 505,
+    S_NOT_MODIFIED           = 304,
+};
+
+
+static const char *const http_status_str[] = {
+    [S_SWITCHING_PROTOCOLS]    = "Switching Protocols",
+    [S_OK]                     = "OK",
+    [S_CREATED]                = "Created",
+    [S_NOT_FOUND]              = "Not Found",
+    [S_METHOD_NOT_ALLOWED]     = "Method Not Allowed",
+    [S_PARTIAL_CONTENT]        = "Partial Content",
+    [S_RANGE_NOT_SATISFIABLE]  = "Range Not Satisfiable",
+    [S_BAD_REQUEST]            = "Bad Request",
+    [S_FORBIDDEN]              = "Forbidden",
+    [S_LENGTH_REQUIRED]        = "Length Required",
+    [S_REQUEST_TOO_LARGE]      = "Request Too Large",
+    [S_MISDIRECTED_REQUEST]    = "Misdirected Request",
+    [S_INTERNAL_ERROR]         = "Internal Server Error",
+    [S_NOT_IMPLEMENTED]        = "Not Implemented",
+    [S_BAD_GATEWAY]            = "Bad Gateway",
+    [S_GATEWAY_TIMEOUT]        = "Gateway Timeout",
+    [S_VERSION_NOT_SUPPORTED]  = "HTTP Version not supported",
+    [S_NOT_MODIFIED]           = "Not Modified",
+};
+
+
+enum file_status {F_EXISTS, F_FORBIDDEN, F_NOT_FOUND, F_INTERNAL_ERROR, F_AGAIN};
+
+
+/* Files served from an archive share its fd, the body starts at offset
+ * and data points at it in the archive's mapping. Small files read by the
+ * I/O pool have no fd and data is the pool's copy. For anything else data
+ * is NULL and fd belongs to the response.
+ */
+struct file_meta {
+    int fd, is_directory;
+    ino_t inode;
+    time_t mtime;
+    char *mime;
+    size_t size;
+    off_t offset;
+    const char *data;
+    char etag[ETAG_SIZE];
+};
+
+
+static inline void
+release_file(const struct file_meta *file)
+{
+    if (!file->data) {
+        close(file->fd);
+    }
+}
+
+
+struct byte_range {
+    size_t lower, upper;
+};
+
+
+/* what a request resolved to, independent of the HTTP framing used to
+ * send it; fd is open only for S_OK and S_PARTIAL_CONTENT, lower and upper
+ * are the first of ranges when there is more than one
+ */
+struct response {
+    struct file_meta file;
+    size_t lower, upper, content_length;
+    int ranges_count;
+    struct byte_range ranges[MAX_RANGES];
+};
+
 
 enum conn_status build_response(struct connection *conn);
+enum conn_status close_on_keep_alive(struct connection *conn);
+struct http_request *copy_request(struct connection *conn,
+                                  const struct http_request *req);
+enum http_status prepare_request(struct http_request *req);
+enum http_status prepare_response(struct http_request *req, enum file_status file_status,
+                                  struct response *resp);
+enum file_status gather_file_meta(const struct vhost *host, const char *target,
+                                  struct file_meta *file_meta, int nowait);
+void log_new_connection(const struct connection *conn,
+                        const struct http_request *req,
+                        enum http_status status,
+                        size_t content_lenght);
+char *get_url_mimetype(const char *url);
 void init_handler(const char *conf_root_dir, int conf_chroot);
 
 #endif
@@ -0,0 +1,502 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "hpack.h"
+#include "utils.h"
+
+
+#define HPACK_STATIC_COUNT (sizeof(static_table) / sizeof(*static_table) - 1)
+#define HPACK_TABLE_CAPACITY (HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD)
+#define HUFFMAN_EOS 256
+
+
+static const struct {
+    char *name;
+    char *value;
+} static_table[] = {
+    { NULL, NULL },
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+
+/* RFC 7541, Appendix B */
+static const struct {
+    unsigned int code;
+    int bits;
+} huffman_codes[HUFFMAN_EOS + 1] = {
+    { 0x00001ff8, 13 }, { 0x007fffd8, 23 }, { 0x0fffffe2, 28 }, { 0x0fffffe3, 28 },
+    { 0x0fffffe4, 28 }, { 0x0fffffe5, 28 }, { 0x0fffffe6, 28 }, { 0x0fffffe7, 28 },
+    { 0x0fffffe8, 28 }, { 0x00ffffea, 24 }, { 0x3ffffffc, 30 }, { 0x0fffffe9, 28 },
+    { 0x0fffffea, 28 }, { 0x3ffffffd, 30 }, { 0x0fffffeb, 28 }, { 0x0fffffec, 28 },
+    { 0x0fffffed, 28 }, { 0x0fffffee, 28 }, { 0x0fffffef, 28 }, { 0x0ffffff0, 28 },
+    { 0x0ffffff1, 28 }, { 0x0ffffff2, 28 }, { 0x3ffffffe, 30 }, { 0x0ffffff3, 28 },
+    { 0x0ffffff4, 28 }, { 0x0ffffff5, 28 }, { 0x0ffffff6, 28 }, { 0x0ffffff7, 28 },
+    { 0x0ffffff8, 28 }, { 0x0ffffff9, 28 }, { 0x0ffffffa, 28 }, { 0x0ffffffb, 28 },
+    { 0x00000014,  6 }, { 0x000003f8, 10 }, { 0x000003f9, 10 }, { 0x00000ffa, 12 },
+    { 0x00001ff9, 13 }, { 0x00000015,  6 }, { 0x000000f8,  8 }, { 0x000007fa, 11 },
+    { 0x000003fa, 10 }, { 0x000003fb, 10 }, { 0x000000f9,  8 }, { 0x000007fb, 11 },
+    { 0x000000fa,  8 }, { 0x00000016,  6 }, { 0x00000017,  6 }, { 0x00000018,  6 },
+    { 0x00000000,  5 }, { 0x00000001,  5 }, { 0x00000002,  5 }, { 0x00000019,  6 },
+    { 0x0000001a,  6 }, { 0x0000001b,  6 }, { 0x0000001c,  6 }, { 0x0000001d,  6 },
+    { 0x0000001e,  6 }, { 0x0000001f,  6 }, { 0x0000005c,  7 }, { 0x000000fb,  8 },
+    { 0x00007ffc, 15 }, { 0x00000020,  6 }, { 0x00000ffb, 12 }, { 0x000003fc, 10 },
+    { 0x00001ffa, 13 }, { 0x00000021,  6 }, { 0x0000005d,  7 }, { 0x0000005e,  7 },
+    { 0x0000005f,  7 }, { 0x00000060,  7 }, { 0x00000061,  7 }, { 0x00000062,  7 },
+    { 0x00000063,  7 }, { 0x00000064,  7 }, { 0x00000065,  7 }, { 0x00000066,  7 },
+    { 0x00000067,  7 }, { 0x00000068,  7 }, { 0x00000069,  7 }, { 0x0000006a,  7 },
+    { 0x0000006b,  7 }, { 0x0000006c,  7 }, { 0x0000006d,  7 }, { 0x0000006e,  7 },
+    { 0x0000006f,  7 }, { 0x00000070,  7 }, { 0x00000071,  7 }, { 0x00000072,  7 },
+    { 0x000000fc,  8 }, { 0x00000073,  7 }, { 0x000000fd,  8 }, { 0x00001ffb, 13 },
+    { 0x0007fff0, 19 }, { 0x00001ffc, 13 }, { 0x00003ffc, 14 }, { 0x00000022,  6 },
+    { 0x00007ffd, 15 }, { 0x00000003,  5 }, { 0x00000023,  6 }, { 0x00000004,  5 },
+    { 0x00000024,  6 }, { 0x00000005,  5 }, { 0x00000025,  6 }, { 0x00000026,  6 },
+    { 0x00000027,  6 }, { 0x00000006,  5 }, { 0x00000074,  7 }, { 0x00000075,  7 },
+    { 0x00000028,  6 }, { 0x00000029,  6 }, { 0x0000002a,  6 }, { 0x00000007,  5 },
+    { 0x0000002b,  6 }, { 0x00000076,  7 }, { 0x0000002c,  6 }, { 0x00000008,  5 },
+    { 0x00000009,  5 }, { 0x0000002d,  6 }, { 0x00000077,  7 }, { 0x00000078,  7 },
+    { 0x00000079,  7 }, { 0x0000007a,  7 }, { 0x0000007b,  7 }, { 0x00007ffe, 15 },
+    { 0x000007fc, 11 }, { 0x00003ffd, 14 }, { 0x00001ffd, 13 }, { 0x0ffffffc, 28 },
+    { 0x000fffe6, 20 }, { 0x003fffd2, 22 }, { 0x000fffe7, 20 }, { 0x000fffe8, 20 },
+    { 0x003fffd3, 22 }, { 0x003fffd4, 22 }, { 0x003fffd5, 22 }, { 0x007fffd9, 23 },
+    { 0x003fffd6, 22 }, { 0x007fffda, 23 }, { 0x007fffdb, 23 }, { 0x007fffdc, 23 },
+    { 0x007fffdd, 23 }, { 0x007fffde, 23 }, { 0x00ffffeb, 24 }, { 0x007fffdf, 23 },
+    { 0x00ffffec, 24 }, { 0x00ffffed, 24 }, { 0x003fffd7, 22 }, { 0x007fffe0, 23 },
+    { 0x00ffffee, 24 }, { 0x007fffe1, 23 }, { 0x007fffe2, 23 }, { 0x007fffe3, 23 },
+    { 0x007fffe4, 23 }, { 0x001fffdc, 21 }, { 0x003fffd8, 22 }, { 0x007fffe5, 23 },
+    { 0x003fffd9, 22 }, { 0x007fffe6, 23 }, { 0x007fffe7, 23 }, { 0x00ffffef, 24 },
+    { 0x003fffda, 22 }, { 0x001fffdd, 21 }, { 0x000fffe9, 20 }, { 0x003fffdb, 22 },
+    { 0x003fffdc, 22 }, { 0x007fffe8, 23 }, { 0x007fffe9, 23 }, { 0x001fffde, 21 },
+    { 0x007fffea, 23 }, { 0x003fffdd, 22 }, { 0x003fffde, 22 }, { 0x00fffff0, 24 },
+    { 0x001fffdf, 21 }, { 0x003fffdf, 22 }, { 0x007fffeb, 23 }, { 0x007fffec, 23 },
+    { 0x001fffe0, 21 }, { 0x001fffe1, 21 }, { 0x003fffe0, 22 }, { 0x001fffe2, 21 },
+    { 0x007fffed, 23 }, { 0x003fffe1, 22 }, { 0x007fffee, 23 }, { 0x007fffef, 23 },
+    { 0x000fffea, 20 }, { 0x003fffe2, 22 }, { 0x003fffe3, 22 }, { 0x003fffe4, 22 },
+    { 0x007ffff0, 23 }, { 0x003fffe5, 22 }, { 0x003fffe6, 22 }, { 0x007ffff1, 23 },
+    { 0x03ffffe0, 26 }, { 0x03ffffe1, 26 }, { 0x000fffeb, 20 }, { 0x0007fff1, 19 },
+    { 0x003fffe7, 22 }, { 0x007ffff2, 23 }, { 0x003fffe8, 22 }, { 0x01ffffec, 25 },
+    { 0x03ffffe2, 26 }, { 0x03ffffe3, 26 }, { 0x03ffffe4, 26 }, { 0x07ffffde, 27 },
+    { 0x07ffffdf, 27 }, { 0x03ffffe5, 26 }, { 0x00fffff1, 24 }, { 0x01ffffed, 25 },
+    { 0x0007fff2, 19 }, { 0x001fffe3, 21 }, { 0x03ffffe6, 26 }, { 0x07ffffe0, 27 },
+    { 0x07ffffe1, 27 }, { 0x03ffffe7, 26 }, { 0x07ffffe2, 27 }, { 0x00fffff2, 24 },
+    { 0x001fffe4, 21 }, { 0x001fffe5, 21 }, { 0x03ffffe8, 26 }, { 0x03ffffe9, 26 },
+    { 0x0ffffffd, 28 }, { 0x07ffffe3, 27 }, { 0x07ffffe4, 27 }, { 0x07ffffe5, 27 },
+    { 0x000fffec, 20 }, { 0x00fffff3, 24 }, { 0x000fffed, 20 }, { 0x001fffe6, 21 },
+    { 0x003fffe9, 22 }, { 0x001fffe7, 21 }, { 0x001fffe8, 21 }, { 0x007ffff3, 23 },
+    { 0x003fffea, 22 }, { 0x003fffeb, 22 }, { 0x01ffffee, 25 }, { 0x01ffffef, 25 },
+    { 0x00fffff4, 24 }, { 0x00fffff5, 24 }, { 0x03ffffea, 26 }, { 0x007ffff4, 23 },
+    { 0x03ffffeb, 26 }, { 0x07ffffe6, 27 }, { 0x03ffffec, 26 }, { 0x03ffffed, 26 },
+    { 0x07ffffe7, 27 }, { 0x07ffffe8, 27 }, { 0x07ffffe9, 27 }, { 0x07ffffea, 27 },
+    { 0x07ffffeb, 27 }, { 0x0ffffffe, 28 }, { 0x07ffffec, 27 }, { 0x07ffffed, 27 },
+    { 0x07ffffee, 27 }, { 0x07ffffef, 27 }, { 0x07fffff0, 27 }, { 0x03ffffee, 26 },
+    { 0x3fffffff, 30 },
+};
+
+
+/* 257 leaves give a full binary tree with 256 inner nodes, leaves are
+ * stored as -(symbol + 1) so that zero still means "no child yet"
+ */
+static short huffman_tree[HUFFMAN_EOS][2];
+
+
+void
+init_hpack(void)
+{
+    int sym, bit, i, node, nodes = 1;
+
+    for (sym = 0; sym <= HUFFMAN_EOS; sym++) {
+        node = 0;
+        for (i = huffman_codes[sym].bits - 1; i >= 0; i--) {
+            bit = (huffman_codes[sym].code >> i) & 1;
+            if (!i) {
+                huffman_tree[node][bit] = -(sym + 1);
+            } else {
+                if (!huffman_tree[node][bit]) {
+                    huffman_tree[node][bit] = nodes++;
+                }
+                node = huffman_tree[node][bit];
+            }
+        }
+    }
+}
+
+
+static int
+huffman_decode(const unsigned char *in, size_t size, char *out, size_t out_size)
+{
+    size_t i, len = 0;
+    int bit, node = 0, depth = 0, ones = 1;
+
+    for (i = 0; i < size; i++) {
+        for (bit = 7; bit >= 0; bit--) {
+            node = huffman_tree[node][(in[i] >> bit) & 1];
+            depth++;
+            ones &= (in[i] >> bit) & 1;
+
+            if (node < 0) {
+                if (-node - 1 == HUFFMAN_EOS || len == out_size) {
+                    return -1;
+                }
+                out[len++] = -node - 1;
+                node = depth = 0;
+                ones = 1;
+            }
+        }
+    }
+
+    /* the padding is the most significant bits of EOS, so at most 7 ones */
+    if (depth > 7 || !ones) {
+        return -1;
+    }
+
+    return len;
+}
+
+
+static int
+decode_int(const unsigned char **p, const unsigned char *end,
+           int prefix, size_t *value)
+{
+    unsigned char b;
+    size_t v, shift = 0, mask = (1 << prefix) - 1;
+
+    if (*p >= end) {
+        return -1;
+    }
+
+    v = *(*p)++ & mask;
+    if (v == mask) {
+        do {
+            if (*p >= end || shift > 28) {
+                return -1;
+            }
+            b = *(*p)++;
+            v += (size_t)(b & 0x7f) << shift;
+            shift += 7;
+        } while (b & 0x80);
+    }
+
+    *value = v;
+
+    return 0;
+}
+
+
+static char *
+decode_string(const unsigned char **p, const unsigned char *end,
+              char *buf, size_t buf_size, size_t *pos)
+{
+    int len;
+    size_t size;
+    char *str = buf + *pos;
+    int huffman = (*p < end) && (**p & 0x80);
+
+    if (decode_int(p, end, 7, &size) || size > (size_t)(end - *p)) {
+        return NULL;
+    }
+
+    if (huffman) {
+        /* copy_string may have filled the buffer up to its end */
+        if (buf_size - *pos < 2) {
+            return NULL;
+        }
+        len = huffman_decode(*p, size, str, buf_size - *pos - 1);
+        if (len < 0) {
+            return NULL;
+        }
+    } else {
+        if (size >= buf_size - *pos) {
+            return NULL;
+        }
+        memcpy(str, *p, size);
+        len = size;
+    }
+
+    str[len] = '\0';
+    *pos += len + 1;
+    *p += size;
+
+    return str;
+}
+
+
+static char *
+copy_string(const char *src, char *buf, size_t buf_size, size_t *pos)
+{
+    char *str = buf + *pos;
+    size_t size = strlen(src);
+
+    if (size >= buf_size - *pos) {
+        return NULL;
+    }
+
+    memcpy(str, src, size + 1);
+    *pos += size + 1;
+
+    return str;
+}
+
+
+static void
+evict_entries(struct hpack_table *table, size_t max_size)
+{
+    struct hpack_entry *entry;
+
+    while (table->count && table->size > max_size) {
+        entry = &table->entries[(table->first + table->count - 1) % HPACK_TABLE_CAPACITY];
+        table->size -= entry->size;
+        free(entry->name);
+        table->count--;
+    }
+}
+
+
+static void
+add_entry(struct hpack_table *table, const char *name, const char *value)
+{
+    char *data;
+    size_t name_size = strlen(name), value_size = strlen(value);
+    size_t size = name_size + value_size + HPACK_ENTRY_OVERHEAD;
+    struct hpack_entry *entry;
+
+    evict_entries(table, (size > table->max_size) ? 0 : table->max_size - size);
+    if (size > table->max_size) {
+        return;
+    }
+
+    data = xmalloc(name_size + value_size + 2);
+    memcpy(data, name, name_size + 1);
+    memcpy(data + name_size + 1, value, value_size + 1);
+
+    table->first = (table->first + HPACK_TABLE_CAPACITY - 1) % HPACK_TABLE_CAPACITY;
+    entry = &table->entries[table->first];
+    entry->name = data;
+    entry->value = data + name_size + 1;
+    entry->size = size;
+
+    table->count++;
+    table->size += size;
+}
+
+
+static int
+lookup_entry(const struct hpack_table *table, size_t index,
+             const char **name, const char **value)
+{
+    const struct hpack_entry *entry;
+
+    if (!index) {
+        return -1;
+    }
+
+    if (index <= HPACK_STATIC_COUNT) {
+        *name = static_table[index].name;
+        *value = static_table[index].value;
+        return 0;
+    }
+
+    index -= HPACK_STATIC_COUNT + 1;
+    if (index >= table->count) {
+        return -1;
+    }
+
+    entry = &table->entries[(table->first + index) % HPACK_TABLE_CAPACITY];
+    *name = entry->name;
+    *value = entry->value;
+
+    return 0;
+}
+
+
+void
+hpack_table_init(struct hpack_table *table)
+{
+    table->first = table->count = table->size = 0;
+    table->max_size = HPACK_TABLE_SIZE;
+}
+
+
+void
+hpack_table_cleanup(struct hpack_table *table)
+{
+    evict_entries(table, 0);
+}
+
+
+int
+hpack_decode(struct hpack_table *table,
+             const unsigned char *in, size_t size,
+             char *buf, size_t buf_size,
+             void (*emit)(void *ctx, const char *name, const char *value),
+             void *ctx)
+{
+    int prefix;
+    size_t index, pos = 0;
+    const char *name, *value;
+    const unsigned char *p = in, *end = in + size;
+
+    while (p < end) {
+        if (*p & 0x80) {
+            /* indexed header field */
+            if (decode_int(&p, end, 7, &index) ||
+                lookup_entry(table, index, &name, &value) ||
+                !(name = copy_string(name, buf, buf_size, &pos)) ||
+                !(value = copy_string(value, buf, buf_size, &pos)))
+            {
+                return -1;
+            }
+        } else if ((*p & 0xe0) == 0x20) {
+            /* dynamic table size update */
+            if (decode_int(&p, end, 5, &index) || index > HPACK_TABLE_SIZE) {
+                return -1;
+            }
+            table->max_size = index;
+            evict_entries(table, index);
+            continue;
+        } else {
+            /* literal, with incremental indexing or not indexed */
+            prefix = (*p & 0x40) ? 6 : 4;
+
+            if (decode_int(&p, end, prefix, &index)) {
+                return -1;
+            }
+
+            if (index) {
+                if (lookup_entry(table, index, &name, &value) ||
+                    !(name = copy_string(name, buf, buf_size, &pos)))
+                {
+                    return -1;
+                }
+            } else if (!(name = decode_string(&p, end, buf, buf_size, &pos))) {
+                return -1;
+            }
+
+            if (!(value = decode_string(&p, end, buf, buf_size, &pos))) {
+                return -1;
+            }
+
+            if (prefix == 6) {
+                add_entry(table, name, value);
+            }
+        }
+
+        emit(ctx, name, value);
+    }
+
+    return 0;
+}
+
+
+static size_t
+encode_int(unsigned char *out, size_t value, int prefix, unsigned char flags)
+{
+    size_t len = 0, mask = (1 << prefix) - 1;
+
+    if (value < mask) {
+        out[len++] = flags | value;
+        return len;
+    }
+
+    out[len++] = flags | mask;
+    value -= mask;
+    while (value >= 0x80) {
+        out[len++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    out[len++] = value;
+
+    return len;
+}
+
+
+size_t
+hpack_encode_header(unsigned char *out, enum hpack_static_index name,
+                    const char *value, size_t value_size)
+{
+    size_t len;
+
+    /* literal header field without indexing, indexed name */
+    len = encode_int(out, name, 4, 0x00);
+    len += encode_int(out + len, value_size, 7, 0x00);
+    memcpy(out + len, value, value_size);
+
+    return len + value_size;
+}
+
+
+size_t
+hpack_encode_status(unsigned char *out, int status)
+{
+    size_t i;
+    char value[8];
+
+    for (i = HPACK_STATUS; i < HPACK_STATUS + 7; i++) {
+        if (atoi(static_table[i].value) == status) {
+            return encode_int(out, i, 7, 0x80);
+        }
+    }
+
+    sprintf(value, "%03d", status % 1000);
+
+    return hpack_encode_header(out, HPACK_STATUS, value, 3);
+}
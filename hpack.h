@@ -0,0 +1,53 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stddef.h>
+
+
+#define HPACK_TABLE_SIZE 4096
+#define HPACK_ENTRY_OVERHEAD 32
+
+
+/* indexes of the static table entries used for responses */
+enum hpack_static_index {
+    HPACK_STATUS         = 8,
+    HPACK_ACCEPT_RANGES  = 18,
+    HPACK_CACHE_CONTROL  = 24,
+    HPACK_CONTENT_LENGTH = 28,
+    HPACK_CONTENT_RANGE  = 30,
+    HPACK_CONTENT_TYPE   = 31,
+    HPACK_ETAG           = 34,
+    HPACK_EXPIRES        = 36,
+    HPACK_LAST_MODIFIED  = 44,
+    HPACK_SERVER         = 54,
+};
+
+
+struct hpack_entry {
+    char *name, *value;
+    size_t size;
+};
+
+
+struct hpack_table {
+    struct hpack_entry entries[HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD];
+    size_t first, count, size, max_size;
+};
+
+
+void init_hpack(void);
+
+void hpack_table_init(struct hpack_table *table);
+void hpack_table_cleanup(struct hpack_table *table);
+
+int hpack_decode(struct hpack_table *table,
+                 const unsigned char *in, size_t size,
+                 char *buf, size_t buf_size,
+                 void (*emit)(void *ctx, const char *name, const char *value),
+                 void *ctx);
+
+size_t hpack_encode_status(unsigned char *out, int status);
+size_t hpack_encode_header(unsigned char *out, enum hpack_static_index name,
+                           const char *value, size_t value_size);
+
+#endif
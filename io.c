@@ -1,21 +1,32 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <sys/sendfile.h>
 #include <fcntl.h>
 
 #include "io.h"
+#include "tls.h"
+#include "h2.h"
+#include "throttle.h"
+#include "admission.h"
+#include "arena.h"
+#include "proxy.h"
+#include "fileio.h"
+#include "upload.h"
+#include "app.h"
 #include "utils.h"
 #include "utlist.h"
+#include "trace.h"
+#include "config.h"
 
-#define REQ_BUF_SIZE 1024
 #define SENDFILE_CHUNK_SIZE 1024 * 512
 
 
-#define BUILD_IO_STEP(steps, meta, step_type, handler)                        \
+#define BUILD_IO_STEP(steps, step_alloc, meta, step_type, handler)            \
 do {                                                                          \
-    struct io_step *__step = xmalloc(sizeof(struct io_step));                 \
+    struct io_step *__step = step_alloc;                                      \
     __step->meta = meta;                                                      \
     __step->type = step_type;                                                 \
     __step->handler = handler;                                                \
@@ -23,16 +34,153 @@ do {                                                                          \
     LL_APPEND(*steps, __step);                                                \
 } while(0);
 
+#define HEAP_STEP (mem_charge(sizeof(struct io_step)), \
+                   xmalloc(sizeof(struct io_step)))
+#define ARENA_STEP(conn) arena_alloc(&(conn)->arena, sizeof(struct io_step))
+
+/* steps of a response live in the connection's arena */
+#define IS_ARENA_STEP(step) ((step)->type == S_WRITE ||    \
+                             (step)->type == S_SENDFILE || \
+                             (step)->type == S_PROXY ||    \
+                             (step)->type == S_FILE ||     \
+                             (step)->type == S_UPLOAD ||   \
+                             (step)->type == S_APP)
+
+
+/* requests are read here first, idle connections own no buffer */
+static __thread char scratch_data[MAX_REQ_SIZE];
+static __thread struct read_meta scratch;
+
+
+static ssize_t
+socket_read(struct connection *conn, void *buf, size_t size)
+{
+    return read(conn->fd, buf, size);
+}
+
+
+static ssize_t
+socket_send(struct connection *conn, const void *buf, size_t size, int flags)
+{
+    return send(conn->fd, buf, size, flags);
+}
+
+
+static ssize_t
+socket_sendfile(struct connection *conn, int fd, off_t *offset, size_t size)
+{
+    return sendfile(conn->fd, fd, offset, size);
+}
+
+
+static ssize_t
+socket_splice(struct connection *conn, int pipe_fd, size_t size)
+{
+    return splice(pipe_fd, NULL, conn->fd, NULL, size,
+                  SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+}
+
+
+const struct transport socket_transport = {
+    .read = socket_read,
+    .send = socket_send,
+    .sendfile = socket_sendfile,
+    .splice = socket_splice,
+};
+
+
+/* every byte moved is charged to the connection's budget for this turn,
+ * bytes sent are also paced by the throttle buckets
+ */
+
+ssize_t
+conn_read(struct connection *conn, void *buf, size_t size)
+{
+    ssize_t len = conn->transport->read(conn, buf, size);
+
+    if (len > 0) {
+        conn->budget -= len;
+    }
+
+    return len;
+}
+
+
+ssize_t
+conn_send(struct connection *conn, const void *buf, size_t size, int flags)
+{
+    ssize_t len;
+
+    if (!(size = throttle_allowance(conn, size))) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    len = conn->transport->send(conn, buf, size, flags);
+    if (len > 0) {
+        conn->budget -= len;
+        throttle_consume(conn, len);
+    }
+
+    return len;
+}
+
+
+ssize_t
+conn_sendfile(struct connection *conn, int fd, off_t *offset, size_t size)
+{
+    ssize_t len;
+
+    if (!(size = throttle_allowance(conn, size))) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    len = conn->transport->sendfile(conn, fd, offset, size);
+    if (len > 0) {
+        conn->budget -= len;
+        throttle_consume(conn, len);
+    }
+
+    return len;
+}
+
+
+/* plain sockets only, the pipe is filled by the caller */
+ssize_t
+conn_splice(struct connection *conn, int pipe_fd, size_t size)
+{
+    ssize_t len;
+
+    if (!(size = throttle_allowance(conn, size))) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    len = conn->transport->splice(conn, pipe_fd, size);
+    if (len > 0) {
+        conn->budget -= len;
+        throttle_consume(conn, len);
+    }
+
+    return len;
+}
+
 
 static enum io_step_status
-make_sendfile_step(int fd, struct sendfile_meta *meta)
+make_sendfile_step(struct connection *conn, struct sendfile_meta *meta)
 {
     off_t size;
     ssize_t sent_len;
 
     do {
+        if (conn->budget <= 0) {
+            return IO_YIELD;
+        }
+
         size = MIN(SENDFILE_CHUNK_SIZE, meta->size);
-        sent_len = sendfile(fd, meta->fd, &meta->start_offset, size);
+        size = MIN(size, conn->budget);
+        sent_len = conn_sendfile(conn, meta->fd, &meta->start_offset, size);
         if (sent_len < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 return IO_AGAIN;
@@ -49,13 +197,18 @@ make_sendfile_step(int fd, struct sendfile_meta *meta)
 
 
 static enum io_step_status
-make_write_step(int fd, struct send_meta *meta)
+make_write_step(struct connection *conn, struct send_meta *meta)
 {
     ssize_t write_size;
     int flags = (meta->more_ahead) ? MSG_MORE : 0;
 
     do {
-        write_size = send(fd, meta->data + meta->offset, meta->size, flags);
+        if (conn->budget <= 0) {
+            return IO_YIELD;
+        }
+
+        write_size = conn_send(conn, meta->data + meta->offset,
+                               meta->size - meta->offset, flags);
         if (write_size < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 return IO_AGAIN;
@@ -71,52 +224,118 @@ make_write_step(int fd, struct send_meta *meta)
 }
 
 
+static int
+request_complete(const char *data, size_t size)
+{
+    if (is_h2_preface_start(data, size)) {
+        return 0;
+    }
+
+    return memmem(data, size, "\r\n\r\n", 4) != NULL;
+}
+
+
+/* Reads into the thread's scratch buffer. A request that is not complete
+ * yet is moved to a buffer of its own size, holding the rest of the
+ * scratch buffer over an IO_AGAIN would tie it to one connection.
+ */
 static enum io_step_status
-make_read_step(int fd, struct read_meta *meta)
+make_read_step(struct connection *conn, struct io_step *step)
 {
-    ssize_t read_size, size;
+    ssize_t read_size;
+    struct read_meta *meta = step->meta;
+
+    scratch.data = scratch_data;
+    scratch.size = 0;
+    if (meta) {
+        memcpy(scratch.data, meta->data, meta->size);
+        scratch.size = meta->size;
+        mem_release(sizeof(struct read_meta) + meta->size);
+        free(meta);
+        step->meta = NULL;
+    }
 
-    do {
-        size = MIN(REQ_BUF_SIZE, MAX_REQ_SIZE - meta->size);
-        read_size = read(fd, meta->data + meta->size, size);
+    for (;;) {
+        read_size = conn_read(conn, scratch.data + scratch.size,
+                              MAX_REQ_SIZE - 1 - scratch.size);
 
         if (read_size < 1) {
             if (read_size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-                return IO_AGAIN;
+                break;
             }
 
             return IO_ERROR;
         }
 
-        meta->size += read_size;
-    } while (read_size == REQ_BUF_SIZE && meta->size < MAX_REQ_SIZE);
+        if (!scratch.size) {
+            conn->request_start = monotonic_us();
+        }
+        scratch.size += read_size;
+        if (request_complete(scratch.data, scratch.size)) {
+            scratch.data[scratch.size] = '\0';
+            step->meta = &scratch;
+            return IO_OK;
+        }
 
-    if (!meta->size || meta->size == MAX_REQ_SIZE) {
-        return IO_ERROR;
+        if (scratch.size == MAX_REQ_SIZE - 1) {
+            return IO_ERROR;
+        }
     }
-    meta->data[meta->size] = '\0';
 
-    return IO_OK;
+    if (scratch.size) {
+        meta = xmalloc(sizeof(struct read_meta) + scratch.size);
+        mem_charge(sizeof(struct read_meta) + scratch.size);
+        meta->size = scratch.size;
+        meta->data = (char *)(meta + 1);
+        memcpy(meta->data, scratch.data, scratch.size);
+        step->meta = meta;
+    }
+
+    return IO_AGAIN;
 }
 
 
 static enum io_step_status
-make_step(int fd, struct io_step *step)
+make_step(struct connection *conn, struct io_step *step)
 {
-    enum io_step_status s;
+    enum io_step_status s = IO_ERROR;
+    ssize_t budget = conn->budget;
+
+    TRACE2(step_start, conn->fd, step->type);
 
     switch (step->type) {
+    case S_HANDSHAKE:
+        s = tls_handshake(conn->tls);
+        break;
     case S_READ:
-        s = make_read_step(fd, step->meta);
+        s = make_read_step(conn, step);
         break;
     case S_WRITE:
-        s = make_write_step(fd, step->meta);
+        s = make_write_step(conn, step->meta);
         break;
     case S_SENDFILE:
-        s = make_sendfile_step(fd, step->meta);
+        s = make_sendfile_step(conn, step->meta);
+        break;
+    case S_H2:
+        s = make_h2_step(conn, step->meta);
+        break;
+    case S_PROXY:
+        s = make_proxy_step(conn, step->meta);
+        break;
+    case S_FILE:
+        s = fileio_ready(step->meta) ? IO_OK : IO_AGAIN;
+        break;
+    case S_UPLOAD:
+        s = make_upload_step(conn, step->meta);
+        break;
+    case S_APP:
+        s = app_ready(step->meta) ? IO_OK : IO_AGAIN;
         break;
     }
 
+    /* bytes are what this run moved, read or sent */
+    TRACE4(step_done, conn->fd, step->type, s, budget - conn->budget);
+
     return s;
 }
 
@@ -124,26 +343,46 @@ make_step(int fd, struct io_step *step)
 static void
 cleanup_step(struct io_step *step)
 {
-    struct send_meta *s_meta;
     struct sendfile_meta *sf_meta;
+    struct read_meta *r_meta;
 
     switch (step->type) {
+    case S_HANDSHAKE:
+        break;
     case S_READ:
-        free(step->meta);
+        r_meta = step->meta;
+        if (r_meta && r_meta != &scratch) {
+            mem_release(sizeof(struct read_meta) + r_meta->size);
+            free(r_meta);
+        }
         break;
     case S_WRITE:
-        s_meta = step->meta;
-        free(s_meta->data);
-        free(s_meta);
-        break;
+        return;
     case S_SENDFILE:
         sf_meta = step->meta;
-        close(sf_meta->fd);
-        free(sf_meta);
+        if (!sf_meta->shared_fd) {
+            close(sf_meta->fd);
+        }
+        return;
+    case S_H2:
+        cleanup_h2_session(step->meta);
         break;
+    case S_PROXY:
+        cleanup_proxy(step->meta);
+        return;
+    case S_FILE:
+        fileio_release(step->meta);
+        return;
+    case S_UPLOAD:
+        cleanup_upload(step->meta);
+        return;
+    case S_APP:
+        app_release(step->meta);
+        return;
     }
 
     free(step);
+    mem_release(sizeof(struct io_step));
 }
 
 
@@ -159,32 +398,45 @@ cleanup_steps(struct io_step *head)
 
 
 ALWAYS_INLINE void
-setup_sendfile_io_step(struct io_step **steps,
-                       int fd, off_t lower, off_t upper, off_t size,
+setup_sendfile_io_step(struct connection *conn,
+                       int fd, int shared_fd, off_t lower, off_t upper, off_t size,
                        enum conn_status (*handler)(struct connection *conn))
 {
-    struct sendfile_meta *meta = xmalloc(sizeof(struct sendfile_meta));
+    struct sendfile_meta *meta = arena_alloc(&conn->arena,
+                                             sizeof(struct sendfile_meta));
     meta->fd = fd;
+    meta->shared_fd = shared_fd;
     meta->start_offset = lower;
     meta->end_offset = upper;
     meta->size = size;
 
-    BUILD_IO_STEP(steps, meta, S_SENDFILE, handler)
+    BUILD_IO_STEP(&conn->steps, ARENA_STEP(conn), meta, S_SENDFILE, handler)
 }
 
 
+/* data has to come from the connection's arena too */
 ALWAYS_INLINE void
-setup_write_io_step(struct io_step **steps,
+setup_write_io_step(struct connection *conn,
                    char *data, int more_ahead, size_t size,
                    enum conn_status (*handler)(struct connection *conn))
 {
-    struct send_meta *meta = xmalloc(sizeof(struct send_meta));
+    struct send_meta *meta = arena_alloc(&conn->arena, sizeof(struct send_meta));
     meta->data = data;
     meta->more_ahead = more_ahead;
     meta->size = size;
     meta->offset = 0;
 
-    BUILD_IO_STEP(steps, meta, S_WRITE, handler)
+    BUILD_IO_STEP(&conn->steps, ARENA_STEP(conn), meta, S_WRITE, handler)
+}
+
+
+ALWAYS_INLINE void
+setup_handshake_io_step(struct io_step **steps,
+                        enum conn_status (*handler)(struct connection *conn))
+{
+    void *meta = NULL;
+
+    BUILD_IO_STEP(steps, HEAP_STEP, meta, S_HANDSHAKE, handler)
 }
 
 
@@ -192,23 +444,126 @@ ALWAYS_INLINE void
 setup_read_io_step(struct io_step **steps,
                    enum conn_status (*handler)(struct connection *conn))
 {
-    struct read_meta *meta = xmalloc(sizeof(struct read_meta));
-    meta->size = 0;
+    void *meta = NULL;
 
-    BUILD_IO_STEP(steps, meta, S_READ, handler)
+    BUILD_IO_STEP(steps, HEAP_STEP, meta, S_READ, handler)
 }
 
 
+ALWAYS_INLINE void
+setup_h2_io_step(struct io_step **steps, struct h2_session *session,
+                 enum conn_status (*handler)(struct connection *conn))
+{
+    void *meta = session;
+
+    BUILD_IO_STEP(steps, HEAP_STEP, meta, S_H2, handler)
+}
+
+
+ALWAYS_INLINE void
+setup_proxy_io_step(struct connection *conn, struct proxy *proxy,
+                    enum conn_status (*handler)(struct connection *conn))
+{
+    void *meta = proxy;
+
+    BUILD_IO_STEP(&conn->steps, ARENA_STEP(conn), meta, S_PROXY, handler)
+}
+
+
+/* parked until the I/O pool is done with the file, the step is woken by
+ * the worker's eventfd
+ */
+ALWAYS_INLINE void
+setup_file_io_step(struct connection *conn, struct file_waiter *waiter,
+                   enum conn_status (*handler)(struct connection *conn))
+{
+    void *meta = waiter;
+
+    BUILD_IO_STEP(&conn->steps, ARENA_STEP(conn), meta, S_FILE, handler)
+}
+
+
+ALWAYS_INLINE void
+setup_upload_io_step(struct connection *conn, struct upload *upload,
+                     enum conn_status (*handler)(struct connection *conn))
+{
+    void *meta = upload;
+
+    BUILD_IO_STEP(&conn->steps, ARENA_STEP(conn), meta, S_UPLOAD, handler)
+}
+
+
+/* parked until a deferred answer of a route's handler comes in, the step
+ * is woken by the worker's eventfd
+ */
+ALWAYS_INLINE void
+setup_app_io_step(struct connection *conn, struct rockepoll_pending *pending,
+                  enum conn_status (*handler)(struct connection *conn))
+{
+    void *meta = pending;
+
+    BUILD_IO_STEP(&conn->steps, ARENA_STEP(conn), meta, S_APP, handler)
+}
+
+
+/* waiting for the next request of a keep-alive connection, nothing read yet */
+int
+connection_is_idle(const struct connection *conn)
+{
+    const struct io_step *step = conn->steps;
+
+    return conn->served && step && !step->next && step->type == S_READ &&
+           !step->meta && !conn->queued && !conn->parked;
+}
+
+
+/* seconds of inactivity before the connection is dropped */
+int
+connection_timeout(const struct connection *conn)
+{
+    if (conn->steps && conn->steps->type == S_PROXY) {
+        return PROXY_TIMEOUT;
+    }
+    if (conn->steps && conn->steps->type == S_APP) {
+        return APP_TIMEOUT;
+    }
+
+    return KEEP_ALIVE_TIMEOUT;
+}
+
+
+/* a step waiting on someone else gets to answer before the close */
 void
+connection_timed_out(struct connection *conn)
+{
+    if (conn->steps && conn->steps->type == S_PROXY) {
+        proxy_timeout(conn, conn->steps->meta);
+    }
+}
+
+
+/* Runs the connection's steps until they block or the turn's budget of
+ * bytes and steps is spent. Returns 1 when it stopped because of the
+ * budget, then the caller has to come back to it as no new event will be
+ * reported for data that is already there.
+ */
+int
 process_connection(struct connection *conn)
 {
-    int run = 1;
+    int run = 1, yield = 0, steps_budget = CONN_STEP_BUDGET;
     enum io_step_status s;
     struct io_step *steps_head, *step;
 
+    conn->budget = CONN_BYTE_BUDGET;
+
     while (run && conn->steps) {
+        if (!steps_budget--) {
+            yield = 1;
+            break;
+        }
+
         steps_head = step = conn->steps;
-        s = make_step(conn->fd, steps_head);
+        s = make_step(conn, steps_head);
 
         switch(s) {
         case IO_OK:
@@ -219,14 +574,23 @@ process_connection(struct connection *conn)
             }
 
             /* cleanup IO step */
-            cleanup_step(step);
             LL_DELETE(steps_head, step);
+            cleanup_step(step);
+
+            /* the response is out, its memory goes back at once */
+            if (!steps_head || !IS_ARENA_STEP(steps_head)) {
+                arena_reset(&conn->arena);
+            }
 
             if (!steps_head) {
                 conn->status = C_CLOSE;
                 run = 0;
             }
             break;
+        case IO_YIELD:
+            yield = 1;
+            run = 0;
+            break;
         case IO_AGAIN:
             run = 0;
             break;
@@ -238,4 +602,6 @@ process_connection(struct connection *conn)
 
         conn->steps = steps_head;
     }
+
+    return yield && conn->status != C_CLOSE;
 }
@@ -3,12 +3,17 @@
 #define IO_H
 
 #include <time.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "throttle.h"
 
 #define MAX_REQ_SIZE 1024 * 8
 
 
-enum io_step_status {IO_OK, IO_AGAIN, IO_ERROR};
-enum io_step_type {S_READ, S_WRITE, S_SENDFILE};
+enum io_step_status {IO_OK, IO_AGAIN, IO_YIELD, IO_ERROR};
+enum io_step_type {S_HANDSHAKE, S_READ, S_WRITE, S_SENDFILE, S_H2, S_PROXY, S_FILE,
+                   S_UPLOAD, S_APP};
 enum conn_status {C_RUN, C_CLOSE};
 
 
@@ -21,18 +26,40 @@ struct send_meta {
 
 struct sendfile_meta {
     off_t start_offset, end_offset, size;
-    int fd;
+    int fd, shared_fd;
 };
 
 
+/* A read step has no meta while nothing was received. Once a whole
+ * request is in, its meta is the thread's scratch buffer, valid until the
+ * step's handler returns.
+ */
 struct read_meta {
-    char data[MAX_REQ_SIZE];
     size_t size;
+    char *data;
 };
 
 
+struct tls;
+struct h2_session;
+struct arena_block;
+struct proxy;
+struct file_waiter;
+struct upload;
+struct rockepoll_pending;
 struct connection;
 
+/* How bytes get to and from the peer: the socket itself, TLS records or
+ * memory for the benchmark. Budgets and throttling are applied on top.
+ */
+struct transport {
+    ssize_t (*read)(struct connection *conn, void *buf, size_t size);
+    ssize_t (*send)(struct connection *conn, const void *buf, size_t size, int flags);
+    ssize_t (*sendfile)(struct connection *conn, int fd, off_t *offset, size_t size);
+    ssize_t (*splice)(struct connection *conn, int pipe_fd, size_t size);
+};
+
+
 struct io_step {
     void *meta;
     enum io_step_type type;
@@ -42,30 +69,68 @@ struct io_step {
 
 
 struct connection {
-    int fd, keep_alive;
+    int fd, keep_alive, served, queued, parked;
     enum conn_status status;
-    time_t last_active;
-    char ip[16];
+    ssize_t budget;
+    struct bucket bucket;
+    int64_t wakeup;
+    int64_t request_start;  /* in microseconds, the first bytes of the request */
+    time_t accepted, last_active;
+    struct in6_addr addr;
+    const struct transport *transport;
+    struct tls *tls;
+    struct arena_block *arena;
     struct io_step *steps;
     struct connection *next;
     struct connection *prev;
+    struct connection *run_next;
+    struct connection *park_next;
 };
 
 
+extern const struct transport socket_transport;
+
+
+ssize_t conn_read(struct connection *conn, void *buf, size_t size);
+ssize_t conn_send(struct connection *conn, const void *buf, size_t size, int flags);
+ssize_t conn_sendfile(struct connection *conn, int fd, off_t *offset, size_t size);
+ssize_t conn_splice(struct connection *conn, int pipe_fd, size_t size);
+
 void cleanup_steps(struct io_step *head);
+int connection_is_idle(const struct connection *conn);
+int connection_timeout(const struct connection *conn);
+void connection_timed_out(struct connection *conn);
 
-void process_connection(struct connection *conn);
+int process_connection(struct connection *conn);
+
+void setup_handshake_io_step(struct io_step **steps,
+                             enum conn_status (*handler)(struct connection *conn));
 
 void setup_read_io_step(struct io_step **steps,
                         enum conn_status (*handler)(struct connection *conn));
 
-void setup_write_io_step(struct io_step **steps,
+void setup_write_io_step(struct connection *conn,
                         char *data, int more_ahead, size_t size,
                         enum conn_status (*handler)(struct connection *conn));
 
-void setup_sendfile_io_step(struct io_step **steps,
-                            int fd, off_t lower, off_t upper, off_t size,
+void setup_sendfile_io_step(struct connection *conn,
+                            int fd, int shared_fd, off_t lower, off_t upper, off_t size,
                             enum conn_status (*handler)(struct connection *conn));
 
+void setup_h2_io_step(struct io_step **steps, struct h2_session *session,
+                      enum conn_status (*handler)(struct connection *conn));
+
+void setup_proxy_io_step(struct connection *conn, struct proxy *proxy,
+                         enum conn_status (*handler)(struct connection *conn));
+
+void setup_file_io_step(struct connection *conn, struct file_waiter *waiter,
+                        enum conn_status (*handler)(struct connection *conn));
+
+void setup_upload_io_step(struct connection *conn, struct upload *upload,
+                          enum conn_status (*handler)(struct connection *conn));
+
+void setup_app_io_step(struct connection *conn, struct rockepoll_pending *pending,
+                       enum conn_status (*handler)(struct connection *conn));
+
 
 #endif
\ No newline at end of file
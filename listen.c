@@ -0,0 +1,304 @@
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <err.h>
+#include <pthread.h>
+
+#include "listen.h"
+#include "utils.h"
+#include "config.h"
+
+
+struct listen_spec listen_specs[MAX_LISTENERS];
+int listen_specs_count = 0;
+
+/* guards fds of the specs, workers open theirs at the same time */
+static pthread_mutex_t fds_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void
+parse_options(struct listen_spec *l, char *opts)
+{
+    char *opt, *value, *end;
+
+    for (opt = strtok(opts, ","); opt; opt = strtok(NULL, ",")) {
+        if ((value = strchr(opt, '='))) {
+            *value++ = '\0';
+        }
+
+        if (!strcmp(opt, "tls")) {
+            l->tls = 1;
+        } else if (!strcmp(opt, "v6only")) {
+            l->v6only = 1;
+        } else if (!strcmp(opt, "defer-accept")) {
+            l->defer_accept = 1;
+        } else if (!strcmp(opt, "backlog") && value) {
+            l->backlog = strtol(value, &end, 10);
+            if (end == value || *end) {
+                errx(1, "invalid backlog `%s'", value);
+            }
+        } else if (!strcmp(opt, "mode") && value) {
+            l->mode = strtol(value, &end, 8);
+            if (end == value || *end) {
+                errx(1, "invalid mode `%s'", value);
+            }
+        } else {
+            errx(1, "unknown listen option `%s'", opt);
+        }
+    }
+}
+
+
+/* unix:/path, [v6addr]:port or v4addr:port, each with ,option... */
+void
+add_listen_spec(const char *spec)
+{
+    struct listen_spec *l;
+    struct sockaddr_un *un;
+    struct sockaddr_in *in;
+    struct sockaddr_in6 *in6;
+    char *buf, *host, *port, *opts, *end;
+    long port_number;
+
+    if (listen_specs_count == MAX_LISTENERS) {
+        errx(1, "too many listeners, at most %d", MAX_LISTENERS);
+    }
+
+    l = &listen_specs[listen_specs_count];
+    memset(l, 0, sizeof(struct listen_spec));
+    l->backlog = -1;
+    l->fd = -1;
+
+    buf = xmalloc(strlen(spec) + 1);
+    strcpy(buf, spec);
+    if ((opts = strchr(buf, ','))) {
+        *opts++ = '\0';
+        parse_options(l, opts);
+    }
+    snprintf(l->name, sizeof(l->name), "%s", buf);
+
+    if (!strncmp(buf, "unix:", sizeof("unix:") - 1)) {
+        un = (struct sockaddr_un *)&l->addr;
+        host = buf + sizeof("unix:") - 1;
+        if (!*host || strlen(host) >= sizeof(un->sun_path)) {
+            errx(1, "invalid socket path `%s'", host);
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, host);
+        l->addr_size = sizeof(struct sockaddr_un);
+        listen_specs_count++;
+        free(buf);
+        return;
+    }
+
+    if (*buf == '[') {
+        host = buf + 1;
+        if (!(end = strchr(host, ']')) || end[1] != ':') {
+            errx(1, "invalid listen address `%s'", spec);
+        }
+        *end = '\0';
+        port = end + 2;
+    } else {
+        host = buf;
+        if (!(port = strrchr(buf, ':'))) {
+            errx(1, "missing port in `%s'", spec);
+        }
+        *port++ = '\0';
+    }
+
+    port_number = strtol(port, &end, 10);
+    if (end == port || *end || port_number < 0 || port_number > 65535) {
+        errx(1, "invalid port `%s'", port);
+    }
+
+    in = (struct sockaddr_in *)&l->addr;
+    in6 = (struct sockaddr_in6 *)&l->addr;
+    if (inet_pton(AF_INET, host, &in->sin_addr) == 1) {
+        in->sin_family = AF_INET;
+        in->sin_port = htons(port_number);
+        l->addr_size = sizeof(struct sockaddr_in);
+    } else if (inet_pton(AF_INET6, host, &in6->sin6_addr) == 1) {
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(port_number);
+        l->addr_size = sizeof(struct sockaddr_in6);
+    } else {
+        errx(1, "invalid listen address `%s'", host);
+    }
+
+    listen_specs_count++;
+    free(buf);
+}
+
+
+static int
+create_socket(const struct listen_spec *l)
+{
+    int fd, opt = 1;
+    int family = l->addr.ss_family;
+
+    if ((fd = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        err(1, "socket(), `%s'", l->name);
+    }
+
+    if (family != AF_UNIX &&
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)))
+    {
+        err(1, "setsockopt(), SOL_SOCKET, SO_REUSEPORT");
+    }
+
+    if (family == AF_INET6 &&
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &l->v6only, sizeof(l->v6only)))
+    {
+        err(1, "setsockopt(), IPPROTO_IPV6, IPV6_V6ONLY");
+    }
+
+    /* the connection is only accepted once the request is there */
+    if (l->defer_accept && family != AF_UNIX) {
+        opt = KEEP_ALIVE_TIMEOUT;
+        if (setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &opt, sizeof(opt))) {
+            warn("setsockopt(), IPPROTO_TCP, TCP_DEFER_ACCEPT");
+        }
+    }
+
+    if (bind(fd, (struct sockaddr *)&l->addr, l->addr_size) < 0) {
+        err(1, "bind(), `%s'", l->name);
+    }
+
+    if (listen(fd, l->backlog) < 0) {
+        err(1, "listen(), `%s'", l->name);
+    }
+
+    return fd;
+}
+
+
+static void
+add_fd(struct listen_spec *l, int fd)
+{
+    pthread_mutex_lock(&fds_lock);
+    if (l->fds_count == LISTEN_MAX_FDS) {
+        errx(1, "too many sockets for `%s', at most %d", l->name, LISTEN_MAX_FDS);
+    }
+    l->fds[l->fds_count++] = fd;
+    pthread_mutex_unlock(&fds_lock);
+}
+
+
+/* Unix sockets are bound before a chroot, a stale socket file left by a
+ * previous run is replaced. One handed over by an upgrade is kept as it is.
+ */
+void
+init_listeners(void)
+{
+    int i;
+    struct stat st;
+    struct listen_spec *l;
+    const char *path;
+
+    for (i = 0; i < listen_specs_count; i++) {
+        l = &listen_specs[i];
+        if (l->addr.ss_family != AF_UNIX) {
+            continue;
+        }
+
+        if (l->inherited) {
+            l->fd = l->fds[0];
+            continue;
+        }
+
+        path = ((struct sockaddr_un *)&l->addr)->sun_path;
+        if (!lstat(path, &st) && S_ISSOCK(st.st_mode)) {
+            unlink(path);
+        }
+
+        l->fd = create_socket(l);
+        add_fd(l, l->fd);
+        if (l->mode && chmod(path, l->mode) < 0) {
+            err(1, "chmod(), `%s'", path);
+        }
+    }
+}
+
+
+/* Takes the sockets of the spec called name from the previous process.
+ * Returns -1 when there is no such spec any more, the fds are closed.
+ */
+int
+listen_inherit(const char *name, const int *fds, int count)
+{
+    int i, j;
+    struct listen_spec *l;
+
+    for (i = 0; i < listen_specs_count; i++) {
+        l = &listen_specs[i];
+        if (strcmp(l->name, name) || l->inherited) {
+            continue;
+        }
+
+        for (j = 0; j < count; j++) {
+            /* a Unix socket is shared, one is enough */
+            if (l->addr.ss_family == AF_UNIX && j) {
+                close(fds[j]);
+                continue;
+            }
+            add_fd(l, fds[j]);
+        }
+        l->inherited = l->fds_count;
+
+        return 0;
+    }
+
+    for (j = 0; j < count; j++) {
+        close(fds[j]);
+    }
+
+    return -1;
+}
+
+
+/* The sockets of the spec a worker accepts on, returns how many. Inherited
+ * TCP sockets are dealt out over the workers, none of them may be left
+ * alone or the connections the kernel hashes to it would wait forever.
+ */
+int
+open_listeners(struct listen_spec *l, int worker, int workers, int *fds)
+{
+    int i, count = 0;
+
+    if (l->fd >= 0) {
+        fds[0] = l->fd;
+        return 1;
+    }
+
+    for (i = worker; i < l->inherited; i += workers) {
+        fds[count++] = l->fds[i];
+    }
+    if (count) {
+        return count;
+    }
+
+    fds[0] = create_socket(l);
+    add_fd(l, fds[0]);
+
+    return 1;
+}
+
+
+/* a copy of the spec's sockets as they are now, for the next process */
+int
+listen_fds(struct listen_spec *l, int *fds)
+{
+    int count;
+
+    pthread_mutex_lock(&fds_lock);
+    count = l->fds_count;
+    memcpy(fds, l->fds, sizeof(int) * count);
+    pthread_mutex_unlock(&fds_lock);
+
+    return count;
+}
@@ -0,0 +1,36 @@
+#ifndef LISTEN_H
+#define LISTEN_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+
+#define LISTEN_MAX_FDS 64  /* sockets of a spec, one per worker for TCP */
+
+
+/* A --listen spec. TCP sockets are opened by every worker with
+ * SO_REUSEPORT, a Unix socket is opened once and shared by all of them.
+ * fds are all the sockets of the spec in this process, the first
+ * inherited of them came from the process this one took over from.
+ */
+struct listen_spec {
+    int tls, backlog, v6only, defer_accept, fd;
+    int fds[LISTEN_MAX_FDS], fds_count, inherited;
+    mode_t mode;
+    struct sockaddr_storage addr;
+    socklen_t addr_size;
+    char name[128];
+};
+
+
+extern struct listen_spec listen_specs[];
+extern int listen_specs_count;
+
+
+void add_listen_spec(const char *spec);
+void init_listeners(void);
+int listen_inherit(const char *name, const int *fds, int count);
+int open_listeners(struct listen_spec *spec, int worker, int workers, int *fds);
+int listen_fds(struct listen_spec *spec, int *fds);
+
+#endif
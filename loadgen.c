@@ -0,0 +1,570 @@
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <err.h>
+#include <pthread.h>
+
+
+/* A keep-alive load over loopback for the training run of make pgo and
+ * for comparing builds. Without --replay every connection goes through
+ * the same mix of requests: small and large files, an index page, ranges
+ * and misses. With --replay the requests are rebuilt from an access log
+ * of rockepoll and the statuses it logged are checked.
+ */
+
+#define LOAD_BUF_SIZE (1024 * 64)
+#define MAX_TARGET_SIZE (1024 * 4)
+#define REPLAY_REQUEST_SIZE (MAX_TARGET_SIZE * 3 + 1024)
+#define MAX_MISMATCHES_SHOWN 10
+
+
+static const char *const mix[] = {
+    "GET / HTTP/1.1\r\nHost: load\r\n\r\n",
+    "GET /small.txt HTTP/1.1\r\nHost: load\r\n\r\n",
+    "GET /style.css HTTP/1.1\r\nHost: load\r\nUser-Agent: rockepoll-load\r\n\r\n",
+    "GET /medium.bin HTTP/1.1\r\nHost: load\r\n\r\n",
+    "GET /small.txt HTTP/1.1\r\nHost: load\r\n\r\n",
+    "GET /large.bin HTTP/1.1\r\nHost: load\r\n\r\n",
+    "GET /large.bin HTTP/1.1\r\nHost: load\r\nRange: bytes=0-1023\r\n\r\n",
+    "GET /medium.bin HTTP/1.1\r\nHost: load\r\nRange: bytes=100-199,5000-5999,-64\r\n\r\n",
+    "GET /missing.html HTTP/1.1\r\nHost: load\r\n\r\n",
+    "HEAD /large.bin HTTP/1.1\r\nHost: load\r\n\r\n",
+    "GET /dir/ HTTP/1.1\r\nHost: load\r\n\r\n",
+    "GET /small.txt HTTP/1.1\r\nHost: load\r\nIf-Match: nothing\r\n\r\n",
+};
+
+
+/* status is what the log recorded, 0 when it is not checked; at is the
+ * offset in seconds from the first request of the log
+ */
+struct request {
+    char *data;
+    size_t size;
+    int head;
+    int status;
+    double at;
+};
+
+
+struct worker {
+    pthread_t tid;
+    long done, failed, mismatched;
+    size_t bytes;
+};
+
+
+static struct sockaddr_storage server_addr;
+static socklen_t server_addr_size;
+
+static struct request *requests;
+static long requests_count, total;
+static double log_span;
+
+static atomic_long next_request;
+static atomic_long mismatches_shown;
+/* in nanoseconds per issued request, -1 when it failed */
+static long *latencies;
+
+static int paced;
+static double speed = 1;
+static struct timespec start;
+
+
+static int
+connect_server(void)
+{
+    int fd, opt = 1;
+
+    if ((fd = socket(server_addr.ss_family, SOCK_STREAM, 0)) < 0) {
+        err(1, "socket()");
+    }
+    if (connect(fd, (struct sockaddr *)&server_addr, server_addr_size) < 0) {
+        err(1, "connect()");
+    }
+    if (server_addr.ss_family == AF_INET) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    }
+
+    return fd;
+}
+
+
+/* Returns the bytes of the whole response, 0 when the connection broke.
+ * closed is set when the server closes the connection after it.
+ */
+static size_t
+read_response(int fd, char *buf, int head, int *status, int *closed)
+{
+    ssize_t len;
+    size_t size = 0, header_size, body_size = 0;
+    char *end, *cl;
+
+    for (;;) {
+        len = read(fd, buf + size, LOAD_BUF_SIZE - 1 - size);
+        if (len <= 0) {
+            return 0;
+        }
+        size += len;
+        buf[size] = '\0';
+        if ((end = strstr(buf, "\r\n\r\n"))) {
+            break;
+        }
+        if (size == LOAD_BUF_SIZE - 1) {
+            return 0;
+        }
+    }
+
+    if (sscanf(buf, "HTTP/%*d.%*d %d", status) != 1) {
+        return 0;
+    }
+
+    /* headers are looked up in the head only */
+    header_size = end + 4 - buf;
+    end[2] = '\0';
+    *closed = strcasestr(buf, "\r\nConnection: close\r\n") != NULL;
+    if (!head && (cl = strcasestr(buf, "\r\nContent-Length:"))) {
+        body_size = strtoull(cl + sizeof("\r\nContent-Length:") - 1, NULL, 10);
+    }
+
+    /* the rest of the body is read and dropped */
+    size -= header_size;
+    while (size < body_size) {
+        len = read(fd, buf, body_size - size < LOAD_BUF_SIZE
+                            ? body_size - size : LOAD_BUF_SIZE);
+        if (len <= 0) {
+            return 0;
+        }
+        size += len;
+    }
+
+    return header_size + body_size;
+}
+
+
+static long
+elapsed_ns(const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000000000L + (to->tv_nsec - from->tv_nsec);
+}
+
+
+/* Sleeps until the moment the i-th request was made in the log, later
+ * passes over the log follow the first one
+ */
+static void
+wait_for_turn(long i)
+{
+    double at;
+    struct timespec ts;
+
+    at = (requests[i % requests_count].at + (i / requests_count) * log_span) / speed;
+    ts.tv_sec = start.tv_sec + (time_t)at;
+    ts.tv_nsec = start.tv_nsec + (long)((at - (time_t)at) * 1e9);
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+
+static void *
+run_worker(void *arg)
+{
+    int fd, status, closed;
+    long i;
+    size_t size;
+    const struct request *req;
+    char *buf = malloc(LOAD_BUF_SIZE);
+    struct worker *w = arg;
+    struct timespec sent, received;
+
+    if (!buf) {
+        err(1, "malloc()");
+    }
+
+    fd = connect_server();
+    while ((i = atomic_fetch_add(&next_request, 1)) < total) {
+        req = &requests[i % requests_count];
+        if (paced) {
+            wait_for_turn(i);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &sent);
+        if (write(fd, req->data, req->size) < 0 ||
+            !(size = read_response(fd, buf, req->head, &status, &closed)))
+        {
+            /* a broken connection is counted and replaced */
+            latencies[i] = -1;
+            w->failed++;
+            close(fd);
+            fd = connect_server();
+            continue;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &received);
+        if (closed) {
+            close(fd);
+            fd = connect_server();
+        }
+
+        latencies[i] = elapsed_ns(&sent, &received);
+        w->done++;
+        w->bytes += size;
+        if (req->status && req->status != status) {
+            w->mismatched++;
+            if (atomic_fetch_add(&mismatches_shown, 1) < MAX_MISMATCHES_SHOWN) {
+                fprintf(stderr, "expected %d, got %d: %.*s\n", req->status, status,
+                        (int)strcspn(req->data, "\r"), req->data);
+            }
+        }
+    }
+
+    close(fd);
+    free(buf);
+
+    return NULL;
+}
+
+
+static void
+load_mix(void)
+{
+    size_t i;
+
+    requests_count = sizeof(mix) / sizeof(*mix);
+    if (!(requests = calloc(requests_count, sizeof(struct request)))) {
+        err(1, "calloc()");
+    }
+    for (i = 0; i < sizeof(mix) / sizeof(*mix); i++) {
+        requests[i].data = (char *)mix[i];
+        requests[i].size = strlen(mix[i]);
+        requests[i].head = !strncmp(mix[i], "HEAD", 4);
+    }
+}
+
+
+/* Puts back the percent-encoding the server took off before logging */
+static char *
+encode_target(const char *target, char *buf)
+{
+    char *p = buf;
+
+    for (; *target; target++) {
+        if ((unsigned char)*target <= ' ' || (unsigned char)*target >= 0x7f ||
+            strchr("%\"#?", *target))
+        {
+            p += sprintf(p, "%%%02X", (unsigned char)*target);
+        } else {
+            *p++ = *target;
+        }
+    }
+    *p = '\0';
+
+    return buf;
+}
+
+
+/* Rebuilds a request from a line of the access log:
+ *
+ *   [Sun, 18/Oct/2026 09:12:01 GMT] 127.0.0.1 "GET /a.txt HTTP/1.1" 200 6 "curl/8" [time]
+ *
+ * The optional last column is the time of the request in seconds, with
+ * a fraction, and takes over from the one second resolution of the
+ * timestamp. Lines of bad requests and of methods with a body, which the
+ * log does not keep, are skipped. Ranges are not logged either, a 206 is
+ * asked for again as the same number of bytes from the start of the file.
+ */
+static int
+parse_log_line(char *line, const char *host, struct request *req, double *at)
+{
+    int status;
+    unsigned long content_length;
+    char *p, *q, *method, *target, *user_agent, *end;
+    char buf[REPLAY_REQUEST_SIZE], encoded[MAX_TARGET_SIZE * 3 + 1];
+    struct tm tm = {0};
+    size_t size;
+
+    if (*line != '[' || !(p = strptime(line + 1, "%a, %d/%b/%Y %H:%M:%S GMT]", &tm))) {
+        return -1;
+    }
+    *at = timegm(&tm);
+
+    /* the address, then the request line up to the quote before the status */
+    if (!(p = strchr(p + 1, ' ')) || *++p != '"' ||
+        !(q = strstr(p + 1, "\" ")) || sscanf(q + 2, "%d %lu", &status, &content_length) != 2)
+    {
+        return -1;
+    }
+    method = p + 1;
+    *q = '\0';
+    if (!(target = strchr(method, ' ')) || !(end = strrchr(target, ' ')) ||
+        end == target || strncmp(end, " HTTP/", 6) || target[1] != '/')
+    {
+        return -1;
+    }
+    *target = '\0';
+    target += 2;
+    *end = '\0';
+    if (strcmp(method, "GET") && strcmp(method, "HEAD") &&
+        strcmp(method, "OPTIONS") && strcmp(method, "DELETE"))
+    {
+        return -1;
+    }
+    if (strlen(target) >= MAX_TARGET_SIZE) {
+        return -1;
+    }
+
+    user_agent = NULL;
+    if ((p = strchr(q + 2, '"')) && (end = strrchr(p + 1, '"'))) {
+        *end = '\0';
+        if (strcmp(p + 1, "-")) {
+            user_agent = p + 1;
+        }
+        if ((p = end + 1 + strspn(end + 1, " ")) && *p && *p != '\n') {
+            *at = strtod(p, NULL);
+        }
+    }
+
+    size = snprintf(buf, sizeof(buf), "%s /%s HTTP/1.1\r\nHost: %s\r\n",
+                    method, encode_target(target, encoded), host);
+    if (user_agent && size < sizeof(buf)) {
+        size += snprintf(buf + size, sizeof(buf) - size, "User-Agent: %s\r\n", user_agent);
+    }
+    if (status == 206 && content_length && size < sizeof(buf)) {
+        size += snprintf(buf + size, sizeof(buf) - size, "Range: bytes=0-%lu\r\n",
+                         content_length - 1);
+    }
+    if (size + 2 >= sizeof(buf)) {
+        return -1;
+    }
+    memcpy(buf + size, "\r\n", 3);
+    size += 2;
+
+    if (!(req->data = strdup(buf))) {
+        err(1, "strdup()");
+    }
+    req->size = size;
+    req->head = !strcmp(method, "HEAD");
+    req->status = status;
+
+    return 0;
+}
+
+
+static void
+load_replay(const char *path, const char *host)
+{
+    FILE *f;
+    char *line = NULL;
+    size_t line_size = 0, allocated = 0;
+    long skipped = 0;
+    double at, first = 0, last = 0;
+    struct request *tmp;
+
+    if (!(f = fopen(path, "r"))) {
+        err(1, "fopen(%s)", path);
+    }
+
+    while (getline(&line, &line_size, f) != -1) {
+        if ((size_t)requests_count == allocated) {
+            allocated = allocated ? allocated * 2 : 1024;
+            if (!(tmp = realloc(requests, allocated * sizeof(struct request)))) {
+                err(1, "realloc()");
+            }
+            requests = tmp;
+        }
+        if (parse_log_line(line, host, &requests[requests_count], &at)) {
+            skipped++;
+            continue;
+        }
+        if (!requests_count) {
+            first = at;
+        }
+        /* a log may be written out of order by a few requests */
+        requests[requests_count].at = at > first ? at - first : 0;
+        if (at > last) {
+            last = at;
+        }
+        requests_count++;
+    }
+
+    free(line);
+    fclose(f);
+
+    if (!requests_count) {
+        errx(1, "no requests to replay in `%s'", path);
+    }
+    /* a pass over the log lasts until the next one second after the last
+     * request, so cycles do not pile the last and first requests together
+     */
+    log_span = last - first + 1;
+
+    fprintf(stderr, "replaying %ld requests, %ld lines skipped\n", requests_count, skipped);
+}
+
+
+static int
+compare_latencies(const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
+
+    return (x > y) - (x < y);
+}
+
+
+static void
+print_latencies(void)
+{
+    long i, n = 0;
+    size_t j;
+    static const struct {
+        const char *name;
+        double q;
+    } percentiles[] = {
+        {"p50", 0.5}, {"p90", 0.9}, {"p99", 0.99}, {"p999", 0.999}, {"max", 1},
+    };
+
+    for (i = 0; i < total; i++) {
+        if (latencies[i] >= 0) {
+            latencies[n++] = latencies[i];
+        }
+    }
+    if (!n) {
+        return;
+    }
+
+    qsort(latencies, n, sizeof(long), compare_latencies);
+    for (j = 0; j < sizeof(percentiles) / sizeof(*percentiles); j++) {
+        i = (long)(percentiles[j].q * (n - 1));
+        printf("latency_%s_us %.1f\n", percentiles[j].name, latencies[i] / 1e3);
+    }
+}
+
+
+static void
+usage(const char *name)
+{
+    printf("usage: %s port|unix:path requests connections [--replay log]"
+           " [--paced] [--speed factor] [--host name]\n", name);
+    exit(1);
+}
+
+
+/* a port on loopback or unix:path */
+static void
+parse_target(const char *target)
+{
+    struct sockaddr_in *sin = (struct sockaddr_in *)&server_addr;
+    struct sockaddr_un *sun = (struct sockaddr_un *)&server_addr;
+
+    if (!strncmp(target, "unix:", sizeof("unix:") - 1)) {
+        target += sizeof("unix:") - 1;
+        if (strlen(target) >= sizeof(sun->sun_path)) {
+            errx(1, "socket path too long `%s'", target);
+        }
+        sun->sun_family = AF_UNIX;
+        strcpy(sun->sun_path, target);
+        server_addr_size = sizeof(struct sockaddr_un);
+    } else {
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(atoi(target));
+        sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        server_addr_size = sizeof(struct sockaddr_in);
+    }
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    int i, connections;
+    long done = 0, failed = 0, mismatched = 0;
+    size_t bytes = 0;
+    double wall;
+    const char *replay = NULL, *host = "load";
+    struct worker *workers;
+    struct timespec end;
+
+    if (argc < 4) {
+        usage(argv[0]);
+    }
+
+    parse_target(argv[1]);
+    total = atol(argv[2]);
+    if ((connections = atoi(argv[3])) < 1) {
+        errx(1, "invalid number of connections `%s'", argv[3]);
+    }
+
+    for (i = 4; i < argc; i++) {
+        if (!strcmp(argv[i], "--replay") && i + 1 < argc) {
+            replay = argv[++i];
+        } else if (!strcmp(argv[i], "--paced")) {
+            paced = 1;
+        } else if (!strcmp(argv[i], "--speed") && i + 1 < argc) {
+            if ((speed = strtod(argv[++i], NULL)) <= 0) {
+                errx(1, "invalid speed `%s'", argv[i]);
+            }
+        } else if (!strcmp(argv[i], "--host") && i + 1 < argc) {
+            host = argv[++i];
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    if (replay) {
+        load_replay(replay, host);
+    } else {
+        load_mix();
+    }
+    /* 0 requests replays the log once */
+    if (!total) {
+        total = requests_count;
+    }
+
+    if (!(latencies = calloc(total, sizeof(long)))) {
+        err(1, "calloc()");
+    }
+    if (!(workers = calloc(connections, sizeof(struct worker)))) {
+        err(1, "calloc()");
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < connections; i++) {
+        if ((errno = pthread_create(&workers[i].tid, NULL, run_worker, &workers[i]))) {
+            err(1, "pthread_create()");
+        }
+    }
+    for (i = 0; i < connections; i++) {
+        pthread_join(workers[i].tid, NULL);
+        done += workers[i].done;
+        failed += workers[i].failed;
+        mismatched += workers[i].mismatched;
+        bytes += workers[i].bytes;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    wall = elapsed_ns(&start, &end) / 1e9;
+
+    printf("requests %ld\n", done);
+    printf("failed %ld\n", failed);
+    printf("mismatched %ld\n", mismatched);
+    printf("seconds %.3f\n", wall);
+    printf("requests_per_second %.0f\n", done / wall);
+    printf("bytes %zu\n", bytes);
+    print_latencies();
+
+    free(workers);
+    free(latencies);
+
+    return failed != 0;
+}
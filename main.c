@@ -0,0 +1,8 @@
+#include "rockepoll.h"
+
+
+int
+main(int argc, char *argv[])
+{
+    return rockepoll_main(argc, argv);
+}
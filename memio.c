@@ -0,0 +1,136 @@
+#include <errno.h>
+#include <string.h>
+
+#include "memio.h"
+#include "utils.h"
+
+
+/* A peer living in memory: input is handed out in scripted chunks, output
+ * is taken in chunks and counted, every so often a call fails with EAGAIN
+ * as a full or empty socket would. Files are never read, sendfile only
+ * moves the offset, so what is measured is the server's own work.
+ */
+
+static int
+scripted_eagain(struct memio *m)
+{
+    if (m->script.eagain_every && !(++m->calls % m->script.eagain_every)) {
+        errno = EAGAIN;
+        return 1;
+    }
+
+    return 0;
+}
+
+
+static size_t
+chunk(size_t size, size_t limit)
+{
+    return limit ? MIN(size, limit) : size;
+}
+
+
+static ssize_t
+memory_read(struct connection *conn, void *buf, size_t size)
+{
+    struct memio *m = (struct memio *)conn;
+
+    if (scripted_eagain(m)) {
+        return -1;
+    }
+
+    if (m->in_offset == m->in_size) {
+        if (m->eof) {
+            return 0;
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+
+    size = chunk(MIN(size, m->in_size - m->in_offset), m->script.read_chunk);
+    memcpy(buf, m->in + m->in_offset, size);
+    m->in_offset += size;
+
+    return size;
+}
+
+
+static ssize_t
+memory_send(struct connection *conn, const void *buf, size_t size,
+            int flags UNUSED)
+{
+    struct memio *m = (struct memio *)conn;
+
+    if (scripted_eagain(m)) {
+        return -1;
+    }
+
+    size = chunk(size, m->script.send_chunk);
+    if (m->out_size < m->out_cap) {
+        memcpy(m->out + m->out_size, buf, MIN(size, m->out_cap - m->out_size));
+    }
+    m->out_size += size;
+    m->out_bytes += size;
+
+    return size;
+}
+
+
+static ssize_t
+memory_sendfile(struct connection *conn, int fd UNUSED, off_t *offset,
+                size_t size)
+{
+    struct memio *m = (struct memio *)conn;
+
+    if (scripted_eagain(m)) {
+        return -1;
+    }
+
+    size = chunk(size, m->script.send_chunk);
+    *offset += size;
+    m->out_size += size;
+    m->out_bytes += size;
+
+    return size;
+}
+
+
+static ssize_t
+memory_splice(struct connection *conn UNUSED, int pipe_fd UNUSED,
+              size_t size UNUSED)
+{
+    errno = EINVAL;
+    return -1;
+}
+
+
+const struct transport memory_transport = {
+    .read = memory_read,
+    .send = memory_send,
+    .sendfile = memory_sendfile,
+    .splice = memory_splice,
+};
+
+
+void
+memio_init(struct memio *m, const struct memio_script *script,
+           char *out, size_t out_cap)
+{
+    memset(m, 0, sizeof(*m));
+    m->conn.fd = -1;
+    m->conn.transport = &memory_transport;
+    m->script = *script;
+    m->out = out;
+    m->out_cap = out_cap;
+}
+
+
+/* data is not copied, it has to outlive the request */
+void
+memio_feed(struct memio *m, const char *data, size_t size)
+{
+    m->in = data;
+    m->in_size = size;
+    m->in_offset = 0;
+    m->out_size = 0;
+}
@@ -0,0 +1,35 @@
+#ifndef MEMIO_H
+#define MEMIO_H
+
+#include <stddef.h>
+
+#include "io.h"
+
+
+/* how the in-memory peer misbehaves, 0 is no limit */
+struct memio_script {
+    size_t read_chunk, send_chunk;  /* most bytes a single call moves */
+    unsigned eagain_every;          /* every nth call fails with EAGAIN */
+};
+
+
+/* the connection comes first, the transport finds its state from it */
+struct memio {
+    struct connection conn;
+    struct memio_script script;
+    const char *in;
+    size_t in_size, in_offset;
+    char *out;                      /* the head of the output is kept here */
+    size_t out_cap, out_size, out_bytes;
+    unsigned calls;
+    int eof;
+};
+
+
+extern const struct transport memory_transport;
+
+void memio_init(struct memio *m, const struct memio_script *script,
+                char *out, size_t out_cap);
+void memio_feed(struct memio *m, const char *data, size_t size);
+
+#endif
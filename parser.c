@@ -1,4 +1,5 @@
 #include <string.h>
+#include <strings.h>
 
 #include "utils.h"
 #include "parser.h"
@@ -100,6 +101,62 @@ remove_target_dots(char *url)
 }
 
 
+int
+parse_target(char *target, struct http_request *req)
+{
+    decode_target(target);
+    if (!(target = remove_target_dots(target))) {
+        return -1;
+    }
+    // skip /
+    req->target = ++target;
+
+    return 0;
+}
+
+
+/* Whether the path of a raw target, once decoded, has no empty or dot
+ * segments and no escaped slash, so that parse_target leaves its segments
+ * as they are.
+ */
+int
+target_is_normal(const char *target, size_t size)
+{
+    const char *p = target, *end = target + size;
+    size_t len = 0, dots = 0;
+    int started = 0;
+    char c;
+
+    while (p < end) {
+        c = *p++;
+        if (c == '%' && end - p >= 2) {
+            c = decode_hex((unsigned char)p[0]) << 4 |
+                decode_hex((unsigned char)p[1]);
+            if (c == '/') {
+                return 0;
+            }
+            p += 2;
+        }
+        if (c == '?') {
+            break;
+        }
+
+        if (c == '/') {
+            if (started && len == dots && len <= 2) {
+                return 0;
+            }
+            started = 1;
+            len = dots = 0;
+        } else {
+            len++;
+            dots += c == '.';
+        }
+    }
+
+    return !(started && len == dots && len && len <= 2);
+}
+
+
 int
 parse_request(char *data, struct http_request *req)
 {
@@ -131,12 +188,9 @@ parse_request(char *data, struct http_request *req)
 
     *q++ = '\0';
 
-    decode_target(p);
-    if (!(p = remove_target_dots(p))) {
+    if (parse_target(p, req)) {
         return -1;
     }
-    // skip /
-    req->target = ++p;
 
     p = q;
 
@@ -193,7 +247,9 @@ parse_request(char *data, struct http_request *req)
 
     while (strncmp(p, "\r\n", sizeof("\r\n") - 1)) {
         for (i = 0; i < HEADERS_COUNT; i++) {
-            if (!strncmp(p, http_headers[i].name, http_headers[i].size)) {
+            if (!strncasecmp(p, http_headers[i].name, http_headers[i].size) &&
+                p[http_headers[i].size] == ':')
+            {
                 p += http_headers[i].size;
                 break;
             }
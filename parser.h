@@ -20,17 +20,27 @@ enum http_header {
     H_CONNECTION,
     H_USER_AGENT,
     H_ACCEPT_ENCODING,
+    H_UPGRADE,
+    H_HTTP2_SETTINGS,
+    H_CONTENT_LENGTH,
+    H_TRANSFER_ENCODING,
+    H_EXPECT,
+    H_HOST,
     HEADERS_COUNT,
 };
 
-enum http_method {M_GET, M_POST, M_OPTIONS, M_DELETE, M_HEAD, M_PATCH, HTTP_METHODS_COUNT};
+enum http_method {M_GET, M_POST, M_OPTIONS, M_DELETE, M_HEAD, M_PATCH, M_PUT, HTTP_METHODS_COUNT};
 enum http_version {V10, V11, V20};
 
+struct vhost;
+
+/* host is the virtual host the Host header routed the request to */
 struct http_request {
     enum http_method method;
     enum http_version version;
     char *target;
     char *headers[HEADERS_COUNT];
+    const struct vhost *host;
 };
 
 
@@ -39,7 +49,13 @@ ENUM_MAPPING(http_headers) {
     MAPPING_ENTRY(H_CONNECTION, "Connection"),
     MAPPING_ENTRY(H_IF_MATCH,   "If-Match"),
     MAPPING_ENTRY(H_USER_AGENT, "User-Agent"),
-    MAPPING_ENTRY(H_ACCEPT_ENCODING, "Accept-Encoding")
+    MAPPING_ENTRY(H_ACCEPT_ENCODING, "Accept-Encoding"),
+    MAPPING_ENTRY(H_UPGRADE,    "Upgrade"),
+    MAPPING_ENTRY(H_HTTP2_SETTINGS, "HTTP2-Settings"),
+    MAPPING_ENTRY(H_CONTENT_LENGTH, "Content-Length"),
+    MAPPING_ENTRY(H_TRANSFER_ENCODING, "Transfer-Encoding"),
+    MAPPING_ENTRY(H_EXPECT,     "Expect"),
+    MAPPING_ENTRY(H_HOST,       "Host"),
 };
 
 
@@ -49,17 +65,20 @@ ENUM_MAPPING(http_methods) {
     MAPPING_ENTRY(M_DELETE,  "DELETE"),
     MAPPING_ENTRY(M_OPTIONS, "OPTIONS"),
     MAPPING_ENTRY(M_HEAD,    "HEAD"),
-    MAPPING_ENTRY(M_PATCH,    "PATCH")
+    MAPPING_ENTRY(M_PATCH,    "PATCH"),
+    MAPPING_ENTRY(M_PUT,     "PUT"),
 };
 
 
 ENUM_MAPPING(http_versions) {
     MAPPING_ENTRY(V10, "1.0"),
     MAPPING_ENTRY(V11, "1.1"),
-    MAPPING_ENTRY(V20, "1.2"),
+    MAPPING_ENTRY(V20, "2.0"),
 };
 
 
+int parse_target(char *target, struct http_request *r);
+int target_is_normal(const char *target, size_t size);
 int parse_request(char *data, struct http_request *r);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,82 @@
+#include <string.h>
+#include <stdlib.h>
+#include <err.h>
+
+#include "peers.h"
+#include "utils.h"
+#include "config.h"
+
+
+#define PEER_SLOTS_MASK (PEER_SLOTS - 1)
+#define PEER_PROBES 8
+/* after this long a bucket has refilled, so the slot can be given away */
+#define PEER_IDLE_MS 1000
+
+
+static struct peer *peers = NULL;
+
+
+static unsigned int
+hash_addr(const struct in6_addr *addr)
+{
+    return hash_bytes(HASH_INIT, addr->s6_addr, sizeof(addr->s6_addr));
+}
+
+
+void
+init_peers(void)
+{
+    if (peers) {
+        return;
+    }
+
+    if (!(peers = calloc(PEER_SLOTS, sizeof(struct peer)))) {
+        err(1, "calloc()");
+    }
+}
+
+
+/* Every slot has its own lock, so workers only contend when they serve
+ * the same address or two addresses hashing to the same slot. A slot
+ * with no connections that went unused for PEER_IDLE_MS is handed over
+ * to a new address. Returns NULL when no slot was found, callers then
+ * don't apply per-address state.
+ */
+struct peer *
+lock_peer(const struct in6_addr *addr, int64_t now)
+{
+    int i;
+    struct peer *peer;
+    unsigned int h = hash_addr(addr);
+
+    for (i = 0; i < PEER_PROBES; i++) {
+        peer = &peers[(h + i) & PEER_SLOTS_MASK];
+
+        while (__atomic_test_and_set(&peer->lock, __ATOMIC_ACQUIRE)) ;
+
+        if (peer->used && !memcmp(&peer->addr, addr, sizeof(struct in6_addr))) {
+            peer->last_used = now;
+            return peer;
+        }
+
+        if (!peer->used || (!peer->conns && now - peer->last_used > PEER_IDLE_MS)) {
+            peer->used = 1;
+            peer->addr = *addr;
+            peer->conns = 0;
+            peer->last_used = now;
+            peer->bucket.stamp = 0;
+            return peer;
+        }
+
+        unlock_peer(peer);
+    }
+
+    return NULL;
+}
+
+
+void
+unlock_peer(struct peer *peer)
+{
+    __atomic_clear(&peer->lock, __ATOMIC_RELEASE);
+}
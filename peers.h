@@ -0,0 +1,24 @@
+#ifndef PEERS_H
+#define PEERS_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "throttle.h"
+
+
+/* state kept per client address, shared by all workers */
+struct peer {
+    char lock, used;
+    struct in6_addr addr;
+    int conns;
+    int64_t last_used;
+    struct bucket bucket;
+};
+
+
+void init_peers(void);
+struct peer *lock_peer(const struct in6_addr *addr, int64_t now);
+void unlock_peer(struct peer *peer);
+
+#endif
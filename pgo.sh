@@ -0,0 +1,67 @@
+#!/bin/sh
+# Builds rockepoll with and without profile feedback and LTO, trains the
+# instrumented build on rockepoll-load over loopback and compares the two.
+# Run through make pgo; PGO_PORT, PGO_REQUESTS and PGO_CONNECTIONS tune it.
+
+set -e
+
+PORT=${PGO_PORT:-7997}
+REQUESTS=${PGO_REQUESTS:-200000}
+CONNECTIONS=${PGO_CONNECTIONS:-8}
+GENERATE="-fprofile-generate -fprofile-update=atomic"
+USE="-fprofile-use -fprofile-partial-training -Wno-missing-profile -flto=auto"
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT INT TERM
+
+# the training site: an index page, small and large files, a subdirectory
+site=$work/site
+mkdir -p "$site/dir"
+echo '<html><body>rockepoll</body></html>' > "$site/index.html"
+echo '<html><body>dir</body></html>' > "$site/dir/index.html"
+seq 1 400 > "$site/small.txt"
+seq 1 1200 | sed 's/.*/.c& { color: #&; }/' > "$site/style.css"
+head -c 65536 /dev/urandom > "$site/medium.bin"
+head -c 2097152 /dev/urandom > "$site/large.bin"
+
+# serve with $1 and put $2 requests through it, prints requests per second
+run() {
+    "$1" "$site" --port "$PORT" --quiet --keep-alive --threads 2 \
+        --io-threads 2 > /dev/null 2>&1 &
+    pid=$!
+    tries=50
+    until "$work/load" "$PORT" 1 1 > /dev/null 2>&1; do
+        tries=$((tries - 1))
+        if [ "$tries" -eq 0 ]; then
+            kill "$pid"
+            echo "rockepoll did not come up on port $PORT" >&2
+            exit 1
+        fi
+        sleep 0.1
+    done
+    "$work/load" "$PORT" "$2" "$CONNECTIONS" | sed -n 's/^requests_per_second //p'
+    # the profile is written when the server exits normally
+    kill -INT "$pid"
+    wait "$pid" || true
+}
+
+make clean > /dev/null
+rm -f ./*.gcda
+make rockepoll rockepoll-load > /dev/null
+cp rockepoll-load "$work/load"
+cp rockepoll "$work/rockepoll-base"
+
+make clean > /dev/null
+make PGOFLAGS="$GENERATE" rockepoll > /dev/null
+echo "training on $REQUESTS requests"
+run ./rockepoll "$REQUESTS" > /dev/null
+
+make clean > /dev/null
+make PGOFLAGS="$USE" rockepoll > /dev/null
+
+base=$(run "$work/rockepoll-base" "$REQUESTS")
+pgo=$(run ./rockepoll "$REQUESTS")
+
+echo "default build: $base requests/s"
+echo "pgo+lto build: $pgo requests/s"
+awk -v b="$base" -v p="$pgo" 'BEGIN { printf "delta: %+.1f%%\n", (p - b) * 100 / b }'
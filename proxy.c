@@ -0,0 +1,1000 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <err.h>
+
+#include "proxy.h"
+#include "chunked.h"
+#include "arena.h"
+#include "stats.h"
+#include "utils.h"
+#include "config.h"
+
+
+#define MAX_PREFIX_SIZE 256
+#define PROXY_PIPE_CHUNK (1024 * 64)
+#define FORWARDED_FOR "X-Forwarded-For: "
+
+#define ERROR_RESPONSE(st)                                                    \
+    "HTTP/1.1 " st "\r\n"                                                     \
+    "Server: rockepoll\r\n"                                                   \
+    "Content-Length: 0\r\n"                                                   \
+    "Connection: close\r\n\r\n"
+
+
+struct route {
+    char prefix[MAX_PREFIX_SIZE];
+    size_t prefix_size;
+    struct sockaddr_storage addr;
+    socklen_t addr_size;
+};
+
+
+/* an upstream connection, owned by a proxy step or idle in its pool */
+struct upstream {
+    int fd, route;
+    int pipe[2];
+    time_t idle_since;
+    struct upstream *next;
+};
+
+
+enum proxy_state {
+    P_CONNECT,
+    P_SEND_REQUEST,
+    P_SEND_BODY,
+    P_READ_HEAD,
+    P_SEND_HEAD,
+    P_RELAY,
+    P_DONE,
+};
+
+enum body_framing {B_NONE, B_LENGTH, B_CHUNKED, B_EOF};
+
+
+struct proxy {
+    int route, tries, reused, sent, body_streamed, response_started;
+    int keep_upstream, head_request;
+    enum proxy_state state;
+    struct upstream *up;
+
+    /* request head and the part of the body read along with it */
+    char *out;
+    size_t out_size, out_offset;
+    size_t body_left;
+
+    /* response head, then the buffer of copied body bytes */
+    char *buf;
+    size_t buf_size, buf_offset;
+    size_t in_pipe;
+
+    enum body_framing framing;
+    size_t resp_left;
+    struct chunked chunk;
+
+    struct http_request req;
+};
+
+
+static struct route routes[PROXY_MAX_ROUTES];
+static int routes_count = 0;
+
+static __thread int worker_epollfd = -1;
+static __thread struct upstream *pools[PROXY_MAX_ROUTES];
+static __thread int pools_size[PROXY_MAX_ROUTES];
+
+static const char bad_gateway[] = ERROR_RESPONSE("502 Bad Gateway");
+static const char gateway_timeout[] = ERROR_RESPONSE("504 Gateway Timeout");
+
+
+/* Numeric addresses, v4 or [v6], are taken as they are, the resolver is
+ * only asked for names
+ */
+static int
+numeric_addr(struct route *r, char *host, const char *port)
+{
+    long n;
+    char *end;
+    size_t size = strlen(host);
+    struct sockaddr_in *sin = (struct sockaddr_in *)&r->addr;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&r->addr;
+
+    n = strtol(port, &end, 10);
+    if (end == port || *end || n < 1 || n > 65535) {
+        return -1;
+    }
+
+    if (inet_pton(AF_INET, host, &sin->sin_addr) == 1) {
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(n);
+        r->addr_size = sizeof(struct sockaddr_in);
+        return 0;
+    }
+
+    if (*host == '[' && host[size - 1] == ']') {
+        host[size - 1] = '\0';
+        if (inet_pton(AF_INET6, host + 1, &sin6->sin6_addr) == 1) {
+            sin6->sin6_family = AF_INET6;
+            sin6->sin6_port = htons(n);
+            r->addr_size = sizeof(struct sockaddr_in6);
+            return 0;
+        }
+        host[size - 1] = ']';
+    }
+
+    return -1;
+}
+
+
+/* PREFIX=HOST:PORT or PREFIX=unix:PATH */
+void
+proxy_add_route(const char *spec)
+{
+    int e;
+    char host[256];
+    const char *addr, *port;
+    struct route *r = &routes[routes_count];
+    struct sockaddr_un *sun = (struct sockaddr_un *)&r->addr;
+    struct addrinfo hints = {0}, *ai;
+
+    if (routes_count == PROXY_MAX_ROUTES) {
+        errx(1, "too many proxy routes, at most %d", PROXY_MAX_ROUTES);
+    }
+
+    if (*spec != '/' || !(addr = strchr(spec, '=')) ||
+        addr - spec >= MAX_PREFIX_SIZE)
+    {
+        errx(1, "invalid proxy route `%s'", spec);
+    }
+
+    r->prefix_size = addr - spec;
+    memcpy(r->prefix, spec, r->prefix_size);
+    addr++;
+
+    if (!strncmp(addr, "unix:", sizeof("unix:") - 1)) {
+        addr += sizeof("unix:") - 1;
+        if (strlen(addr) >= sizeof(sun->sun_path)) {
+            errx(1, "socket path too long `%s'", addr);
+        }
+        sun->sun_family = AF_UNIX;
+        strcpy(sun->sun_path, addr);
+        r->addr_size = sizeof(struct sockaddr_un);
+    } else {
+        if (!(port = strrchr(addr, ':')) || port - addr >= (long)sizeof(host)) {
+            errx(1, "invalid upstream address `%s'", addr);
+        }
+        memcpy(host, addr, port - addr);
+        host[port - addr] = '\0';
+
+        if (numeric_addr(r, host, port + 1) < 0) {
+            hints.ai_socktype = SOCK_STREAM;
+            if ((e = getaddrinfo(host, port + 1, &hints, &ai))) {
+                errx(1, "can't resolve `%s': %s", addr, gai_strerror(e));
+            }
+            memcpy(&r->addr, ai->ai_addr, ai->ai_addrlen);
+            r->addr_size = ai->ai_addrlen;
+            freeaddrinfo(ai);
+        }
+    }
+
+    routes_count++;
+}
+
+
+void
+init_proxy_worker(int epollfd)
+{
+    worker_epollfd = epollfd;
+}
+
+
+/* target is a parsed one, without its leading slash */
+int
+proxy_match(const char *target)
+{
+    int i;
+
+    for (i = 0; i < routes_count; i++) {
+        if (!strncmp(target, routes[i].prefix + 1, routes[i].prefix_size - 1)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+
+/* Runs before parse_request, which rewrites the request, so the target is
+ * decoded and its dot segments removed on a copy. Prefixes are matched
+ * against what the static lookup would open, percent escapes or dot
+ * segments can't route around them.
+ */
+int
+proxy_route(const char *data)
+{
+    char target[MAX_TARGET_SIZE];
+    const char *start, *end;
+    struct http_request req;
+
+    if (!routes_count || !(start = strchr(data, ' ')) ||
+        !(end = strchr(++start, ' ')) || end - start >= MAX_TARGET_SIZE)
+    {
+        return -1;
+    }
+
+    memcpy(target, start, end - start);
+    target[end - start] = '\0';
+    if (parse_target(target, &req)) {
+        return -1;
+    }
+
+    return proxy_match(req.target);
+}
+
+
+static void
+close_upstream(struct upstream *up)
+{
+    close(up->fd);
+    if (up->pipe[0] >= 0) {
+        close(up->pipe[0]);
+        close(up->pipe[1]);
+    }
+    free(up);
+}
+
+
+static void
+release_upstream(struct upstream *up)
+{
+    if (pools_size[up->route] == PROXY_POOL_SIZE ||
+        epoll_ctl(worker_epollfd, EPOLL_CTL_DEL, up->fd, NULL) < 0)
+    {
+        close_upstream(up);
+        return;
+    }
+
+    up->idle_since = time(NULL);
+    up->next = pools[up->route];
+    pools[up->route] = up;
+    pools_size[up->route]++;
+}
+
+
+static struct upstream *
+take_upstream(int route, int *reused)
+{
+    struct upstream *up;
+    time_t now = time(NULL);
+
+    while ((up = pools[route])) {
+        pools[route] = up->next;
+        pools_size[route]--;
+
+        if (difftime(now, up->idle_since) < PROXY_IDLE_TIMEOUT) {
+            *reused = 1;
+            return up;
+        }
+        close_upstream(up);
+    }
+
+    *reused = 0;
+
+    up = xmalloc(sizeof(struct upstream));
+    up->route = route;
+    up->pipe[0] = up->pipe[1] = -1;
+    up->fd = socket(routes[route].addr.ss_family,
+                    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (up->fd < 0) {
+        free(up);
+        return NULL;
+    }
+
+    return up;
+}
+
+
+static int
+ensure_pipe(struct upstream *up)
+{
+    if (up->pipe[0] >= 0) {
+        return 0;
+    }
+
+    return pipe2(up->pipe, O_NONBLOCK | O_CLOEXEC);
+}
+
+
+static enum io_step_status
+answer(struct connection *conn, struct proxy *p,
+       const char *response, size_t size, enum http_status st)
+{
+    /* static responses are never written to */
+    p->buf = (char *)response;
+    p->buf_size = size;
+    p->buf_offset = 0;
+    p->framing = B_NONE;
+    p->response_started = 1;
+    p->state = P_SEND_HEAD;
+    conn->keep_alive = 0;
+
+    log_new_connection(conn, &p->req, st, 0);
+
+    return IO_OK;
+}
+
+
+/* A failed upstream is retried with a fresh connection while nothing of
+ * the request is lost and running it again is safe: the failure was on
+ * connect, on a pooled connection the upstream may have closed meanwhile,
+ * or the method is idempotent.
+ */
+static enum io_step_status
+upstream_failed(struct connection *conn, struct proxy *p)
+{
+    close_upstream(p->up);
+    p->up = NULL;
+    p->in_pipe = 0;
+    stats_inc(ST_UPSTREAM_FAILED);
+
+    if (p->response_started) {
+        return IO_ERROR;
+    }
+
+    if (!p->body_streamed && !p->buf_size && p->tries++ < PROXY_RETRIES &&
+        (!p->sent || p->reused ||
+         p->req.method == M_GET || p->req.method == M_HEAD))
+    {
+        stats_inc(ST_UPSTREAM_RETRIES);
+        p->state = P_CONNECT;
+        p->out_offset = 0;
+        p->sent = 0;
+        return IO_OK;
+    }
+
+    return answer(conn, p, bad_gateway, sizeof(bad_gateway) - 1, S_BAD_GATEWAY);
+}
+
+
+static enum io_step_status
+start_upstream(struct connection *conn, struct proxy *p)
+{
+    struct route *r = &routes[p->route];
+    struct epoll_event ev = {0};
+    int opt = 1;
+
+    if (!(p->up = take_upstream(p->route, &p->reused))) {
+        return answer(conn, p, bad_gateway, sizeof(bad_gateway) - 1, S_BAD_GATEWAY);
+    }
+
+    if (!p->reused) {
+        if (r->addr.ss_family != AF_UNIX) {
+            setsockopt(p->up->fd, SOL_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        }
+
+        /* the request is sent as soon as the connect completes, send()
+         * gives EAGAIN until then and the connect error after
+         */
+        if (connect(p->up->fd, (struct sockaddr *)&r->addr, r->addr_size) < 0 &&
+            errno != EINPROGRESS)
+        {
+            return upstream_failed(conn, p);
+        }
+    } else {
+        stats_inc(ST_UPSTREAM_REUSED);
+    }
+
+    ev.data.ptr = (void *)((uintptr_t)conn | UPSTREAM_TAG);
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    if (epoll_ctl(worker_epollfd, EPOLL_CTL_ADD, p->up->fd, &ev) < 0) {
+        return upstream_failed(conn, p);
+    }
+
+    p->state = P_SEND_REQUEST;
+
+    return IO_OK;
+}
+
+
+static enum io_step_status
+send_request(struct connection *conn, struct proxy *p)
+{
+    ssize_t len;
+    int flags = MSG_NOSIGNAL | (p->body_left ? MSG_MORE : 0);
+
+    while (p->out_offset < p->out_size) {
+        len = send(p->up->fd, p->out + p->out_offset,
+                   p->out_size - p->out_offset, flags);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return IO_AGAIN;
+            }
+            return upstream_failed(conn, p);
+        }
+
+        p->out_offset += len;
+        p->sent = 1;
+    }
+
+    p->state = p->body_left ? P_SEND_BODY : P_READ_HEAD;
+
+    return IO_OK;
+}
+
+
+/* the rest of the request body, client to upstream */
+static enum io_step_status
+send_body(struct connection *conn, struct proxy *p)
+{
+    ssize_t len;
+    int spliced = !conn->tls;
+
+    if (spliced && ensure_pipe(p->up) < 0) {
+        return upstream_failed(conn, p);
+    }
+
+    for (;;) {
+        if (!p->in_pipe) {
+            if (!p->body_left) {
+                p->state = P_READ_HEAD;
+                return IO_OK;
+            }
+            if (conn->budget <= 0) {
+                return IO_YIELD;
+            }
+
+            if (spliced) {
+                len = splice(conn->fd, NULL, p->up->pipe[1], NULL,
+                             MIN(p->body_left, PROXY_PIPE_CHUNK),
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (len > 0) {
+                    conn->budget -= len;
+                }
+            } else {
+                len = conn_read(conn, p->buf, MIN(p->body_left, MAX_REQ_SIZE));
+                p->buf_offset = 0;
+            }
+
+            if (len < 1) {
+                if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    return IO_AGAIN;
+                }
+                return IO_ERROR;
+            }
+
+            p->in_pipe = len;
+            p->body_left -= len;
+            p->body_streamed = 1;
+        }
+
+        if (spliced) {
+            len = splice(p->up->pipe[0], NULL, p->up->fd, NULL, p->in_pipe,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        } else {
+            len = send(p->up->fd, p->buf + p->buf_offset, p->in_pipe, MSG_NOSIGNAL);
+            p->buf_offset += MAX(len, 0);
+        }
+
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return IO_AGAIN;
+            }
+            return upstream_failed(conn, p);
+        }
+
+        p->in_pipe -= len;
+    }
+}
+
+
+static const char *
+header_value(const char *line, const char *name, size_t name_size)
+{
+    if (strncasecmp(line, name, name_size) || line[name_size] != ':') {
+        return NULL;
+    }
+
+    line += name_size + 1;
+    while (*line == ' ' || *line == '\t') {
+        line++;
+    }
+
+    return line;
+}
+
+
+static int
+value_has(const char *value, const char *eol, const char *token)
+{
+    size_t size = strlen(token);
+
+    for (; value + size <= eol; value++) {
+        if (!strncasecmp(value, token, size)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static int
+parse_response_head(struct connection *conn, struct proxy *p, size_t head_size)
+{
+    int status, has_length = 0;
+    char *end;
+    const char *line, *eol, *value, *head_end = p->buf + head_size - 2;
+
+    if (strncmp(p->buf, "HTTP/1.", sizeof("HTTP/1.") - 1) || p->buf[8] != ' ') {
+        return -1;
+    }
+
+    p->keep_upstream = p->buf[7] == '1';
+    status = strtol(p->buf + 9, &end, 10);
+    if (end != p->buf + 12) {
+        return -1;
+    }
+
+    p->framing = B_EOF;
+
+    line = (const char *)memmem(p->buf, head_size, "\r\n", 2) + 2;
+    for (; line < head_end; line = eol + 2) {
+        eol = memmem(line, head_end + 2 - line, "\r\n", 2);
+
+        if ((value = header_value(line, "Content-Length", sizeof("Content-Length") - 1))) {
+            p->resp_left = strtoull(value, &end, 10);
+            if (end == value) {
+                return -1;
+            }
+            has_length = 1;
+        } else if ((value = header_value(line, "Transfer-Encoding", sizeof("Transfer-Encoding") - 1))) {
+            if (value_has(value, eol, "chunked")) {
+                p->framing = B_CHUNKED;
+            }
+        } else if ((value = header_value(line, "Connection", sizeof("Connection") - 1))) {
+            if (value_has(value, eol, "close")) {
+                p->keep_upstream = 0;
+            }
+        }
+    }
+
+    if (p->head_request || status / 100 == 1 || status == 204 || status == 304) {
+        p->framing = B_NONE;
+    } else if (p->framing != B_CHUNKED && has_length) {
+        p->framing = B_LENGTH;
+    }
+
+    if (p->framing == B_EOF) {
+        /* the end of the body is the end of both connections */
+        p->keep_upstream = 0;
+        conn->keep_alive = 0;
+    }
+
+    log_new_connection(conn, &p->req, status,
+                       p->framing == B_LENGTH ? p->resp_left : 0);
+
+    return 0;
+}
+
+
+static enum io_step_status
+read_head(struct connection *conn, struct proxy *p)
+{
+    ssize_t len;
+    size_t head_size, extra;
+    char *end;
+
+    for (;;) {
+        if (p->buf_size == MAX_REQ_SIZE) {
+            return upstream_failed(conn, p);
+        }
+
+        len = read(p->up->fd, p->buf + p->buf_size, MAX_REQ_SIZE - p->buf_size);
+        if (len < 1) {
+            if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return IO_AGAIN;
+            }
+            return upstream_failed(conn, p);
+        }
+
+        p->buf_size += len;
+        if ((end = memmem(p->buf, p->buf_size, "\r\n\r\n", 4))) {
+            break;
+        }
+    }
+
+    head_size = end + 4 - p->buf;
+    if (parse_response_head(conn, p, head_size)) {
+        /* keeps buf_size, a response was there so it is not retried */
+        return upstream_failed(conn, p);
+    }
+
+    /* body bytes that came with the head go out with it */
+    extra = p->buf_size - head_size;
+    switch (p->framing) {
+    case B_NONE:
+        extra = 0;
+        break;
+    case B_LENGTH:
+        extra = MIN(extra, p->resp_left);
+        p->resp_left -= extra;
+        break;
+    case B_CHUNKED:
+        extra = chunked_scan(&p->chunk, p->buf + head_size, extra);
+        break;
+    case B_EOF:
+        break;
+    }
+
+    if (p->framing == B_CHUNKED && p->chunk.state == CH_ERROR) {
+        return upstream_failed(conn, p);
+    }
+
+    p->buf_size = head_size + extra;
+    p->buf_offset = 0;
+    p->response_started = 1;
+    p->state = P_SEND_HEAD;
+
+    return IO_OK;
+}
+
+
+static int
+response_complete(const struct proxy *p)
+{
+    switch (p->framing) {
+    case B_NONE:
+        return 1;
+    case B_LENGTH:
+        return !p->resp_left;
+    case B_CHUNKED:
+        return p->chunk.state == CH_DONE;
+    case B_EOF:
+        break;
+    }
+
+    return 0;
+}
+
+
+static enum io_step_status
+send_head(struct connection *conn, struct proxy *p)
+{
+    ssize_t len;
+    int flags = response_complete(p) ? 0 : MSG_MORE;
+
+    while (p->buf_offset < p->buf_size) {
+        if (conn->budget <= 0) {
+            return IO_YIELD;
+        }
+
+        len = conn_send(conn, p->buf + p->buf_offset,
+                        p->buf_size - p->buf_offset, flags);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return IO_AGAIN;
+            }
+            return IO_ERROR;
+        }
+
+        p->buf_offset += len;
+    }
+
+    p->buf_size = p->buf_offset = 0;
+    p->state = response_complete(p) ? P_DONE : P_RELAY;
+
+    return IO_OK;
+}
+
+
+/* upstream to client through the upstream's pipe, no copies */
+static enum io_step_status
+relay_spliced(struct connection *conn, struct proxy *p)
+{
+    ssize_t len;
+    size_t size;
+
+    if (ensure_pipe(p->up) < 0) {
+        return IO_ERROR;
+    }
+
+    for (;;) {
+        if (!p->in_pipe) {
+            if (response_complete(p)) {
+                p->state = P_DONE;
+                return IO_OK;
+            }
+            if (conn->budget <= 0) {
+                return IO_YIELD;
+            }
+
+            size = PROXY_PIPE_CHUNK;
+            if (p->framing == B_LENGTH) {
+                size = MIN(size, p->resp_left);
+            }
+
+            len = splice(p->up->fd, NULL, p->up->pipe[1], NULL, size,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (len < 1) {
+                if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    return IO_AGAIN;
+                }
+                if (!len && p->framing == B_EOF) {
+                    p->state = P_DONE;
+                    return IO_OK;
+                }
+                return IO_ERROR;
+            }
+
+            p->in_pipe = len;
+            if (p->framing == B_LENGTH) {
+                p->resp_left -= len;
+            }
+        }
+
+        len = conn_splice(conn, p->up->pipe[0], p->in_pipe);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return IO_AGAIN;
+            }
+            return IO_ERROR;
+        }
+
+        p->in_pipe -= len;
+    }
+}
+
+
+/* TLS clients and chunked bodies, which have to be looked at */
+static enum io_step_status
+relay_copied(struct connection *conn, struct proxy *p)
+{
+    ssize_t len;
+    size_t size;
+
+    for (;;) {
+        if (p->buf_offset == p->buf_size) {
+            if (response_complete(p)) {
+                p->state = P_DONE;
+                return IO_OK;
+            }
+            if (conn->budget <= 0) {
+                return IO_YIELD;
+            }
+
+            size = MAX_REQ_SIZE;
+            if (p->framing == B_LENGTH) {
+                size = MIN(size, p->resp_left);
+            }
+
+            len = read(p->up->fd, p->buf, size);
+            if (len < 1) {
+                if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    return IO_AGAIN;
+                }
+                if (!len && p->framing == B_EOF) {
+                    p->state = P_DONE;
+                    return IO_OK;
+                }
+                return IO_ERROR;
+            }
+
+            if (p->framing == B_CHUNKED) {
+                len = chunked_scan(&p->chunk, p->buf, len);
+                if (p->chunk.state == CH_ERROR) {
+                    return upstream_failed(conn, p);
+                }
+            } else if (p->framing == B_LENGTH) {
+                p->resp_left -= len;
+            }
+
+            p->buf_size = len;
+            p->buf_offset = 0;
+        }
+
+        len = conn_send(conn, p->buf + p->buf_offset,
+                        p->buf_size - p->buf_offset, 0);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return IO_AGAIN;
+            }
+            return IO_ERROR;
+        }
+
+        p->buf_offset += len;
+    }
+}
+
+
+enum io_step_status
+make_proxy_step(struct connection *conn, struct proxy *p)
+{
+    enum io_step_status s = IO_OK;
+
+    while (s == IO_OK && p->state != P_DONE) {
+        switch (p->state) {
+        case P_CONNECT:
+            s = start_upstream(conn, p);
+            break;
+        case P_SEND_REQUEST:
+            s = send_request(conn, p);
+            break;
+        case P_SEND_BODY:
+            s = send_body(conn, p);
+            break;
+        case P_READ_HEAD:
+            s = read_head(conn, p);
+            break;
+        case P_SEND_HEAD:
+            s = send_head(conn, p);
+            break;
+        case P_RELAY:
+            if (p->framing == B_CHUNKED || conn->tls) {
+                s = relay_copied(conn, p);
+            } else {
+                s = relay_spliced(conn, p);
+            }
+            break;
+        case P_DONE:
+            break;
+        }
+    }
+
+    if (p->state == P_DONE && p->up) {
+        if (p->keep_upstream) {
+            release_upstream(p->up);
+        } else {
+            close_upstream(p->up);
+        }
+        p->up = NULL;
+    }
+
+    return s;
+}
+
+
+static size_t
+copy_request_head(char *out, const char *head, size_t size,
+                  const struct in6_addr *addr)
+{
+    char *p = out;
+    char ip[ADDR_STR_SIZE];
+    const char *eol, *line = head, *end = head + size - 2;
+
+    /* the request line, then the headers that are not hop-by-hop */
+    for (; line < end; line = eol) {
+        eol = (const char *)memmem(line, end + 2 - line, "\r\n", 2) + 2;
+
+        if (line != head &&
+            (!strncasecmp(line, "Connection:", sizeof("Connection:") - 1) ||
+             !strncasecmp(line, "Keep-Alive:", sizeof("Keep-Alive:") - 1)))
+        {
+            continue;
+        }
+
+        memcpy(p, line, eol - line);
+        p += eol - line;
+    }
+
+    p += sprintf(p, FORWARDED_FOR "%s\r\n\r\n", format_addr(addr, ip));
+
+    return p - out;
+}
+
+
+static char *
+arena_strdup(struct connection *conn, const char *s)
+{
+    size_t size = strlen(s) + 1;
+
+    return memcpy(arena_alloc(&conn->arena, size), s, size);
+}
+
+
+/* Builds the proxy step of a request. The request head is forwarded as
+ * it came, without hop-by-hop headers, and the upstream connection is
+ * kept alive independently of the client's.
+ */
+enum http_status
+proxy_request(struct connection *conn, int route, const struct read_meta *in,
+              struct http_request *req, struct proxy **proxy)
+{
+    struct proxy *p;
+    size_t head_size, extra, body_size = 0;
+    const char *start;
+    char *end;
+
+    head_size = (char *)memmem(in->data, in->size, "\r\n\r\n", 4) + 4 - in->data;
+    extra = in->size - head_size;
+
+    /* the raw target is forwarded, it has to be the one that was routed */
+    start = strchr(in->data, ' ') + 1;
+    if (!target_is_normal(start, strchr(start, ' ') - start)) {
+        return S_BAD_REQUEST;
+    }
+
+    p = arena_alloc(&conn->arena, sizeof(struct proxy));
+    memset(p, 0, sizeof(struct proxy));
+    p->route = route;
+    p->out = arena_alloc(&conn->arena, head_size + extra +
+                         sizeof(FORWARDED_FOR "\r\n") + ADDR_STR_SIZE);
+    p->out_size = copy_request_head(p->out, in->data, head_size, &conn->addr);
+    memcpy(p->out + p->out_size, in->data + head_size, extra);
+
+    /* after the copy, it writes into the request */
+    if (parse_request(in->data, req)) {
+        return S_BAD_REQUEST;
+    }
+
+    if (req->headers[H_TRANSFER_ENCODING]) {
+        return S_LENGTH_REQUIRED;
+    }
+
+    if (req->headers[H_CONTENT_LENGTH]) {
+        body_size = strtoull(req->headers[H_CONTENT_LENGTH], &end, 10);
+        if (end == req->headers[H_CONTENT_LENGTH] || *end) {
+            return S_BAD_REQUEST;
+        }
+    }
+
+    if (req->headers[H_CONNECTION] && !strcmp(req->headers[H_CONNECTION], "close")) {
+        conn->keep_alive = 0;
+    }
+
+    extra = MIN(extra, body_size);
+    p->out_size += extra;
+    p->body_left = body_size - extra;
+    p->head_request = req->method == M_HEAD;
+    p->buf = arena_alloc(&conn->arena, MAX_REQ_SIZE);
+
+    p->req.method = req->method;
+    p->req.version = req->version;
+    p->req.target = arena_strdup(conn, req->target);
+    if (req->headers[H_USER_AGENT]) {
+        p->req.headers[H_USER_AGENT] = arena_strdup(conn, req->headers[H_USER_AGENT]);
+    }
+
+    stats_inc(ST_UPSTREAM_REQUESTS);
+    *proxy = p;
+
+    return S_OK;
+}
+
+
+/* the upstream did not answer in time, best effort as the connection is
+ * closed right after
+ */
+void
+proxy_timeout(struct connection *conn, struct proxy *p)
+{
+    stats_inc(ST_UPSTREAM_FAILED);
+
+    if (p->response_started) {
+        return;
+    }
+
+    conn_send(conn, gateway_timeout, sizeof(gateway_timeout) - 1,
+              MSG_DONTWAIT | MSG_NOSIGNAL);
+    log_new_connection(conn, &p->req, S_GATEWAY_TIMEOUT, 0);
+}
+
+
+void
+cleanup_proxy(struct proxy *p)
+{
+    if (p->up) {
+        close_upstream(p->up);
+    }
+}
@@ -0,0 +1,32 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include "io.h"
+#include "parser.h"
+#include "handler.h"
+
+
+/* The epoll data of an upstream socket is the client connection it works
+ * for, tagged in the lowest bit so the event loop can tell it from the
+ * client's own socket.
+ */
+#define UPSTREAM_TAG 1
+
+
+struct proxy;
+
+
+void proxy_add_route(const char *spec);
+void init_proxy_worker(int epollfd);
+
+int proxy_match(const char *target);
+int proxy_route(const char *data);
+enum http_status proxy_request(struct connection *conn, int route,
+                               const struct read_meta *in,
+                               struct http_request *req,
+                               struct proxy **proxy);
+enum io_step_status make_proxy_step(struct connection *conn, struct proxy *proxy);
+void proxy_timeout(struct connection *conn, struct proxy *proxy);
+void cleanup_proxy(struct proxy *proxy);
+
+#endif
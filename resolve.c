@@ -0,0 +1,170 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+#include <err.h>
+
+#include "resolve.h"
+#include "utils.h"
+#include "config.h"
+
+
+#define RESOLVE_FLAGS (RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS)
+
+
+/* an open directory below a root, keyed by the root and its path */
+struct dir_entry {
+    int fd, root_fd;
+    time_t expires;
+    size_t size;
+    char path[DIR_CACHE_PATH];
+};
+
+
+static int have_openat2 = 1;
+static int have_cached = 1;
+
+static __thread struct dir_entry dir_cache[DIR_CACHE_SLOTS];
+
+
+/* The process is already in the root directory, chrooted or not. Returns
+ * the fd of the root.
+ */
+int
+init_resolver(void)
+{
+    int fd, root_fd;
+
+    if ((root_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        err(1, "open(), `.'");
+    }
+
+    if ((fd = open_beneath(root_fd, ".", O_PATH, 0)) < 0 && errno == ENOSYS) {
+        /* before 5.6 the dot removal in parse_target is all there is */
+        have_openat2 = 0;
+        warnx("openat2() is not available, paths are resolved with openat()");
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    /* before 5.12 there is no way to ask for a walk that can't block */
+    if (!have_openat2 ||
+        ((fd = open_beneath(root_fd, ".", O_PATH, 1)) < 0 && errno == EINVAL))
+    {
+        have_cached = 0;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    return root_fd;
+}
+
+
+/* Path may not leave dirfd, neither through ".." nor through symlinks.
+ * With nowait the walk has to be served from the dentry cache, EAGAIN
+ * tells that it would have gone to the disk.
+ */
+int
+open_beneath(int dirfd, const char *path, int flags, int nowait)
+{
+    struct open_how how = {0};
+
+    if (nowait && !have_cached) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (!have_openat2) {
+        return openat(dirfd, path, flags | O_CLOEXEC);
+    }
+
+    how.flags = flags | O_CLOEXEC;
+    how.resolve = RESOLVE_FLAGS | (nowait ? RESOLVE_CACHED : 0);
+
+    return syscall(SYS_openat2, dirfd, path, &how, sizeof(how));
+}
+
+
+static uint32_t
+hash_path(int root_fd, const char *path, size_t size)
+{
+    return hash_bytes(hash_bytes(HASH_INIT, &root_fd, sizeof(root_fd)),
+                      path, size);
+}
+
+
+/* Directories are held open for DIR_CACHE_TTL seconds, a directory that
+ * is replaced meanwhile is picked up after that.
+ */
+static int
+open_dir(int root_fd, const char *path, size_t size, int nowait)
+{
+    int fd;
+    time_t now = time(NULL);
+    struct dir_entry *e;
+    char buf[DIR_CACHE_PATH];
+
+    if (size >= DIR_CACHE_PATH) {
+        return -2;
+    }
+
+    e = &dir_cache[hash_path(root_fd, path, size) & (DIR_CACHE_SLOTS - 1)];
+    if (e->expires > now && e->root_fd == root_fd && e->size == size &&
+        !memcmp(e->path, path, size))
+    {
+        return e->fd;
+    }
+
+    memcpy(buf, path, size);
+    buf[size] = '\0';
+    if ((fd = open_beneath(root_fd, buf, O_PATH | O_DIRECTORY, nowait)) < 0) {
+        return fd;
+    }
+
+    if (e->expires) {
+        close(e->fd);
+    }
+    e->fd = fd;
+    e->root_fd = root_fd;
+    e->expires = now + DIR_CACHE_TTL;
+    e->size = size;
+    memcpy(e->path, buf, size + 1);
+
+    return fd;
+}
+
+
+/* Opens a path below a root, the last component relative to the cached
+ * fd of its directory. A symlink that leaves that directory but stays in
+ * the root is followed from the root.
+ */
+int
+open_target(int root_fd, const char *target, int flags, int nowait)
+{
+    int fd, dirfd;
+    const char *name = strrchr(target, '/');
+
+    if (!name || !name[1]) {
+        return open_beneath(root_fd, target, flags, nowait);
+    }
+
+    if ((dirfd = open_dir(root_fd, target, name - target, nowait)) == -2) {
+        return open_beneath(root_fd, target, flags, nowait);
+    }
+    if (dirfd < 0) {
+        return -1;
+    }
+
+    fd = open_beneath(dirfd, name + 1, flags, nowait);
+    if (fd < 0 && errno == EXDEV) {
+        fd = open_beneath(root_fd, target, flags, nowait);
+    }
+
+    return fd;
+}
@@ -0,0 +1,9 @@
+#ifndef RESOLVE_H
+#define RESOLVE_H
+
+
+int init_resolver(void);
+int open_beneath(int dirfd, const char *path, int flags, int nowait);
+int open_target(int root_fd, const char *target, int flags, int nowait);
+
+#endif
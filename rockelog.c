@@ -0,0 +1,407 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <err.h>
+
+#include "binlog.h"
+#include "utils.h"
+
+
+/* Reads the segments of rockepoll --binlog. Records that pass the filters
+ * are printed in the text format of the access log with the time of the
+ * request, in seconds, as the last column, which rockepoll-load --replay
+ * takes for pacing. With --summary they are counted instead.
+ */
+
+#define TIMESTAMP_FORMAT "[%a, %d/%b/%Y %H:%M:%S GMT]"
+
+
+struct filter {
+    int status, method;
+    const char *prefix;
+    size_t prefix_size;
+    uint64_t since_us, until_us;
+};
+
+
+struct target_count {
+    const char *target;
+    long requests;
+    uint64_t bytes;
+};
+
+
+struct summary {
+    long requests, statuses[600];
+    uint64_t bytes, first_us, last_us;
+    uint32_t *latencies;
+    size_t latencies_count, latencies_size;
+    struct target_count *targets;
+    size_t targets_count, targets_size;  /* size is a power of two */
+};
+
+
+static struct filter filter = {0, -1, NULL, 0, 0, UINT64_MAX};
+static struct summary summary = {0};
+static int conf_summary = 0, conf_top = 10;
+
+
+static const char *
+lookup(const struct binlog_header *h, const char *strings, uint32_t offset)
+{
+    if (offset == BINLOG_NO_STRING || offset >= h->strings_size) {
+        return NULL;
+    }
+
+    return strings + offset;
+}
+
+
+static void
+print_record(const struct binlog_record *r, const char *target, const char *user_agent)
+{
+    time_t t = r->time_us / 1000000;
+    char timestamp[64], addr[INET6_ADDRSTRLEN];
+    const struct in6_addr *a = (const struct in6_addr *)r->addr;
+
+    strftime(timestamp, sizeof(timestamp), TIMESTAMP_FORMAT, gmtime(&t));
+    if (IN6_IS_ADDR_V4MAPPED(a)) {
+        inet_ntop(AF_INET, &a->s6_addr[12], addr, sizeof(addr));
+    } else {
+        inet_ntop(AF_INET6, a, addr, sizeof(addr));
+    }
+
+    printf("%s %s ", timestamp, addr);
+    if (r->method < HTTP_METHODS_COUNT && target) {
+        printf("\"%s /%s HTTP/%s\"", http_methods[r->method].name, target,
+               http_versions[r->version <= V20 ? r->version : V11].name);
+    } else {
+        printf("\"-\"");
+    }
+    printf(" %d %llu \"%s\" %llu.%06llu\n", r->status, (unsigned long long)r->bytes,
+           user_agent ? user_agent : "-",
+           (unsigned long long)(r->time_us / 1000000),
+           (unsigned long long)(r->time_us % 1000000));
+}
+
+
+static struct target_count *
+find_target(const char *target)
+{
+    size_t i, j, old_size;
+    struct target_count *old, *t;
+
+    if (summary.targets_count * 2 >= summary.targets_size) {
+        old = summary.targets;
+        old_size = summary.targets_size;
+        summary.targets_size = old_size ? old_size * 2 : 1024;
+        if (!(summary.targets = calloc(summary.targets_size, sizeof(*t)))) {
+            err(1, "calloc()");
+        }
+        for (i = 0; i < old_size; i++) {
+            if (!old[i].target) {
+                continue;
+            }
+            j = hash_string(HASH_INIT, old[i].target) & (summary.targets_size - 1);
+            while (summary.targets[j].target) {
+                j = (j + 1) & (summary.targets_size - 1);
+            }
+            summary.targets[j] = old[i];
+        }
+        free(old);
+    }
+
+    i = hash_string(HASH_INIT, target) & (summary.targets_size - 1);
+    while ((t = &summary.targets[i])->target && strcmp(t->target, target)) {
+        i = (i + 1) & (summary.targets_size - 1);
+    }
+    if (!t->target) {
+        t->target = target;
+        summary.targets_count++;
+    }
+
+    return t;
+}
+
+
+static void
+count_record(const struct binlog_record *r, const char *target)
+{
+    struct target_count *t;
+
+    summary.requests++;
+    summary.bytes += r->bytes;
+    if (r->status < sizeof(summary.statuses) / sizeof(*summary.statuses)) {
+        summary.statuses[r->status]++;
+    }
+    if (!summary.first_us || r->time_us < summary.first_us) {
+        summary.first_us = r->time_us;
+    }
+    summary.last_us = r->time_us > summary.last_us ? r->time_us : summary.last_us;
+
+    if (summary.latencies_count == summary.latencies_size) {
+        summary.latencies_size = summary.latencies_size ? summary.latencies_size * 2 : 4096;
+        summary.latencies = realloc(summary.latencies,
+                                    summary.latencies_size * sizeof(uint32_t));
+        if (!summary.latencies) {
+            err(1, "realloc()");
+        }
+    }
+    summary.latencies[summary.latencies_count++] = r->latency_us;
+
+    if (target) {
+        t = find_target(target);
+        t->requests++;
+        t->bytes += r->bytes;
+    }
+}
+
+
+static int
+matches(const struct binlog_record *r, const char *target)
+{
+    if (filter.status && r->status != filter.status) {
+        return 0;
+    }
+    if (filter.method >= 0 && r->method != filter.method) {
+        return 0;
+    }
+    if (filter.prefix &&
+        (!target || strncmp(target, filter.prefix, filter.prefix_size)))
+    {
+        return 0;
+    }
+
+    return r->time_us >= filter.since_us && r->time_us < filter.until_us;
+}
+
+
+/* The mapping stays, the summary keeps pointers to its strings */
+static void
+read_segment(const char *path)
+{
+    int fd;
+    uint64_t i, records;
+    const char *base, *strings, *target;
+    const struct binlog_header *h;
+    const struct binlog_record *r;
+    struct stat st;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        err(1, "open(%s)", path);
+    }
+    if (fstat(fd, &st) < 0) {
+        err(1, "fstat(%s)", path);
+    }
+    if ((size_t)st.st_size < BINLOG_HEADER_SIZE) {
+        errx(1, "`%s' is not a rockepoll binary log", path);
+    }
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        err(1, "mmap(%s)", path);
+    }
+    close(fd);
+
+    h = (const struct binlog_header *)base;
+    if (memcmp(h->magic, BINLOG_MAGIC, sizeof(h->magic)) ||
+        h->record_size != sizeof(struct binlog_record) ||
+        BINLOG_HEADER_SIZE + (uint64_t)h->records_capacity * h->record_size > h->strings_offset ||
+        h->strings_offset + h->strings_capacity > (uint64_t)st.st_size ||
+        h->records > h->records_capacity || h->strings_size > h->strings_capacity)
+    {
+        errx(1, "`%s' is not a rockepoll binary log", path);
+    }
+
+    strings = base + h->strings_offset;
+    records = h->records;
+    r = (const struct binlog_record *)(base + BINLOG_HEADER_SIZE);
+
+    for (i = 0; i < records; i++, r++) {
+        target = lookup(h, strings, r->target);
+        if (!matches(r, target)) {
+            continue;
+        }
+        if (conf_summary) {
+            count_record(r, target);
+        } else {
+            print_record(r, target, lookup(h, strings, r->user_agent));
+        }
+    }
+}
+
+
+static int
+compare_latencies(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+
+static int
+compare_targets(const void *a, const void *b)
+{
+    long x = ((const struct target_count *)a)->requests;
+    long y = ((const struct target_count *)b)->requests;
+
+    return (x < y) - (x > y);
+}
+
+
+static void
+print_summary(void)
+{
+    int i;
+    size_t n = 0, j;
+    double seconds = (summary.last_us - summary.first_us) / 1e6;
+    static const struct {
+        const char *name;
+        double q;
+    } percentiles[] = {
+        {"p50", 0.5}, {"p90", 0.9}, {"p99", 0.99}, {"max", 1},
+    };
+
+    printf("requests %ld\n", summary.requests);
+    printf("bytes %llu\n", (unsigned long long)summary.bytes);
+    printf("seconds %.3f\n", seconds);
+    if (seconds > 0) {
+        printf("requests_per_second %.0f\n", summary.requests / seconds);
+    }
+    for (i = 0; i < (int)(sizeof(summary.statuses) / sizeof(*summary.statuses)); i++) {
+        if (summary.statuses[i]) {
+            printf("status_%d %ld\n", i, summary.statuses[i]);
+        }
+    }
+
+    if (summary.latencies_count) {
+        qsort(summary.latencies, summary.latencies_count, sizeof(uint32_t),
+              compare_latencies);
+        for (j = 0; j < sizeof(percentiles) / sizeof(*percentiles); j++) {
+            printf("latency_%s_us %u\n", percentiles[j].name,
+                   summary.latencies[(size_t)(percentiles[j].q *
+                                              (summary.latencies_count - 1))]);
+        }
+    }
+
+    /* the table is packed to the front and sorted by requests */
+    for (j = 0; j < summary.targets_size; j++) {
+        if (summary.targets[j].target) {
+            summary.targets[n++] = summary.targets[j];
+        }
+    }
+    qsort(summary.targets, n, sizeof(struct target_count), compare_targets);
+    for (j = 0; j < n && (int)j < conf_top; j++) {
+        printf("top /%s %ld %llu\n", summary.targets[j].target,
+               summary.targets[j].requests,
+               (unsigned long long)summary.targets[j].bytes);
+    }
+}
+
+
+static void
+usage(const char *argv0)
+{
+    printf("usage: %s "
+           "[--status code] "
+           "[--method name] "
+           "[--prefix /path] "
+           "[--since epoch] "
+           "[--until epoch] "
+           "[--summary [--top n]] "
+           "segment...\n", argv0);
+}
+
+
+static long long
+parse_number(int argc, char *argv[], int *i)
+{
+    long long value;
+    char *next = NULL;
+
+    if (++*i >= argc) {
+        errx(1, "missing number after %s", argv[*i - 1]);
+    }
+
+    value = strtoll(argv[*i], &next, 10);
+    if (next == argv[*i] || *next != '\0' || value < 0) {
+        errx(1, "invalid argument `%s'", argv[*i]);
+    }
+
+    return value;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    int i, j;
+
+    for (i = 1; i < argc && !strncmp(argv[i], "--", 2); i++) {
+        if (!strcmp(argv[i], "--status")) {
+            filter.status = parse_number(argc, argv, &i);
+        }
+        else if (!strcmp(argv[i], "--method")) {
+            if (++i >= argc) {
+                errx(1, "missing name after --method");
+            }
+            for (j = 0; j < HTTP_METHODS_COUNT; j++) {
+                if (!strcasecmp(argv[i], http_methods[j].name)) {
+                    filter.method = j;
+                }
+            }
+            if (filter.method < 0) {
+                errx(1, "unknown method `%s'", argv[i]);
+            }
+        }
+        else if (!strcmp(argv[i], "--prefix")) {
+            if (++i >= argc) {
+                errx(1, "missing path after --prefix");
+            }
+            /* targets are logged without the leading slash */
+            filter.prefix = argv[i] + (*argv[i] == '/');
+            filter.prefix_size = strlen(filter.prefix);
+        }
+        else if (!strcmp(argv[i], "--since")) {
+            filter.since_us = parse_number(argc, argv, &i) * 1000000;
+        }
+        else if (!strcmp(argv[i], "--until")) {
+            filter.until_us = parse_number(argc, argv, &i) * 1000000;
+        }
+        else if (!strcmp(argv[i], "--summary")) {
+            conf_summary = 1;
+        }
+        else if (!strcmp(argv[i], "--top")) {
+            conf_top = parse_number(argc, argv, &i);
+        }
+        else if (!strcmp(argv[i], "--help")) {
+            usage(argv[0]);
+            return 0;
+        }
+        else {
+            errx(1, "unknown argument `%s'", argv[i]);
+        }
+    }
+
+    if (i == argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    for (; i < argc; i++) {
+        read_segment(argv[i]);
+    }
+
+    if (conf_summary) {
+        print_summary();
+    }
+
+    return 0;
+}
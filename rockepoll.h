@@ -0,0 +1,56 @@
+#ifndef ROCKEPOLL_H
+#define ROCKEPOLL_H
+
+#include <sys/types.h>
+
+#include "io.h"
+#include "parser.h"
+#include "handler.h"
+
+
+/* The API of librockepoll. A program registers its routes, then hands
+ * its arguments to rockepoll_main, which runs the server as rockepoll
+ * itself would and returns on SIGINT.
+ *
+ * A handler runs on the worker that read the request. req and what it
+ * points to are valid only until the handler returns. The handler either
+ * answers before it returns, defers the answer, or returns an HTTP status
+ * that is sent as rockepoll's own status page. It returns 0 in the first
+ * two cases. A status rockepoll has no reason phrase for, in any of these,
+ * is answered with 500.
+ */
+typedef int (*rockepoll_handler)(struct connection *conn,
+                                 struct http_request *req, void *arg);
+
+struct rockepoll_pending;
+
+
+/* prefix is matched against the decoded target, "/api/" for example */
+void rockepoll_route(const char *prefix, rockepoll_handler handler, void *arg);
+int rockepoll_main(int argc, char *argv[]);
+
+/* Answers with body, which is copied. content_type may be NULL */
+void rockepoll_respond(struct connection *conn, const struct http_request *req,
+                       enum http_status st, const char *content_type,
+                       const char *body, size_t size);
+
+/* Answers with size bytes of fd from offset, the fd is closed afterwards */
+void rockepoll_respond_file(struct connection *conn, const struct http_request *req,
+                            enum http_status st, const char *content_type,
+                            int fd, off_t offset, size_t size);
+
+/* Steps a handler appends on its own end with this one, it keeps the
+ * connection alive for the next request or closes it.
+ */
+enum conn_status rockepoll_request_done(struct connection *conn);
+
+/* Parks the connection until rockepoll_complete, which may be called
+ * from any thread, exactly once. If the connection goes away meanwhile,
+ * the answer is dropped.
+ */
+struct rockepoll_pending *rockepoll_defer(struct connection *conn,
+                                          const struct http_request *req);
+void rockepoll_complete(struct rockepoll_pending *pending, enum http_status st,
+                        const char *content_type, const char *body, size_t size);
+
+#endif
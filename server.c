@@ -1,6 +1,7 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <signal.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <sys/epoll.h>
@@ -16,23 +17,41 @@
 #include "utils.h"
 #include "utlist.h"
 #include "handler.h"
+#include "tls.h"
+#include "h2.h"
+#include "throttle.h"
+#include "admission.h"
+#include "stats.h"
+#include "arena.h"
+#include "proxy.h"
+#include "fileio.h"
+#include "upload.h"
+#include "listen.h"
+#include "balance.h"
+#include "cache.h"
+#include "vhost.h"
+#include "dump.h"
+#include "app.h"
+#include "upgrade.h"
+#include "binlog.h"
+#include "rockepoll.h"
+#include "trace.h"
 #include "config.h"
 
 
 #define EPOLL_WAIT_TIMEOUT (KEEP_ALIVE_TIMEOUT * 1000) /* in milliseconds */
 
-#if defined(__GNUC__) || defined(__INTEL_COMPILER)
-# define UNUSED __attribute__((__unused__))
-#else
-# define UNUSED
-#endif
-
 #define CLOSE_CONN(connections, conn)                                         \
 do {                                                                          \
+    TRACE2(conn_close, (conn)->fd, (conn)->served);                           \
+    tls_free((conn)->tls);                                                    \
     close((conn)->fd);                                                        \
     cleanup_steps((conn)->steps);                                             \
+    arena_reset(&(conn)->arena);                                              \
+    release_connection(&(conn)->addr);                                        \
     DL_DELETE(connections, conn);                                             \
     free(conn);                                                               \
+    mem_release(sizeof(struct connection));                                   \
 } while (0)
 
 
@@ -44,22 +63,281 @@ static int   conf_quiet = DEFAULT_CONF_QUIET;
 static int   conf_chroot = DEFAULT_CONF_CHROOT;
 static char *conf_listen_addr = DEFAULT_CONF_LISTEN_ADDR;
 static char *conf_root_dir = DEFAULT_CONF_ROOT_DIR;
+static int   conf_tls_port = DEFAULT_CONF_TLS_PORT;
+static char *conf_tls_cert = NULL;
+static char *conf_tls_key = NULL;
+static size_t conf_rate_conn = 0;
+static size_t conf_rate_ip = 0;
+static size_t conf_rate_global = 0;
+static size_t conf_max_conns = 0;
+static size_t conf_max_conns_ip = 0;
+static size_t conf_max_memory = 0;
+static size_t conf_io_threads = DEFAULT_CONF_IO_THREADS;
+static int   conf_upload = 0;
+static size_t conf_max_upload = DEFAULT_CONF_MAX_UPLOAD;
+static char *conf_dump = NULL;
+static char *conf_upgrade = NULL;
+static char *conf_binlog = NULL;
 
 static volatile int loop = 1;
 
+static const char overload_response[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Server: rockepoll\r\n"
+    "Retry-After: " XSTR(OVERLOAD_RETRY_AFTER) "\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n\r\n";
+
+
+/* a worker's side of a listen spec, shared for a Unix socket */
+struct listener {
+    int fd, tls, tcp, shared, pending;
+};
+
+
+/* connections that have work left, served round robin */
+struct run_queue {
+    struct connection *head, *tail;
+};
+
+
+/* throttled connections waiting for their buckets to refill */
+struct park_list {
+    struct connection *head;
+    int64_t next_wakeup;
+};
+
+
+static inline void
+enqueue_connection(struct run_queue *rq, struct connection *conn)
+{
+    if (conn->queued) {
+        return;
+    }
+
+    conn->queued = 1;
+    conn->run_next = NULL;
+    if (rq->tail) {
+        rq->tail->run_next = conn;
+    } else {
+        rq->head = conn;
+    }
+    rq->tail = conn;
+}
+
+
+static inline void
+park_connection(struct park_list *pl, struct connection *conn)
+{
+    if (conn->parked) {
+        return;
+    }
+
+    conn->parked = 1;
+    conn->park_next = pl->head;
+    pl->head = conn;
+
+    if (!pl->next_wakeup || conn->wakeup < pl->next_wakeup) {
+        pl->next_wakeup = conn->wakeup;
+    }
+}
+
+
+static void
+wakeup_connections(struct park_list *pl, struct run_queue *rq)
+{
+    int64_t now;
+    struct connection *conn, **link;
+
+    if (!pl->head) {
+        return;
+    }
+
+    now = monotonic_ms();
+    pl->next_wakeup = 0;
+
+    for (link = &pl->head; (conn = *link);) {
+        if (conn->status == C_CLOSE || conn->wakeup <= now) {
+            *link = conn->park_next;
+            conn->parked = 0;
+            conn->wakeup = 0;
+            enqueue_connection(rq, conn);
+            continue;
+        }
+
+        if (!pl->next_wakeup || conn->wakeup < pl->next_wakeup) {
+            pl->next_wakeup = conn->wakeup;
+        }
+        link = &conn->park_next;
+    }
+}
+
 
+static int
+epoll_timeout(const struct run_queue *rq, const struct park_list *pl,
+              int accept_pending)
+{
+    int64_t wait;
+
+    /* don't sleep while there is work left from the previous turn */
+    if (rq->head || accept_pending) {
+        return 0;
+    }
+
+    if (pl->head) {
+        wait = pl->next_wakeup - monotonic_ms();
+        return MAX(0, MIN(wait, EPOLL_WAIT_TIMEOUT / 4));
+    }
+
+    return EPOLL_WAIT_TIMEOUT / 4;
+}
+
+
+/* The connections list is kept in LRU order, the least recently active
+ * idle keep-alive connection is closed to make room for a new one.
+ */
 static void
+evict_idle_connection(struct connection **connections)
+{
+    int scan = EVICT_SCAN_LIMIT;
+    struct connection *conn, *tmp_conn;
+
+    DL_FOREACH_SAFE(*connections, conn, tmp_conn) {
+        if (!scan--) {
+            break;
+        }
+        if (conn->status != C_CLOSE && connection_is_idle(conn)) {
+            CLOSE_CONN(*connections, conn);
+            stats_inc(ST_EVICTED_IDLE);
+            break;
+        }
+    }
+}
+
+
+/* No allocation and no connection state, the answer fits in the socket
+ * buffer of a fresh connection.
+ */
+static void
+shed_peer(int peerfd, int tls)
+{
+    if (!tls) {
+        send(peerfd, overload_response, sizeof(overload_response) - 1,
+             MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    close(peerfd);
+}
+
+
+static void
+run_connections(struct connection **connections, struct run_queue *rq,
+                struct park_list *pl, time_t now)
+{
+    long ran = 0, bytes = 0;
+    struct connection *conn, *next;
+
+    /* a single turn for everything that is queued now, connections that
+     * spent their budget go behind the ones that got ready meanwhile
+     */
+    conn = rq->head;
+    rq->head = rq->tail = NULL;
+
+    for (; conn; conn = next) {
+        next = conn->run_next;
+        conn->queued = 0;
+
+        if (conn->status == C_CLOSE || conn->parked) {
+            continue;
+        }
+
+        DL_DELETE(*connections, conn);
+        DL_APPEND(*connections, conn);
+
+        conn->wakeup = 0;
+        if (process_connection(conn)) {
+            enqueue_connection(rq, conn);
+        } else if (conn->wakeup && conn->status != C_CLOSE) {
+            park_connection(pl, conn);
+        }
+        conn->last_active = now;
+
+        ran++;
+        bytes += CONN_BYTE_BUDGET - conn->budget;
+    }
+
+    balance_account(ran, bytes);
+}
+
+
+/* Idle keep-alive connections are between requests, nothing of theirs is
+ * left in this worker. The most recently active go first, they are the
+ * likeliest to send the next request soon.
+ */
+static void
+hand_off_connections(struct connection **connections, int epollfd,
+                     struct worker *to)
+{
+    int batch = BALANCE_BATCH, scan = BALANCE_SCAN;
+    struct connection *conn, *prev;
+
+    if (!*connections) {
+        return;
+    }
+
+    for (conn = (*connections)->prev; conn && batch && scan--; conn = prev) {
+        prev = (conn == *connections) ? NULL : conn->prev;
+
+        if (conn->status != C_RUN || !connection_is_idle(conn)) {
+            continue;
+        }
+        if (epoll_ctl(epollfd, EPOLL_CTL_DEL, conn->fd, NULL) < 0) {
+            warn("epoll_ctl()");
+            continue;
+        }
+
+        DL_DELETE(*connections, conn);
+        balance_handoff(to, conn);
+        batch--;
+    }
+}
+
+
+static void
+adopt_connections(struct connection **connections, int epollfd)
+{
+    struct connection *conn, *next;
+    struct epoll_event peer_event = {0};
+
+    for (conn = balance_received(); conn; conn = next) {
+        next = conn->run_next;
+        DL_APPEND(*connections, conn);
+
+        /* anything that arrived meanwhile is reported right away */
+        peer_event.data.ptr = conn;
+        peer_event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, conn->fd, &peer_event) < 0) {
+            warn("epoll_ctl()");
+            CLOSE_CONN(*connections, conn);
+        }
+    }
+}
+
+
+/* Returns 1 when it stopped on ACCEPT_BUDGET with the queue not drained */
+static int
 accept_peers_loop(struct connection **connections,
-                  int listenfd, int epollfd, time_t now)
+                  const struct listener *l, int epollfd, time_t now)
 {
-    int                  peerfd, opt;
+    int                  peerfd, opt, budget = ACCEPT_BUDGET;
+    struct in6_addr      addr;
     struct connection   *conn;
-    struct sockaddr_in   conn_addr;
+    struct sockaddr_storage conn_addr;
     struct epoll_event   peer_event = {0};
-    socklen_t            conn_addr_len = sizeof(conn_addr);
+    socklen_t            conn_addr_len;
 
-    for (;;) {
-        peerfd = accept4(listenfd,
+    while (budget--) {
+        conn_addr_len = sizeof(conn_addr);
+        peerfd = accept4(l->fd,
                          (struct sockaddr *)&conn_addr, &conn_addr_len,
                          SOCK_NONBLOCK);
 
@@ -67,24 +345,59 @@ accept_peers_loop(struct connection **connections,
             if (errno != EAGAIN && errno != EWOULDBLOCK) {
                 warn("accept4()");
             }
-            break;
+            return 0;
         } else {
+            stats_inc(ST_ACCEPTED);
+
+            sockaddr_to_addr((struct sockaddr *)&conn_addr, &addr);
+
+            if (near_limits()) {
+                evict_idle_connection(connections);
+            }
+
+            if (admit_connection(&addr) != SHED_NONE) {
+                shed_peer(peerfd, l->tls);
+                continue;
+            }
+
             opt = 1;
-            if (setsockopt(peerfd, SOL_TCP, TCP_NODELAY, &opt, sizeof(opt))) {
+            if (l->tcp &&
+                setsockopt(peerfd, SOL_TCP, TCP_NODELAY, &opt, sizeof(opt)))
+            {
                 warn("setsockopt(), SOL_TCP, TCP_NODELAY");
             }
 
             conn = xmalloc(sizeof(struct connection));
+            mem_charge(sizeof(struct connection));
 
-            memset(conn->ip, 0, sizeof(conn->ip));
-            strcpy(conn->ip, inet_ntoa(conn_addr.sin_addr));
+            conn->addr = addr;
             conn->fd = peerfd;
+            conn->accepted = now;
             conn->last_active = now;
             conn->status = C_RUN;
             conn->keep_alive = conf_keep_alive;
+            conn->served = 0;
+            conn->queued = 0;
+            conn->parked = 0;
+            conn->transport = &socket_transport;
+            conn->tls = NULL;
+            conn->arena = NULL;
+            throttle_init_connection(conn);
             conn->steps = NULL;
             conn->next = NULL;
             conn->prev = NULL;
+            TRACE2(conn_accept, peerfd, l->fd);
+
+            if (l->tls) {
+                if (!(conn->tls = tls_new(peerfd))) {
+                    warnx("tls_new()");
+                    DL_APPEND(*connections, conn);
+                    CLOSE_CONN(*connections, conn);
+                    continue;
+                }
+                conn->transport = &tls_transport;
+                setup_handshake_io_step(&conn->steps, NULL);
+            }
             setup_read_io_step(&conn->steps, build_response);
 
             DL_APPEND(*connections, conn);
@@ -97,69 +410,234 @@ accept_peers_loop(struct connection **connections,
             }
         }
     }
+
+    return 1;
+}
+
+
+static int
+accept_pending(const struct listener *listeners, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (listeners[i].pending) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/* Stops accepting once a new process took over, what is already in the
+ * backlogs goes to it. Idle keep-alive connections are closed, the others
+ * finish their response and are closed after it.
+ */
+static void
+start_drain(struct connection *connections, struct listener *listeners,
+            int *listeners_count, int epollfd)
+{
+    int i;
+    struct connection *conn;
+
+    for (i = 0; i < *listeners_count; i++) {
+        if (epoll_ctl(epollfd, EPOLL_CTL_DEL, listeners[i].fd, NULL) < 0) {
+            warn("epoll_ctl()");
+        }
+        if (!listeners[i].shared) {
+            close(listeners[i].fd);
+        }
+    }
+    *listeners_count = 0;
+
+    for (conn = connections; conn; conn = conn->next) {
+        conn->keep_alive = 0;
+        if (connection_is_idle(conn)) {
+            conn->status = C_CLOSE;
+        }
+    }
 }
 
 
 static void *
-run_server()
+run_server(void *arg)
 {
-    int                  i, epollfd, listenfd;
-    time_t               now;
+    int                  i, j, n, epollfd, fileio_fd, balance_fd, dump_fd, app_fd;
+    int                  upgrade_fd, listeners_count = 0;
+    int                  fds[LISTEN_MAX_FDS], worker = (intptr_t)arg;
+    time_t               now, drain_deadline = 0;
     struct epoll_event   ev = {0};
     struct epoll_event   events[MAXFDS] = {0};
     struct connection   *tmp_conn, *conn, *connections = NULL;
-
-    listenfd = create_listen_socket(conf_listen_addr, conf_port);
+    struct listener     *listeners, *l;
+    struct run_queue     rq = {NULL, NULL};
+    struct park_list     pl = {NULL, 0};
+    struct worker       *target;
 
     if ((epollfd = epoll_create1(0)) < 0) {
         err(1, "epoll_create1()");
     }
+    init_proxy_worker(epollfd);
 
-    ev.data.ptr = &listenfd;
+    if ((fileio_fd = init_fileio_worker()) >= 0) {
+        ev.data.ptr = &fileio_fd;
+        ev.events = EPOLLIN | EPOLLET;
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fileio_fd, &ev) < 0) {
+            err(1, "epoll_ctl()");
+        }
+    }
+
+    if ((balance_fd = init_balance_worker()) >= 0) {
+        ev.data.ptr = &balance_fd;
+        ev.events = EPOLLIN | EPOLLET;
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, balance_fd, &ev) < 0) {
+            err(1, "epoll_ctl()");
+        }
+    }
+
+    if ((app_fd = init_app_worker()) >= 0) {
+        ev.data.ptr = &app_fd;
+        ev.events = EPOLLIN | EPOLLET;
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, app_fd, &ev) < 0) {
+            err(1, "epoll_ctl()");
+        }
+    }
+
+    dump_fd = init_dump_worker();
+    ev.data.ptr = &dump_fd;
     ev.events = EPOLLIN | EPOLLET;
-    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, listenfd, &ev) < 0) {
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, dump_fd, &ev) < 0) {
         err(1, "epoll_ctl()");
     }
 
-    while (loop) {
-        now = time(NULL);
+    if ((upgrade_fd = init_upgrade_worker()) >= 0) {
+        ev.data.ptr = &upgrade_fd;
+        ev.events = EPOLLIN | EPOLLET;
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, upgrade_fd, &ev) < 0) {
+            err(1, "epoll_ctl()");
+        }
+    }
 
-        DL_FOREACH_SAFE(connections, conn, tmp_conn) {
-            if (conn->status == C_CLOSE ||
-                difftime(now, conn->last_active) > KEEP_ALIVE_TIMEOUT)
-            {
-                CLOSE_CONN(connections, conn);
+    /* a shared Unix socket wakes a single worker per connection */
+    listeners = xmalloc(sizeof(struct listener) * listen_specs_count * LISTEN_MAX_FDS);
+    for (i = 0; i < listen_specs_count; i++) {
+        n = open_listeners(&listen_specs[i], worker, conf_threads, fds);
+        for (j = 0; j < n; j++) {
+            l = &listeners[listeners_count++];
+            l->fd = fds[j];
+            l->tls = listen_specs[i].tls;
+            l->tcp = listen_specs[i].addr.ss_family != AF_UNIX;
+            l->shared = listen_specs[i].fd >= 0;
+            l->pending = 0;
+
+            ev.data.ptr = l;
+            ev.events = EPOLLIN | EPOLLET | (l->tcp ? 0 : EPOLLEXCLUSIVE);
+            if (epoll_ctl(epollfd, EPOLL_CTL_ADD, l->fd, &ev) < 0) {
+                err(1, "epoll_ctl()");
             }
         }
+    }
 
-        i = epoll_wait(epollfd, events, MAXFDS, EPOLL_WAIT_TIMEOUT / 4);
+    while (loop) {
+        i = epoll_wait(epollfd, events, MAXFDS,
+                       epoll_timeout(&rq, &pl,
+                                     accept_pending(listeners, listeners_count)));
         if (i < 0) {
             warn("epoll_wait()");
             continue;
         }
 
+        now = time(NULL);
 
         while (i) {
             ev = events[--i];
             conn = ev.data.ptr;
 
+            /* the upstream of a proxied request has news for its client */
+            if ((uintptr_t)conn & UPSTREAM_TAG) {
+                conn = (struct connection *)((uintptr_t)conn & ~UPSTREAM_TAG);
+                enqueue_connection(&rq, conn);
+                continue;
+            }
+
+            if ((void *)conn >= (void *)listeners &&
+                (void *)conn < (void *)(listeners + listeners_count))
+            {
+                ((struct listener *)conn)->pending = 1;
+                continue;
+            }
+
             /* In this case conn does not reference to connection's struct,
-             * but references to address of listenfd variable. It works because
-             * connection's struct first element is fd, so dereferencing gives
-             * in both cases fd variable
+             * but references to address of fileio_fd, app_fd, balance_fd,
+             * dump_fd or upgrade_fd variable. It works because connection's
+             * struct first element is fd, so dereferencing gives in all
+             * cases fd variable
              */
-            if (conn->fd  == listenfd) {
-                accept_peers_loop(&connections, listenfd, epollfd, now);
+            if (conn->fd == dump_fd || conn->fd == upgrade_fd) {
+                /* the snapshot or the drain start once this turn is over */
+                continue;
+            } else if (conn->fd == balance_fd) {
+                adopt_connections(&connections, epollfd);
+            } else if (conn->fd == fileio_fd) {
+                while ((conn = fileio_next_done())) {
+                    enqueue_connection(&rq, conn);
+                }
+            } else if (conn->fd == app_fd) {
+                while ((conn = app_next_done())) {
+                    enqueue_connection(&rq, conn);
+                }
             } else if (
                 ev.events & EPOLLHUP ||
                 ev.events & EPOLLERR ||
                 ev.events & EPOLLRDHUP)
             {
-                CLOSE_CONN(connections, conn);
+                conn->status = C_CLOSE;
             } else {
-                process_connection(conn);
-                conn->last_active = now;
+                enqueue_connection(&rq, conn);
+            }
+        }
+
+        for (i = 0; i < listeners_count; i++) {
+            l = &listeners[i];
+            if (l->pending) {
+                l->pending = accept_peers_loop(&connections, l, epollfd, now);
+            }
+        }
+
+        wakeup_connections(&pl, &rq);
+        run_connections(&connections, &rq, &pl, now);
+
+        if (!drain_deadline && upgrade_draining()) {
+            start_drain(connections, listeners, &listeners_count, epollfd);
+            drain_deadline = now + UPGRADE_DRAIN_TIMEOUT;
+        }
+
+        DL_FOREACH_SAFE(connections, conn, tmp_conn) {
+            if (conn->queued || conn->parked) {
+                continue;
             }
+
+            if (conn->status != C_CLOSE) {
+                if (difftime(now, conn->last_active) <= connection_timeout(conn)) {
+                    continue;
+                }
+                connection_timed_out(conn);
+            }
+
+            CLOSE_CONN(connections, conn);
+        }
+
+        if (dump_pending()) {
+            dump_worker(connections, now);
+        }
+
+        if (drain_deadline && (!connections || now >= drain_deadline)) {
+            break;
+        }
+
+        if (loop && (target = balance_target())) {
+            hand_off_connections(&connections, epollfd, target);
         }
     }
 
@@ -167,7 +645,13 @@ run_server()
         CLOSE_CONN(connections, conn);
     }
 
-    close(listenfd);
+    /* shared sockets stay open for the other workers */
+    for (i = 0; i < listeners_count; i++) {
+        if (!listeners[i].shared) {
+            close(listeners[i].fd);
+        }
+    }
+    free(listeners);
     close(epollfd);
 
     return NULL;
@@ -181,15 +665,69 @@ sigint_handler(int dummy UNUSED)
 }
 
 
+static void
+sigusr1_handler(int dummy UNUSED)
+{
+    dump_request();
+}
+
+
 static void
 usage(const char *argv0)
 {
     printf("usage: %s path "
            "[--addr addr] "
            "[--port port] "
+           "[--listen addr:port|[addr]:port|unix:path[,tls][,backlog=n][,mode=octal][,v6only][,defer-accept]]... "
            "[--quiet] "
            "[--chroot] "
-           "[--keep-alive]\n", argv0);
+           "[--keep-alive] "
+           "[--tls-cert file --tls-key file [--tls-port port]] "
+           "[--rate-conn bytes/s] "
+           "[--rate-ip bytes/s] "
+           "[--rate-global bytes/s] "
+           "[--max-conns n] "
+           "[--max-conns-ip n] "
+           "[--max-memory bytes] "
+           "[--io-threads n] "
+           "[--upload [--max-upload bytes]] "
+           "[--proxy /prefix=host:port|/prefix=unix:path]... "
+           "[--vhost name=path[,alias=name]...[,index=page][,default]]... "
+           "[--dump file] "
+           "[--upgrade path] "
+           "[--binlog dir] "
+           "[--cache /path|/prefix*|*suffix|mime[/*]=directive[,directive]...]...\n", argv0);
+}
+
+
+static size_t
+parse_size_arg(int argc, char *argv[], int *i)
+{
+    size_t value;
+    char *next = NULL;
+
+    if (++*i >= argc) {
+        errx(1, "missing number after %s", argv[*i - 1]);
+    }
+
+    value = strtoull(argv[*i], &next, 10);
+    if (next == argv[*i] || *next != '\0') {
+        errx(1, "invalid argument `%s'", argv[*i]);
+    }
+
+    return value;
+}
+
+
+static void
+add_default_listener(int port, int tls)
+{
+    char spec[128];
+
+    snprintf(spec, sizeof(spec),
+             strchr(conf_listen_addr, ':') ? "[%s]:%d%s" : "%s:%d%s",
+             conf_listen_addr, port, tls ? ",tls" : "");
+    add_listen_spec(spec);
 }
 
 
@@ -207,6 +745,7 @@ parse_args(int argc, char *argv[])
 
     if (getuid() == 0) {
         conf_port = 80;
+        conf_tls_port = 443;
     }
 
     conf_root_dir = argv[1];
@@ -237,12 +776,102 @@ parse_args(int argc, char *argv[])
                 errx(1, "invalid argument `%s'", argv[i]);
             }
         }
+        else if (!strcmp(argv[i], "--listen")) {
+            if (++i >= argc) {
+                errx(1, "missing address after --listen");
+            }
+            add_listen_spec(argv[i]);
+        }
         else if (!strcmp(argv[i], "--addr")) {
             if (++i >= argc) {
                 errx(1, "missing ip after --addr");
             }
             conf_listen_addr = argv[i];
         }
+        else if (!strcmp(argv[i], "--tls-port")) {
+            if (++i >= argc) {
+                errx(1, "missing number after --tls-port");
+            }
+            conf_tls_port = strtol(argv[i], &next, 10);
+            if (next == argv[i] || *next != '\0') {
+                errx(1, "invalid argument `%s'", argv[i]);
+            }
+        }
+        else if (!strcmp(argv[i], "--tls-cert")) {
+            if (++i >= argc) {
+                errx(1, "missing file after --tls-cert");
+            }
+            conf_tls_cert = argv[i];
+        }
+        else if (!strcmp(argv[i], "--tls-key")) {
+            if (++i >= argc) {
+                errx(1, "missing file after --tls-key");
+            }
+            conf_tls_key = argv[i];
+        }
+        else if (!strcmp(argv[i], "--rate-conn")) {
+            conf_rate_conn = parse_size_arg(argc, argv, &i);
+        }
+        else if (!strcmp(argv[i], "--rate-ip")) {
+            conf_rate_ip = parse_size_arg(argc, argv, &i);
+        }
+        else if (!strcmp(argv[i], "--rate-global")) {
+            conf_rate_global = parse_size_arg(argc, argv, &i);
+        }
+        else if (!strcmp(argv[i], "--max-conns")) {
+            conf_max_conns = parse_size_arg(argc, argv, &i);
+        }
+        else if (!strcmp(argv[i], "--max-conns-ip")) {
+            conf_max_conns_ip = parse_size_arg(argc, argv, &i);
+        }
+        else if (!strcmp(argv[i], "--max-memory")) {
+            conf_max_memory = parse_size_arg(argc, argv, &i);
+        }
+        else if (!strcmp(argv[i], "--io-threads")) {
+            conf_io_threads = parse_size_arg(argc, argv, &i);
+        }
+        else if (!strcmp(argv[i], "--max-upload")) {
+            conf_max_upload = parse_size_arg(argc, argv, &i);
+        }
+        else if (!strcmp(argv[i], "--upload")) {
+            conf_upload = 1;
+        }
+        else if (!strcmp(argv[i], "--proxy")) {
+            if (++i >= argc) {
+                errx(1, "missing route after --proxy");
+            }
+            proxy_add_route(argv[i]);
+        }
+        else if (!strcmp(argv[i], "--vhost")) {
+            if (++i >= argc) {
+                errx(1, "missing host after --vhost");
+            }
+            vhost_add(argv[i]);
+        }
+        else if (!strcmp(argv[i], "--cache")) {
+            if (++i >= argc) {
+                errx(1, "missing rule after --cache");
+            }
+            cache_add_rule(argv[i]);
+        }
+        else if (!strcmp(argv[i], "--dump")) {
+            if (++i >= argc) {
+                errx(1, "missing file after --dump");
+            }
+            conf_dump = argv[i];
+        }
+        else if (!strcmp(argv[i], "--upgrade")) {
+            if (++i >= argc) {
+                errx(1, "missing path after --upgrade");
+            }
+            conf_upgrade = argv[i];
+        }
+        else if (!strcmp(argv[i], "--binlog")) {
+            if (++i >= argc) {
+                errx(1, "missing directory after --binlog");
+            }
+            conf_binlog = argv[i];
+        }
         else if (!strcmp(argv[i], "--quiet")) {
             conf_quiet = 1;
         }
@@ -257,16 +886,40 @@ parse_args(int argc, char *argv[])
         }
     }
 
+    /* without --listen the address and ports given make the listeners */
+    if (!listen_specs_count) {
+        add_default_listener(conf_port, 0);
+        if (conf_tls_cert) {
+            add_default_listener(conf_tls_port, 1);
+        }
+    }
+
+    for (i = 0; i < listen_specs_count; i++) {
+        if (listen_specs[i].tls && !conf_tls_cert) {
+            errx(1, "`%s' needs --tls-cert and --tls-key", listen_specs[i].name);
+        }
+    }
+
+    if (!conf_tls_cert != !conf_tls_key) {
+        errx(1, "--tls-cert and --tls-key go together");
+    }
+#ifndef USE_TLS
+    if (conf_tls_cert) {
+        errx(1, "built without TLS support");
+    }
+#endif
+
     conf_threads = (conf_threads) ? conf_threads : 1;
 }
 
 
 int
-main(int argc, char *argv[])
+rockepoll_main(int argc, char *argv[])
 {
     void *ptr;
     int i;
     pthread_t *tid;
+    struct connection *conn, *next, *connections = NULL;
 
     signal(SIGPIPE, SIG_IGN);
     signal(SIGINT, sigint_handler);
@@ -274,26 +927,58 @@ main(int argc, char *argv[])
     parse_args(argc, argv);
 
     init_logger(conf_quiet);
+    init_binlog(conf_binlog);
+    init_dump(conf_dump);
+    signal(SIGUSR1, sigusr1_handler);
+#ifdef USE_TLS
+    if (conf_tls_cert) {
+        init_tls(conf_tls_cert, conf_tls_key);
+    }
+#endif
+    init_h2();
+    init_throttle(conf_rate_conn, conf_rate_ip, conf_rate_global);
+    init_limits(conf_max_conns, conf_max_conns_ip, conf_max_memory);
+    init_upgrade(conf_upgrade);
+    init_listeners();
     init_handler(conf_root_dir, conf_chroot);
-
-    printf("listening on http://%s:%d/.\nRunning with %d threads.\n", conf_listen_addr, conf_port, conf_threads);
+    init_fileio(conf_io_threads);
+    init_upload(conf_upload, conf_max_upload);
+    init_balance(conf_threads);
+    upgrade_prewarm();
+
+    for (i = 0; i < listen_specs_count; i++) {
+        printf("listening on %s://%s/.\n",
+               listen_specs[i].tls ? "https" : "http", listen_specs[i].name);
+    }
+    printf("Running with %d threads.\n", conf_threads);
 
     if (conf_threads == 1) {
-        run_server();
+        upgrade_started();
+        run_server(NULL);
+        stats_dump(stderr);
         return 0;
     }
 
     tid = xmalloc(sizeof(pthread_t) * conf_threads);
 
     for (i = 0; i < conf_threads; i++) {
-        pthread_create(&(tid[i]), NULL, &run_server, NULL);
+        pthread_create(&(tid[i]), NULL, &run_server, (void *)(intptr_t)i);
     }
+    upgrade_started();
 
     for (i = 0; i < conf_threads; i++) {
         pthread_join(tid[i], &ptr);
     }
 
+    for (conn = balance_leftovers(); conn; conn = next) {
+        next = conn->run_next;
+        DL_APPEND(connections, conn);
+        CLOSE_CONN(connections, conn);
+    }
+
     free(tid);
 
+    stats_dump(stderr);
+
     return 0;
 }
@@ -0,0 +1,17 @@
+#include <stdio.h>
+
+#include "stats.h"
+
+
+long stats[STATS_COUNT] = {0};
+
+
+void
+stats_dump(FILE *f)
+{
+    int i;
+
+    for (i = 0; i < STATS_COUNT; i++) {
+        fprintf(f, "%s %ld\n", stat_names[i].name, stats_get(i));
+    }
+}
@@ -0,0 +1,105 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+#include "parser.h"
+
+
+enum stat_counter {
+    ST_ACCEPTED,
+    ST_SHED_CONNS,
+    ST_SHED_CONNS_IP,
+    ST_SHED_MEMORY,
+    ST_EVICTED_IDLE,
+    ST_MEMORY_USED,
+    ST_MEMORY_PEAK,
+    ST_ARENA_PEAK,
+    ST_UPSTREAM_REQUESTS,
+    ST_UPSTREAM_REUSED,
+    ST_UPSTREAM_RETRIES,
+    ST_UPSTREAM_FAILED,
+    ST_FILEIO_JOBS,
+    ST_FILEIO_COALESCED,
+    ST_FILEIO_INLINE,
+    ST_UPLOADS,
+    ST_UPLOAD_BYTES,
+    ST_MIGRATED,
+    ST_LOAD_IMBALANCE,
+    ST_APP_REQUESTS,
+    ST_APP_DEFERRED,
+    STATS_COUNT,
+};
+
+
+ENUM_MAPPING(stat_names) {
+    MAPPING_ENTRY(ST_ACCEPTED,      "accepted"),
+    MAPPING_ENTRY(ST_SHED_CONNS,    "shed_connections"),
+    MAPPING_ENTRY(ST_SHED_CONNS_IP, "shed_connections_per_ip"),
+    MAPPING_ENTRY(ST_SHED_MEMORY,   "shed_memory"),
+    MAPPING_ENTRY(ST_EVICTED_IDLE,  "evicted_idle"),
+    MAPPING_ENTRY(ST_MEMORY_USED,   "memory_used"),
+    MAPPING_ENTRY(ST_MEMORY_PEAK,   "memory_peak"),
+    MAPPING_ENTRY(ST_ARENA_PEAK,    "arena_peak"),
+    MAPPING_ENTRY(ST_UPSTREAM_REQUESTS, "upstream_requests"),
+    MAPPING_ENTRY(ST_UPSTREAM_REUSED,   "upstream_reused"),
+    MAPPING_ENTRY(ST_UPSTREAM_RETRIES,  "upstream_retries"),
+    MAPPING_ENTRY(ST_UPSTREAM_FAILED,   "upstream_failed"),
+    MAPPING_ENTRY(ST_FILEIO_JOBS,       "file_io_jobs"),
+    MAPPING_ENTRY(ST_FILEIO_COALESCED,  "file_io_coalesced"),
+    MAPPING_ENTRY(ST_FILEIO_INLINE,     "file_io_inline"),
+    MAPPING_ENTRY(ST_UPLOADS,           "uploads"),
+    MAPPING_ENTRY(ST_UPLOAD_BYTES,      "upload_bytes"),
+    MAPPING_ENTRY(ST_MIGRATED,          "migrated"),
+    MAPPING_ENTRY(ST_LOAD_IMBALANCE,    "load_imbalance"),
+    MAPPING_ENTRY(ST_APP_REQUESTS,      "app_requests"),
+    MAPPING_ENTRY(ST_APP_DEFERRED,      "app_deferred"),
+};
+
+
+extern long stats[STATS_COUNT];
+
+
+/* counters are shared by all workers, updates are relaxed atomics */
+static inline long
+stats_add(enum stat_counter counter, long value)
+{
+    return __atomic_add_fetch(&stats[counter], value, __ATOMIC_RELAXED);
+}
+
+
+static inline void
+stats_inc(enum stat_counter counter)
+{
+    stats_add(counter, 1);
+}
+
+
+static inline long
+stats_get(enum stat_counter counter)
+{
+    return __atomic_load_n(&stats[counter], __ATOMIC_RELAXED);
+}
+
+
+static inline void
+stats_set(enum stat_counter counter, long value)
+{
+    __atomic_store_n(&stats[counter], value, __ATOMIC_RELAXED);
+}
+
+
+static inline void
+stats_max(enum stat_counter counter, long value)
+{
+    long old = stats_get(counter);
+
+    while (value > old &&
+           !__atomic_compare_exchange_n(&stats[counter], &old, value, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) ;
+}
+
+
+void stats_dump(FILE *f);
+
+#endif
@@ -0,0 +1,177 @@
+#include <time.h>
+
+#include "io.h"
+#include "throttle.h"
+#include "peers.h"
+#include "utils.h"
+#include "config.h"
+
+
+#define NSEC_PER_SEC 1000000000LL
+
+
+#define SPIN_LOCK(lock)                                                       \
+    while (__atomic_test_and_set((lock), __ATOMIC_ACQUIRE)) ;
+
+#define SPIN_UNLOCK(lock)                                                     \
+    __atomic_clear((lock), __ATOMIC_RELEASE);
+
+
+static int64_t conn_rate = 0, ip_rate = 0, global_rate = 0;
+static struct {
+    char lock;
+    struct bucket bucket;
+} global;
+
+
+static inline int64_t
+monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+
+inline int64_t
+monotonic_ms(void)
+{
+    return monotonic_ns() / 1000000;
+}
+
+
+inline int64_t
+monotonic_us(void)
+{
+    return monotonic_ns() / 1000;
+}
+
+
+static inline int64_t
+burst_size(int64_t rate)
+{
+    return MAX(rate * THROTTLE_BURST_MS / 1000, THROTTLE_MIN_BURST);
+}
+
+
+static inline void
+refill(struct bucket *b, int64_t rate, int64_t now)
+{
+    int64_t burst = burst_size(rate), elapsed = now - b->stamp;
+
+    if (!b->stamp) {
+        /* a fresh per-address slot */
+        b->tokens = burst;
+    } else if (b->tokens < burst) {
+        /* a second is already more than a burst, don't multiply it out */
+        b->tokens += (elapsed < NSEC_PER_SEC) ? elapsed * rate / NSEC_PER_SEC : rate;
+        b->tokens = MIN(b->tokens, burst);
+    }
+    b->stamp = now;
+}
+
+
+/* time until the bucket has anything to give, in milliseconds */
+static inline int64_t
+deficit_ms(const struct bucket *b, int64_t rate)
+{
+    return (b->tokens >= 0) ? 0 : (-b->tokens * 1000 / rate) + 1;
+}
+
+
+void
+init_throttle(size_t conn_rate_conf, size_t ip_rate_conf, size_t global_rate_conf)
+{
+    conn_rate = conn_rate_conf;
+    ip_rate = ip_rate_conf;
+    global_rate = global_rate_conf;
+
+    if (ip_rate) {
+        init_peers();
+    }
+
+    global.lock = 0;
+    global.bucket.tokens = burst_size(global_rate);
+    global.bucket.stamp = monotonic_ns();
+}
+
+
+void
+throttle_init_connection(struct connection *conn)
+{
+    conn->bucket.tokens = burst_size(conn_rate);
+    conn->bucket.stamp = monotonic_ns();
+    conn->wakeup = 0;
+}
+
+
+/* How much of size may be sent now. When the answer is zero conn->wakeup
+ * is set to the moment some tokens are available again.
+ */
+size_t
+throttle_allowance(struct connection *conn, size_t size)
+{
+    int64_t now, allowed = size, wait = 0;
+    struct peer *peer;
+
+    if (!conn_rate && !ip_rate && !global_rate) {
+        return size;
+    }
+
+    now = monotonic_ns();
+
+    if (conn_rate) {
+        refill(&conn->bucket, conn_rate, now);
+        allowed = MIN(allowed, conn->bucket.tokens);
+        wait = MAX(wait, deficit_ms(&conn->bucket, conn_rate));
+    }
+
+    if (ip_rate && (peer = lock_peer(&conn->addr, now / 1000000))) {
+        refill(&peer->bucket, ip_rate, now);
+        allowed = MIN(allowed, peer->bucket.tokens);
+        wait = MAX(wait, deficit_ms(&peer->bucket, ip_rate));
+        unlock_peer(peer);
+    }
+
+    if (global_rate) {
+        SPIN_LOCK(&global.lock)
+        refill(&global.bucket, global_rate, now);
+        allowed = MIN(allowed, global.bucket.tokens);
+        wait = MAX(wait, deficit_ms(&global.bucket, global_rate));
+        SPIN_UNLOCK(&global.lock)
+    }
+
+    if (allowed <= 0) {
+        conn->wakeup = now / 1000000 + MAX(wait, 1);
+        return 0;
+    }
+
+    return allowed;
+}
+
+
+void
+throttle_consume(struct connection *conn, size_t size)
+{
+    struct peer *peer;
+
+    if (!conn_rate && !ip_rate && !global_rate) {
+        return;
+    }
+
+    if (conn_rate) {
+        conn->bucket.tokens -= size;
+    }
+
+    if (ip_rate && (peer = lock_peer(&conn->addr, monotonic_ms()))) {
+        peer->bucket.tokens -= size;
+        unlock_peer(peer);
+    }
+
+    if (global_rate) {
+        SPIN_LOCK(&global.lock)
+        global.bucket.tokens -= size;
+        SPIN_UNLOCK(&global.lock)
+    }
+}
@@ -0,0 +1,24 @@
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+struct connection;
+
+struct bucket {
+    int64_t tokens, stamp;
+};
+
+
+void init_throttle(size_t conn_rate, size_t ip_rate, size_t global_rate);
+void throttle_init_connection(struct connection *conn);
+
+int64_t monotonic_ms(void);
+int64_t monotonic_us(void);
+
+size_t throttle_allowance(struct connection *conn, size_t size);
+void throttle_consume(struct connection *conn, size_t size);
+
+#endif
@@ -0,0 +1,227 @@
+#ifdef USE_TLS
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <err.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "io.h"
+#include "tls.h"
+#include "utils.h"
+
+
+#define TLS_SENDFILE_BUF_SIZE 1024 * 16
+#define TLS_SESSION_ID_CONTEXT "rockepoll"
+
+
+struct tls {
+    SSL *ssl;
+    int fd, ktls_send;
+};
+
+
+/* One context is shared by every worker thread, so the session cache and
+ * the ticket encryption keys are common to all of them and a session
+ * resumed on any worker is accepted by the others.
+ */
+static SSL_CTX *ctx = NULL;
+
+
+static ssize_t
+map_ssl_error(struct tls *tls, int ret)
+{
+    switch (SSL_get_error(tls->ssl, ret)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        break;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    default:
+        ERR_clear_error();
+        errno = EIO;
+        break;
+    }
+
+    return -1;
+}
+
+
+void
+init_tls(const char *cert_file, const char *key_file)
+{
+    if (!(ctx = SSL_CTX_new(TLS_server_method()))) {
+        errx(1, "SSL_CTX_new()");
+    }
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                          SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                          SSL_MODE_RELEASE_BUFFERS);
+
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(ctx,
+                                   (const unsigned char *)TLS_SESSION_ID_CONTEXT,
+                                   sizeof(TLS_SESSION_ID_CONTEXT) - 1);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1) {
+        errx(1, "can't load certificate `%s'", cert_file);
+    }
+
+    if (SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1) {
+        errx(1, "can't load private key `%s'", key_file);
+    }
+
+    if (SSL_CTX_check_private_key(ctx) != 1) {
+        errx(1, "private key `%s' does not match certificate", key_file);
+    }
+}
+
+
+struct tls *
+tls_new(int fd)
+{
+    struct tls *tls;
+
+    tls = xmalloc(sizeof(struct tls));
+    tls->fd = fd;
+    tls->ktls_send = 0;
+
+    if (!(tls->ssl = SSL_new(ctx))) {
+        free(tls);
+        return NULL;
+    }
+
+    SSL_set_fd(tls->ssl, fd);
+    SSL_set_accept_state(tls->ssl);
+
+    return tls;
+}
+
+
+void
+tls_free(struct tls *tls)
+{
+    if (!tls) {
+        return;
+    }
+
+    SSL_shutdown(tls->ssl);
+    SSL_free(tls->ssl);
+    ERR_clear_error();
+    free(tls);
+}
+
+
+enum io_step_status
+tls_handshake(struct tls *tls)
+{
+    int ret;
+
+    ret = SSL_do_handshake(tls->ssl);
+    if (ret != 1) {
+        return (map_ssl_error(tls, ret) < 0 && errno == EAGAIN) ?
+            IO_AGAIN : IO_ERROR;
+    }
+
+    /* With SSL_OP_ENABLE_KTLS OpenSSL attaches the "tls" ULP to the socket
+     * and hands it the session keys once the handshake is done. When the
+     * kernel accepted them, plain send() and sendfile() on the socket
+     * produce TLS records, so responses keep the zero-copy path.
+     */
+    tls->ktls_send = BIO_get_ktls_send(SSL_get_wbio(tls->ssl));
+
+    return IO_OK;
+}
+
+
+static ssize_t
+tls_read(struct connection *conn, void *buf, size_t size)
+{
+    int ret;
+    struct tls *tls = conn->tls;
+
+    /* reads always go through OpenSSL, it deals with kTLS control records */
+    ret = SSL_read(tls->ssl, buf, size);
+    if (ret <= 0) {
+        return map_ssl_error(tls, ret);
+    }
+
+    return ret;
+}
+
+
+static ssize_t
+tls_send(struct connection *conn, const void *buf, size_t size, int flags)
+{
+    int ret;
+    struct tls *tls = conn->tls;
+
+    if (tls->ktls_send) {
+        return send(tls->fd, buf, size, flags);
+    }
+
+    ret = SSL_write(tls->ssl, buf, size);
+    if (ret <= 0) {
+        return map_ssl_error(tls, ret);
+    }
+
+    return ret;
+}
+
+
+static ssize_t
+tls_sendfile(struct connection *conn, int in_fd, off_t *offset, size_t size)
+{
+    int ret;
+    ssize_t read_size;
+    char buf[TLS_SENDFILE_BUF_SIZE];
+    struct tls *tls = conn->tls;
+
+    if (tls->ktls_send) {
+        return sendfile(tls->fd, in_fd, offset, size);
+    }
+
+    /* userspace fallback, the same bytes are re-read on a retried write */
+    read_size = pread(in_fd, buf, MIN(size, sizeof(buf)), *offset);
+    if (read_size <= 0) {
+        if (!read_size) {
+            errno = EIO;
+        }
+        return -1;
+    }
+
+    ret = SSL_write(tls->ssl, buf, read_size);
+    if (ret <= 0) {
+        return map_ssl_error(tls, ret);
+    }
+
+    *offset += ret;
+
+    return ret;
+}
+
+
+/* records are built in userspace, nothing to splice */
+static ssize_t
+tls_splice(struct connection *conn UNUSED, int pipe_fd UNUSED, size_t size UNUSED)
+{
+    errno = EINVAL;
+    return -1;
+}
+
+
+const struct transport tls_transport = {
+    .read = tls_read,
+    .send = tls_send,
+    .sendfile = tls_sendfile,
+    .splice = tls_splice,
+};
+
+#endif
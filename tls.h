@@ -0,0 +1,31 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <sys/types.h>
+
+#include "io.h"
+
+
+#ifdef USE_TLS
+
+void init_tls(const char *cert_file, const char *key_file);
+struct tls *tls_new(int fd);
+void tls_free(struct tls *tls);
+
+enum io_step_status tls_handshake(struct tls *tls);
+
+extern const struct transport tls_transport;
+
+#else
+
+static inline struct tls *tls_new(int fd) { (void)fd; return NULL; }
+static inline void tls_free(struct tls *tls) { (void)tls; }
+static inline enum io_step_status tls_handshake(struct tls *tls)
+{ (void)tls; return IO_ERROR; }
+
+/* never picked, TLS listeners are refused without TLS support */
+#define tls_transport socket_transport
+
+#endif
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+
+/* USDT probes in the format of sys/sdt.h, so bpftrace and perf find them
+ * as usdt:rockepoll:name without systemtap's headers. A probe is a nop and
+ * an ELF note with its address and where its arguments are. Arguments are
+ * passed as 64 bit integers, strings as pointers. Built with USE_TRACE
+ * on x86_64 and aarch64, empty otherwise.
+ */
+
+#if defined(USE_TRACE) && (defined(__x86_64__) || defined(__aarch64__))
+
+#ifdef __x86_64__
+#define TRACE_ARG(x) "nor"((int64_t)(intptr_t)(x))
+#else
+#define TRACE_ARG(x) "r"((int64_t)(intptr_t)(x))
+#endif
+
+#define TRACE_NOTE(name, args)                                                \
+    "990: nop\n"                                                              \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n"                             \
+    ".balign 4\n"                                                             \
+    ".4byte 992f-991f, 994f-993f, 3\n"                                        \
+    "991: .asciz \"stapsdt\"\n"                                               \
+    "992: .balign 4\n"                                                        \
+    "993: .8byte 990b\n"                                                      \
+    ".8byte _.stapsdt.base\n"                                                 \
+    ".8byte 0\n"                                                              \
+    ".asciz \"rockepoll\"\n"                                                  \
+    ".asciz \"" #name "\"\n"                                                  \
+    ".asciz \"" args "\"\n"                                                   \
+    "994: .balign 4\n"                                                        \
+    ".popsection\n"                                                           \
+    ".ifndef _.stapsdt.base\n"                                                \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"   \
+    ".weak _.stapsdt.base\n"                                                  \
+    ".hidden _.stapsdt.base\n"                                                \
+    "_.stapsdt.base: .space 1\n"                                              \
+    ".size _.stapsdt.base, 1\n"                                               \
+    ".popsection\n"                                                           \
+    ".endif\n"
+
+#define TRACE1(name, a)                                                       \
+    __asm__ __volatile__(TRACE_NOTE(name, "-8@%0") :: TRACE_ARG(a))
+#define TRACE2(name, a, b)                                                    \
+    __asm__ __volatile__(TRACE_NOTE(name, "-8@%0 -8@%1")                      \
+                         :: TRACE_ARG(a), TRACE_ARG(b))
+#define TRACE3(name, a, b, c)                                                 \
+    __asm__ __volatile__(TRACE_NOTE(name, "-8@%0 -8@%1 -8@%2")                \
+                         :: TRACE_ARG(a), TRACE_ARG(b), TRACE_ARG(c))
+#define TRACE4(name, a, b, c, d)                                              \
+    __asm__ __volatile__(TRACE_NOTE(name, "-8@%0 -8@%1 -8@%2 -8@%3")          \
+                         :: TRACE_ARG(a), TRACE_ARG(b), TRACE_ARG(c),         \
+                            TRACE_ARG(d))
+
+#else
+
+/* arguments are still used, what is computed only for a probe is dropped */
+#define TRACE1(name, a)             ((void)(a))
+#define TRACE2(name, a, b)          ((void)(a), (void)(b))
+#define TRACE3(name, a, b, c)       ((void)(a), (void)(b), (void)(c))
+#define TRACE4(name, a, b, c, d)    ((void)(a), (void)(b), (void)(c), (void)(d))
+
+#endif
+
+#endif
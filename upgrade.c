@@ -0,0 +1,508 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <err.h>
+
+#include "upgrade.h"
+#include "listen.h"
+#include "handler.h"
+#include "vhost.h"
+#include "utils.h"
+#include "config.h"
+
+
+/* A process started with --upgrade path listens on a Unix socket there.
+ * The next one started with the same path connects to it first and gets
+ * the listening sockets over SCM_RIGHTS, then the hottest paths. It warms
+ * them up, starts its workers and says it is ready. Then the old process
+ * stops accepting, lets its connections finish until UPGRADE_DRAIN_TIMEOUT
+ * and exits. If the new process dies before it is ready, nothing changes
+ * for the old one: the new socket is bound next to path and only renamed
+ * over it once the new process is ready.
+ *
+ * Hot paths are sampled from the static files served, HOT_PATH_SLOTS
+ * slots each keep the path that outlasted the others hashed to it.
+ */
+
+#define HOT_HOST_SIZE   128
+#define HOT_TARGET_SIZE 256
+#define UPGRADE_CHUNK   8192
+#define UPGRADE_READY   'R'
+
+
+enum upgrade_msg_type {U_LISTENER, U_HOT, U_END};
+
+
+struct upgrade_msg {
+    enum upgrade_msg_type type;
+    int count;
+    char name[sizeof(listen_specs->name)];
+};
+
+
+struct hot_path {
+    uint32_t hash;
+    long hits;
+    char host[HOT_HOST_SIZE];
+    char target[HOT_TARGET_SIZE];
+};
+
+
+static const char *control_path = NULL;
+static int control_fd = -1, previous_fd = -1, wake_fd = -1, control_dir_fd = -1;
+/* names in control_dir_fd, the directory of control_path */
+static char control_name[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static char temp_name[sizeof(control_name) + 16];
+static int draining = 0;
+
+static pthread_mutex_t hot_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hot_path hot[HOT_PATH_SLOTS];
+static __thread unsigned long sampled = 0;
+
+/* what the previous process sent, host and target pairs */
+static char *warm = NULL;
+static size_t warm_size = 0;
+
+
+static uint32_t
+hash_path(const char *host, const char *target)
+{
+    return hash_string(hash_bytes(hash_string(HASH_INIT, host), "/", 1), target);
+}
+
+
+void
+upgrade_touch(const char *host, const char *target)
+{
+    uint32_t hash;
+    struct hot_path *p;
+
+    if (!control_path || ++sampled % HOT_PATH_SAMPLE) {
+        return;
+    }
+
+    host = host ? host : "";
+    if (strlen(host) >= HOT_HOST_SIZE || strlen(target) >= HOT_TARGET_SIZE) {
+        return;
+    }
+
+    hash = hash_path(host, target);
+    p = &hot[hash & (HOT_PATH_SLOTS - 1)];
+
+    pthread_mutex_lock(&hot_lock);
+    if (p->hits && p->hash == hash &&
+        !strcmp(p->host, host) && !strcmp(p->target, target))
+    {
+        p->hits++;
+    } else if (p->hits) {
+        p->hits--;
+    } else {
+        p->hash = hash;
+        p->hits = 1;
+        strcpy(p->host, host);
+        strcpy(p->target, target);
+    }
+    pthread_mutex_unlock(&hot_lock);
+}
+
+
+static int
+compare_hits(const void *a, const void *b)
+{
+    long x = ((const struct hot_path *)a)->hits;
+    long y = ((const struct hot_path *)b)->hits;
+
+    return (x < y) - (x > y);
+}
+
+
+static int
+send_msg(int fd, const struct upgrade_msg *msg, const char *data, size_t size,
+         const int *fds, int fds_count)
+{
+    char control[CMSG_SPACE(sizeof(int) * LISTEN_MAX_FDS)];
+    struct iovec iov[2] = {
+        {(void *)msg, sizeof(*msg)},
+        {(void *)data, size},
+    };
+    struct msghdr mh = {0};
+    struct cmsghdr *cmsg;
+
+    mh.msg_iov = iov;
+    mh.msg_iovlen = size ? 2 : 1;
+
+    if (fds_count) {
+        mh.msg_control = control;
+        mh.msg_controllen = CMSG_SPACE(sizeof(int) * fds_count);
+        cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds_count);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fds_count);
+    }
+
+    if (sendmsg(fd, &mh, MSG_NOSIGNAL) < 0) {
+        warn("sendmsg(), upgrade");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* the listeners first, then the hottest paths in chunks */
+static int
+hand_over(int fd)
+{
+    int i, n, fds[LISTEN_MAX_FDS];
+    size_t size = 0, len;
+    char *chunk;
+    struct hot_path *paths;
+    struct upgrade_msg msg = {0};
+
+    for (i = 0; i < listen_specs_count; i++) {
+        n = listen_fds(&listen_specs[i], fds);
+        msg.type = U_LISTENER;
+        msg.count = n;
+        memcpy(msg.name, listen_specs[i].name, sizeof(msg.name));
+        if (send_msg(fd, &msg, NULL, 0, fds, n)) {
+            return -1;
+        }
+    }
+
+    paths = xmalloc(sizeof(hot));
+    chunk = xmalloc(UPGRADE_CHUNK);
+    pthread_mutex_lock(&hot_lock);
+    memcpy(paths, hot, sizeof(hot));
+    pthread_mutex_unlock(&hot_lock);
+    qsort(paths, HOT_PATH_SLOTS, sizeof(struct hot_path), compare_hits);
+
+    msg.type = U_HOT;
+    msg.count = 0;
+    for (i = 0; i < HOT_PATH_SLOTS && i < HOT_PATH_SNAPSHOT && paths[i].hits; i++) {
+        len = strlen(paths[i].host) + strlen(paths[i].target) + 2;
+        if (size + len > UPGRADE_CHUNK) {
+            if (send_msg(fd, &msg, chunk, size, NULL, 0)) {
+                goto fail;
+            }
+            size = 0;
+            msg.count = 0;
+        }
+        size += sprintf(chunk + size, "%s", paths[i].host) + 1;
+        size += sprintf(chunk + size, "%s", paths[i].target) + 1;
+        msg.count++;
+    }
+    if (size && send_msg(fd, &msg, chunk, size, NULL, 0)) {
+        goto fail;
+    }
+
+    free(paths);
+    free(chunk);
+
+    msg.type = U_END;
+    msg.count = 0;
+    return send_msg(fd, &msg, NULL, 0, NULL, 0);
+
+fail:
+    free(paths);
+    free(chunk);
+    return -1;
+}
+
+
+/* the new process has its workers running once it says so */
+static int
+wait_ready(int fd)
+{
+    char c;
+    struct timeval tv = {UPGRADE_READY_TIMEOUT, 0};
+
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+        warn("setsockopt(), SOL_SOCKET, SO_RCVTIMEO");
+    }
+
+    return read(fd, &c, 1) == 1 && c == UPGRADE_READY;
+}
+
+
+static void *
+run_control(void *arg UNUSED)
+{
+    int fd;
+    uint64_t one = 1;
+
+    for (;;) {
+        if ((fd = accept4(control_fd, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+            if (errno != EINTR) {
+                warn("accept4(), upgrade");
+            }
+            continue;
+        }
+
+        if (!hand_over(fd) && wait_ready(fd)) {
+            close(fd);
+            break;
+        }
+
+        /* the new process went away, this one carries on */
+        warnx("upgrade did not complete");
+        close(fd);
+    }
+
+    /* the socket file belongs to the new process now */
+    close(control_fd);
+    __atomic_store_n(&draining, 1, __ATOMIC_RELAXED);
+    if (write(wake_fd, &one, sizeof(one)) < 0) {
+        warn("write(), eventfd");
+    }
+
+    return NULL;
+}
+
+
+static void
+receive_state(int fd)
+{
+    int n, *fds;
+    ssize_t len;
+    char data[UPGRADE_CHUNK];
+    char control[CMSG_SPACE(sizeof(int) * LISTEN_MAX_FDS)];
+    struct upgrade_msg msg;
+    struct iovec iov[2] = {
+        {&msg, sizeof(msg)},
+        {data, sizeof(data)},
+    };
+    struct msghdr mh = {0};
+    struct cmsghdr *cmsg;
+
+    for (;;) {
+        mh.msg_iov = iov;
+        mh.msg_iovlen = 2;
+        mh.msg_control = control;
+        mh.msg_controllen = sizeof(control);
+
+        if ((len = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC)) < 0) {
+            err(1, "recvmsg(), upgrade");
+        }
+        if ((size_t)len < sizeof(msg)) {
+            errx(1, "the running process went away during the upgrade");
+        }
+        len -= sizeof(msg);
+
+        switch (msg.type) {
+        case U_LISTENER:
+            cmsg = CMSG_FIRSTHDR(&mh);
+            n = 0;
+            fds = NULL;
+            if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+                cmsg->cmsg_type == SCM_RIGHTS)
+            {
+                n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                fds = (int *)CMSG_DATA(cmsg);
+            }
+            msg.name[sizeof(msg.name) - 1] = '\0';
+            if (n != msg.count) {
+                errx(1, "got %d of %d sockets for `%s'", n, msg.count, msg.name);
+            }
+            if (listen_inherit(msg.name, fds, n)) {
+                warnx("`%s' is not listened on any more", msg.name);
+            }
+            break;
+        case U_HOT:
+            warm = realloc(warm, warm_size + len);
+            if (!warm) {
+                err(1, "realloc()");
+            }
+            memcpy(warm + warm_size, data, len);
+            warm_size += len;
+            break;
+        case U_END:
+            return;
+        }
+    }
+}
+
+
+/* Binds path.pid, path itself still leads to the previous process. The
+ * directory is kept open for the rename, which may come after a chroot.
+ */
+static void
+bind_control(void)
+{
+    const char *slash = strrchr(control_path, '/');
+    char dir[sizeof(control_name)];
+    struct sockaddr_un addr = {0};
+
+    if ((size_t)snprintf(addr.sun_path, sizeof(addr.sun_path), "%s.%d",
+                         control_path, (int)getpid()) >= sizeof(addr.sun_path))
+    {
+        errx(1, "socket path too long `%s'", control_path);
+    }
+    addr.sun_family = AF_UNIX;
+
+    if (!slash) {
+        strcpy(dir, ".");
+    } else if (slash == control_path) {
+        strcpy(dir, "/");
+    } else {
+        sprintf(dir, "%.*s", (int)(slash - control_path), control_path);
+    }
+    strcpy(control_name, slash ? slash + 1 : control_path);
+    sprintf(temp_name, "%s.%d", control_name, (int)getpid());
+
+    if ((control_dir_fd = open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        err(1, "open(), `%s'", dir);
+    }
+    if ((control_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0) {
+        err(1, "socket(), upgrade");
+    }
+    unlink(addr.sun_path);
+    if (bind(control_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        err(1, "bind(), `%s'", addr.sun_path);
+    }
+    if (chmod(addr.sun_path, 0600) < 0) {
+        err(1, "chmod(), `%s'", addr.sun_path);
+    }
+    if (listen(control_fd, 1) < 0) {
+        err(1, "listen(), `%s'", addr.sun_path);
+    }
+}
+
+
+/* Runs before the listeners are opened and before a chroot. A process
+ * that answers on path hands its state over, nobody there is a fresh start.
+ */
+void
+init_upgrade(const char *path)
+{
+    struct sockaddr_un addr = {0};
+
+    if (!path) {
+        return;
+    }
+    control_path = path;
+
+    if ((wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        err(1, "eventfd()");
+    }
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errx(1, "socket path too long `%s'", path);
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if ((previous_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0) {
+        err(1, "socket(), upgrade");
+    }
+    if (connect(previous_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (errno != ENOENT && errno != ECONNREFUSED) {
+            err(1, "connect(), `%s'", path);
+        }
+        close(previous_fd);
+        previous_fd = -1;
+    } else {
+        receive_state(previous_fd);
+        printf("took over from the process on %s.\n", path);
+    }
+
+    bind_control();
+}
+
+
+/* Looks up the hot paths of the previous process and reads the start of
+ * the files ahead, with the root and vhosts set up and before any worker
+ */
+void
+upgrade_prewarm(void)
+{
+    int count = 0, warmed = 0;
+    char *host, *target, *end = warm + warm_size;
+    struct file_meta file;
+
+    for (host = warm; host < end; host = target + strlen(target) + 1) {
+        target = host + strlen(host) + 1;
+        count++;
+
+        if (gather_file_meta(vhost_lookup(*host ? host : NULL), target, &file, 0)
+            != F_EXISTS)
+        {
+            continue;
+        }
+        if (!file.data &&
+            readahead(file.fd, file.offset, MIN(file.size, HOT_PATH_READAHEAD)) < 0)
+        {
+            warn("readahead(), `%s'", target);
+        }
+        release_file(&file);
+        warmed++;
+    }
+
+    if (count) {
+        printf("warmed up %d of %d hot files.\n", warmed, count);
+    }
+
+    free(warm);
+    warm = NULL;
+    warm_size = 0;
+}
+
+
+/* The workers run, the previous process may stop accepting */
+void
+upgrade_started(void)
+{
+    char c = UPGRADE_READY;
+    pthread_t tid;
+
+    if (!control_path) {
+        return;
+    }
+
+    if (previous_fd >= 0) {
+        if (write(previous_fd, &c, 1) != 1) {
+            warn("write(), upgrade");
+        }
+        close(previous_fd);
+        previous_fd = -1;
+    }
+
+    /* from here on the next process finds this one */
+    if (renameat(control_dir_fd, temp_name, control_dir_fd, control_name) < 0) {
+        warn("rename(), `%s'", control_path);
+    }
+    close(control_dir_fd);
+    control_dir_fd = -1;
+
+    if ((errno = pthread_create(&tid, NULL, run_control, NULL))) {
+        err(1, "pthread_create()");
+    }
+    pthread_detach(tid);
+}
+
+
+/* returns the eventfd that wakes the worker for the drain, -1 without
+ * --upgrade
+ */
+int
+init_upgrade_worker(void)
+{
+    return wake_fd;
+}
+
+
+int
+upgrade_draining(void)
+{
+    return __atomic_load_n(&draining, __ATOMIC_RELAXED);
+}
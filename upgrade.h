@@ -0,0 +1,13 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+
+void init_upgrade(const char *path);
+void upgrade_prewarm(void);
+void upgrade_started(void);
+int init_upgrade_worker(void);
+int upgrade_draining(void);
+
+void upgrade_touch(const char *host, const char *target);
+
+#endif
@@ -0,0 +1,455 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "upload.h"
+#include "chunked.h"
+#include "resolve.h"
+#include "vhost.h"
+#include "arena.h"
+#include "stats.h"
+#include "utils.h"
+#include "config.h"
+
+
+#define UPLOAD_PIPE_CHUNK (1024 * 64)
+#define UPLOAD_FRAME_READ 64
+#define UPLOAD_NAME_SIZE  64
+
+#define CONTINUE_RESPONSE "HTTP/1.1 100 Continue\r\n\r\n"
+
+
+/* A PUT or POST body on its way into a temporary file next to where it
+ * goes, the file is renamed into place once the body is complete.
+ */
+struct upload {
+    int fd, dirfd, chunked, renamed, post;
+    int pipe[2];
+    enum http_status status;
+
+    /* body bytes left with Content-Length, and written so far */
+    size_t left, size;
+    struct chunked chunk;
+
+    /* bytes that went through userspace: those read along with the head,
+     * chunk framing and everything from TLS connections
+     */
+    char *buf;
+    size_t buf_size, buf_offset;
+
+    char tmp_name[UPLOAD_NAME_SIZE];
+    char *name;
+    char *location;
+
+    struct http_request req;
+};
+
+
+static int uploads_enabled = 0;
+static size_t max_upload_size = 0;
+static unsigned upload_seq = 0;
+
+
+void
+init_upload(int enabled, size_t max_size)
+{
+    uploads_enabled = enabled;
+    max_upload_size = max_size;
+}
+
+
+int
+upload_enabled(void)
+{
+    return uploads_enabled;
+}
+
+
+static char *
+arena_strdup(struct connection *conn, const char *s)
+{
+    size_t size = strlen(s) + 1;
+
+    return memcpy(arena_alloc(&conn->arena, size), s, size);
+}
+
+
+static int
+body_done(const struct upload *u)
+{
+    return u->chunked ? u->chunk.state == CH_DONE : !u->left;
+}
+
+
+/* how many of the next bytes are body data */
+static size_t
+data_left(const struct upload *u)
+{
+    return u->chunked ? u->chunk.left : u->left;
+}
+
+
+/* the body can't go on, the rest of it is never read so the connection
+ * is closed after the answer
+ */
+static enum io_step_status
+upload_failed(struct connection *conn, struct upload *u, enum http_status st)
+{
+    u->status = st;
+    conn->keep_alive = 0;
+
+    return IO_OK;
+}
+
+
+static int
+consume(struct upload *u, size_t size)
+{
+    if (u->chunked) {
+        chunked_data(&u->chunk, size);
+    } else {
+        u->left -= size;
+    }
+
+    u->size += size;
+    stats_add(ST_UPLOAD_BYTES, size);
+
+    return u->size <= max_upload_size;
+}
+
+
+static int
+write_all(int fd, const char *data, size_t size)
+{
+    ssize_t len;
+
+    while (size) {
+        if ((len = write(fd, data, size)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += len;
+        size -= len;
+    }
+
+    return 0;
+}
+
+
+/* the pipe is emptied into the file right away, it never holds more
+ * than one splice from the socket
+ */
+static int
+drain_pipe(struct upload *u, size_t size)
+{
+    ssize_t len;
+
+    while (size) {
+        if ((len = splice(u->pipe[0], NULL, u->fd, NULL, size, SPLICE_F_MOVE)) < 1) {
+            return -1;
+        }
+        size -= len;
+    }
+
+    return 0;
+}
+
+
+enum io_step_status
+make_upload_step(struct connection *conn, struct upload *u)
+{
+    ssize_t len;
+    size_t n;
+    char *p;
+
+    for (;;) {
+        while (u->buf_offset < u->buf_size && !body_done(u)) {
+            p = u->buf + u->buf_offset;
+            n = u->buf_size - u->buf_offset;
+
+            if (u->chunked && u->chunk.state != CH_DATA) {
+                u->buf_offset += chunked_frame(&u->chunk, p, n);
+                if (u->chunk.state == CH_ERROR) {
+                    return upload_failed(conn, u, S_BAD_REQUEST);
+                }
+                continue;
+            }
+
+            n = MIN(n, data_left(u));
+            if (write_all(u->fd, p, n) < 0) {
+                return upload_failed(conn, u, S_INTERNAL_ERROR);
+            }
+            u->buf_offset += n;
+            if (!consume(u, n)) {
+                return upload_failed(conn, u, S_REQUEST_TOO_LARGE);
+            }
+        }
+
+        if (body_done(u)) {
+            /* the start of a pipelined request got read with the framing */
+            if (u->buf_offset < u->buf_size) {
+                conn->keep_alive = 0;
+            }
+            return IO_OK;
+        }
+
+        if (conn->budget <= 0) {
+            return IO_YIELD;
+        }
+
+        if (conn->tls || (u->chunked && u->chunk.state != CH_DATA)) {
+            n = (u->chunked && u->chunk.state != CH_DATA)
+                ? UPLOAD_FRAME_READ : MIN(data_left(u), MAX_REQ_SIZE);
+            if ((len = conn_read(conn, u->buf, n)) > 0) {
+                u->buf_size = len;
+                u->buf_offset = 0;
+                continue;
+            }
+        } else {
+            /* socket to file through the pipe, no copies */
+            len = splice(conn->fd, NULL, u->pipe[1], NULL,
+                         MIN(data_left(u), UPLOAD_PIPE_CHUNK),
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (len > 0) {
+                conn->budget -= len;
+                if (drain_pipe(u, len) < 0) {
+                    return upload_failed(conn, u, S_INTERNAL_ERROR);
+                }
+                if (!consume(u, len)) {
+                    return upload_failed(conn, u, S_REQUEST_TOO_LARGE);
+                }
+                continue;
+            }
+        }
+
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return IO_AGAIN;
+        }
+        return IO_ERROR;
+    }
+}
+
+
+/* Transfer-Encoding of a request has to end in chunked. Only chunked
+ * alone is taken, any other coding would have to be undone before the
+ * body is stored.
+ */
+static enum http_status
+check_codings(const char *value)
+{
+    const char *p, *last, *end = value + strlen(value);
+
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t')) {
+        end--;
+    }
+    for (last = end; last > value && last[-1] != ','; last--) ;
+    while (last < end && (*last == ' ' || *last == '\t')) {
+        last++;
+    }
+
+    if (end - last != sizeof("chunked") - 1 ||
+        strncasecmp(last, "chunked", sizeof("chunked") - 1))
+    {
+        return S_BAD_REQUEST;
+    }
+
+    for (p = value; p < last; p++) {
+        if (*p != ' ' && *p != '\t' && *p != ',') {
+            return S_NOT_IMPLEMENTED;
+        }
+    }
+
+    return S_OK;
+}
+
+
+/* A PUT names the file, a POST names an existing directory the file is
+ * created in. Either way the body is taken as it is.
+ */
+enum http_status
+upload_request(struct connection *conn, const struct read_meta *in,
+               struct http_request *req, struct upload **upload)
+{
+    struct upload *u;
+    char *end, *slash, *dir;
+    const char *head_end;
+    size_t extra, body_size = 0;
+    enum http_status st;
+    unsigned seq;
+    int keep_alive = conn->keep_alive;
+
+    /* everything that goes wrong here leaves the body unread */
+    conn->keep_alive = 0;
+
+    if (req->headers[H_TRANSFER_ENCODING]) {
+        if ((st = check_codings(req->headers[H_TRANSFER_ENCODING])) != S_OK) {
+            return st;
+        }
+    } else if (req->headers[H_CONTENT_LENGTH]) {
+        body_size = strtoull(req->headers[H_CONTENT_LENGTH], &end, 10);
+        if (end == req->headers[H_CONTENT_LENGTH] || *end) {
+            return S_BAD_REQUEST;
+        }
+        if (body_size > max_upload_size) {
+            return S_REQUEST_TOO_LARGE;
+        }
+    } else {
+        return S_LENGTH_REQUIRED;
+    }
+
+    u = arena_alloc(&conn->arena, sizeof(struct upload));
+    memset(u, 0, sizeof(struct upload));
+    u->fd = u->dirfd = u->pipe[0] = u->pipe[1] = -1;
+    u->status = S_CREATED;
+    u->post = req->method == M_POST;
+    u->chunked = req->headers[H_TRANSFER_ENCODING] != NULL;
+    u->left = body_size;
+
+    /* POST goes into the target, PUT next to it */
+    dir = arena_strdup(conn, *req->target ? req->target : ".");
+    if (u->post) {
+        u->name = arena_alloc(&conn->arena, UPLOAD_NAME_SIZE);
+        if ((slash = strrchr(dir, '/')) && !slash[1] && slash != dir) {
+            *slash = '\0';
+        }
+    } else if ((slash = strrchr(dir, '/'))) {
+        *slash = '\0';
+        u->name = slash + 1;
+    } else {
+        u->name = dir;
+        dir = ".";
+    }
+
+    if (!u->post && (!*u->name || !strcmp(u->name, "."))) {
+        return S_METHOD_NOT_ALLOWED;
+    }
+
+    u->dirfd = open_target(req->host->root_fd, dir, O_PATH | O_DIRECTORY, 0);
+    if (u->dirfd < 0) {
+        cleanup_upload(u);
+        return (errno == ENOENT || errno == ENOTDIR) ? S_NOT_FOUND : S_FORBIDDEN;
+    }
+
+    seq = __atomic_add_fetch(&upload_seq, 1, __ATOMIC_RELAXED);
+    snprintf(u->tmp_name, sizeof(u->tmp_name), ".upload-%d-%u", getpid(), seq);
+    if (u->post) {
+        snprintf(u->name, UPLOAD_NAME_SIZE, "%ld-%u", (long)time(NULL), seq);
+        u->location = arena_alloc(&conn->arena, strlen(dir) + UPLOAD_NAME_SIZE + 2);
+        if (strcmp(dir, ".")) {
+            sprintf(u->location, "/%s/%s", dir, u->name);
+        } else {
+            sprintf(u->location, "/%s", u->name);
+        }
+    }
+
+    u->fd = openat(u->dirfd, u->tmp_name,
+                   O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, UPLOAD_FILE_MODE);
+    if (u->fd < 0 ||
+        (!conn->tls && pipe2(u->pipe, O_NONBLOCK | O_CLOEXEC) < 0))
+    {
+        cleanup_upload(u);
+        return S_INTERNAL_ERROR;
+    }
+
+    /* body bytes that came along with the head */
+    head_end = (char *)memmem(in->data, in->size, "\n\r\n", 3) + 3;
+    extra = in->size - (head_end - in->data);
+    if (!u->chunked && extra > body_size) {
+        /* the start of a pipelined request is dropped with the rest */
+        extra = body_size;
+        keep_alive = 0;
+    }
+    u->buf = arena_alloc(&conn->arena, MAX_REQ_SIZE);
+    memcpy(u->buf, head_end, extra);
+    u->buf_size = extra;
+
+    if (!extra && req->headers[H_EXPECT] &&
+        !strcasecmp(req->headers[H_EXPECT], "100-continue"))
+    {
+        setup_write_io_step(conn,
+                            arena_strdup(conn, CONTINUE_RESPONSE), 0,
+                            sizeof(CONTINUE_RESPONSE) - 1, NULL);
+    }
+
+    u->req.method = req->method;
+    u->req.version = req->version;
+    u->req.target = arena_strdup(conn, req->target);
+    if (req->headers[H_USER_AGENT]) {
+        u->req.headers[H_USER_AGENT] = arena_strdup(conn, req->headers[H_USER_AGENT]);
+    }
+
+    conn->keep_alive = keep_alive;
+    stats_inc(ST_UPLOADS);
+    *upload = u;
+
+    return S_OK;
+}
+
+
+/* Moves the complete file into place. A PUT replaces what was there, a
+ * POST never does.
+ */
+enum http_status
+upload_finish(struct upload *u, const char **location)
+{
+    int replaced = 0;
+
+    *location = NULL;
+    if (u->status != S_CREATED) {
+        return u->status;
+    }
+
+    if (close(u->fd) < 0) {
+        u->fd = -1;
+        return S_INTERNAL_ERROR;
+    }
+    u->fd = -1;
+
+    if (u->post) {
+        if (renameat2(u->dirfd, u->tmp_name, u->dirfd, u->name, RENAME_NOREPLACE) < 0) {
+            return S_INTERNAL_ERROR;
+        }
+        *location = u->location;
+    } else {
+        replaced = !faccessat(u->dirfd, u->name, F_OK, AT_SYMLINK_NOFOLLOW);
+        if (renameat(u->dirfd, u->tmp_name, u->dirfd, u->name) < 0) {
+            return errno == EISDIR ? S_METHOD_NOT_ALLOWED : S_INTERNAL_ERROR;
+        }
+    }
+    u->renamed = 1;
+
+    return replaced ? S_OK : S_CREATED;
+}
+
+
+const struct http_request *
+upload_req(const struct upload *u)
+{
+    return &u->req;
+}
+
+
+void
+cleanup_upload(struct upload *u)
+{
+    if (u->pipe[0] >= 0) {
+        close(u->pipe[0]);
+        close(u->pipe[1]);
+    }
+    if (u->fd >= 0) {
+        close(u->fd);
+    }
+    if (u->dirfd >= 0) {
+        if (!u->renamed && *u->tmp_name) {
+            unlinkat(u->dirfd, u->tmp_name, 0);
+        }
+        close(u->dirfd);
+    }
+}
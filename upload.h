@@ -0,0 +1,24 @@
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include "io.h"
+#include "parser.h"
+#include "handler.h"
+
+
+struct upload;
+
+
+void init_upload(int enabled, size_t max_size);
+int upload_enabled(void);
+
+enum http_status upload_request(struct connection *conn,
+                                const struct read_meta *in,
+                                struct http_request *req,
+                                struct upload **upload);
+enum io_step_status make_upload_step(struct connection *conn, struct upload *u);
+enum http_status upload_finish(struct upload *u, const char **location);
+const struct http_request *upload_req(const struct upload *u);
+void cleanup_upload(struct upload *u);
+
+#endif
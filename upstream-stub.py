@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+"""Upstream for trying --proxy routes by hand.
+
+    ./upstream-stub.py 9000            # TCP on 127.0.0.1:9000
+    ./upstream-stub.py unix:/tmp/up    # Unix socket
+    ./rockepoll www --keep-alive --proxy /api/=127.0.0.1:9000
+
+Answers keep-alive HTTP/1.1 and picks a behaviour by the last path segment:
+    .../echo      the request body back, Content-Length delimited
+    .../chunked   a chunked body in a few chunks
+    .../close     a body delimited by closing the connection
+    .../slow      the usual answer after a second
+    .../drop      closes the connection without an answer
+anything else gets the method, path, X-Forwarded-For and the number of
+requests served on this connection as JSON.
+"""
+
+import json
+import os
+import socketserver
+import sys
+import time
+from http.server import BaseHTTPRequestHandler, HTTPServer
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    served = 0
+
+    def log_message(self, format, *args):
+        pass
+
+    def answer(self):
+        self.served += 1
+        length = int(self.headers.get("Content-Length") or 0)
+        body = self.rfile.read(length) if length else b""
+        action = self.path.split("?")[0].rstrip("/").rsplit("/", 1)[-1]
+
+        if action == "drop":
+            self.close_connection = True
+            return
+        if action == "slow":
+            time.sleep(1)
+
+        if action == "echo":
+            self.send_response(200)
+            self.send_header("Content-Type", "application/octet-stream")
+            self.send_header("Content-Length", str(len(body)))
+            self.end_headers()
+            self.wfile.write(body)
+            return
+
+        if action == "chunked":
+            self.send_response(200)
+            self.send_header("Content-Type", "text/plain")
+            self.send_header("Transfer-Encoding", "chunked")
+            self.end_headers()
+            for i in range(5):
+                chunk = ("chunk %d\n" % i).encode() * (i + 1)
+                self.wfile.write(b"%x\r\n%s\r\n" % (len(chunk), chunk))
+            self.wfile.write(b"0\r\n\r\n")
+            return
+
+        out = json.dumps({
+            "method": self.command,
+            "path": self.path,
+            "forwarded_for": self.headers.get("X-Forwarded-For"),
+            "body_size": len(body),
+            "served": self.served,
+        }).encode() + b"\n"
+
+        self.send_response(200)
+        self.send_header("Content-Type", "application/json")
+        if action == "close":
+            self.send_header("Connection", "close")
+            self.close_connection = True
+        else:
+            self.send_header("Content-Length", str(len(out)))
+        self.end_headers()
+        if self.command != "HEAD":
+            self.wfile.write(out)
+
+    do_GET = do_HEAD = do_POST = do_PUT = do_DELETE = do_PATCH = answer
+
+
+class TCPServer(socketserver.ThreadingMixIn, HTTPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+
+
+class UnixServer(socketserver.ThreadingUnixStreamServer):
+    daemon_threads = True
+
+
+class UnixHandler(Handler):
+    # a Unix peer has no address, what BaseHTTPRequestHandler logs
+    def address_string(self):
+        return "unix"
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit("usage: %s port|unix:path" % sys.argv[0])
+
+    if sys.argv[1].startswith("unix:"):
+        path = sys.argv[1][len("unix:"):]
+        if os.path.exists(path):
+            os.unlink(path)
+        server = UnixServer(path, UnixHandler)
+    else:
+        server = TCPServer(("127.0.0.1", int(sys.argv[1])), Handler)
+
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
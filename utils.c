@@ -1,5 +1,4 @@
 #include <stdlib.h>
-#include <netinet/tcp.h>
 #include <string.h>
 #include <arpa/inet.h>
 #include <unistd.h>
@@ -20,6 +19,18 @@ xmalloc(const size_t size)
 }
 
 
+inline void *
+xrealloc(void *ptr, const size_t size)
+{
+    void *new_ptr = realloc(ptr, size);
+
+    if (!new_ptr) {
+        err(1, "realloc(), can't allocate %zu bytes", size);
+    }
+    return new_ptr;
+}
+
+
 inline void
 xchdir(const char *dir)
 {
@@ -38,33 +49,32 @@ xchroot(const char *dir)
 }
 
 
-int
-create_listen_socket(const char *listen_addr, int port)
+/* Peers are kept as IPv6 addresses, IPv4 ones v4-mapped. Unix socket
+ * peers have no address and get the unspecified one.
+ */
+void
+sockaddr_to_addr(const struct sockaddr *sa, struct in6_addr *addr)
 {
-    int    opt, listenfd;
-    struct sockaddr_in addr;
+    memset(addr, 0, sizeof(struct in6_addr));
 
-    if ((listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
-        err(1, "socket()");
+    if (sa->sa_family == AF_INET6) {
+        *addr = ((const struct sockaddr_in6 *)sa)->sin6_addr;
+    } else if (sa->sa_family == AF_INET) {
+        addr->s6_addr[10] = addr->s6_addr[11] = 0xff;
+        memcpy(&addr->s6_addr[12], &((const struct sockaddr_in *)sa)->sin_addr, 4);
     }
+}
 
-    opt = 1;
-    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
-        err(1, "setsockopt(), SOL_SOCKET, SO_REUSEPORT");
-    }
-
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    addr.sin_addr.s_addr = inet_addr(listen_addr);
-
-    if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        err(1, "bind(), `%d'", port);
-    }
 
-    if (listen(listenfd, -1) < 0) {
-        err(1, "listen()");
+/* buf has to hold ADDR_STR_SIZE bytes */
+const char *
+format_addr(const struct in6_addr *addr, char *buf)
+{
+    if (IN6_IS_ADDR_V4MAPPED(addr)) {
+        return inet_ntop(AF_INET, &addr->s6_addr[12], buf, ADDR_STR_SIZE);
+    } else if (IN6_IS_ADDR_UNSPECIFIED(addr)) {
+        return strcpy(buf, "unix");
     }
 
-    return listenfd;
+    return inet_ntop(AF_INET6, addr, buf, ADDR_STR_SIZE);
 }
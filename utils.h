@@ -2,15 +2,59 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
 
 #define ALWAYS_INLINE inline __attribute__((always_inline))
 #define MAX(x, y) (((x) > (y)) ? (x) : (y))
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#define STR(x) #x
+#define XSTR(x) STR(x)
+
+#define ADDR_STR_SIZE INET6_ADDRSTRLEN
+
+/* FNV-1a, a hash is started with HASH_INIT and may be fed in pieces */
+#define HASH_INIT 2166136261u
+
+#if defined(__GNUC__) || defined(__INTEL_COMPILER)
+# define UNUSED __attribute__((__unused__))
+#else
+# define UNUSED
+#endif
 
 
 void *xmalloc(const size_t size);
+void *xrealloc(void *ptr, const size_t size);
 void xchdir(const char *dir);
 void xchroot(const char *dir);
-int create_listen_socket(const char *listen_addr, int port);
+void sockaddr_to_addr(const struct sockaddr *sa, struct in6_addr *addr);
+const char *format_addr(const struct in6_addr *addr, char *buf);
+
+
+static inline uint32_t
+hash_bytes(uint32_t h, const void *data, size_t size)
+{
+    const unsigned char *p = data;
+
+    while (size--) {
+        h = (h ^ *p++) * 16777619u;
+    }
+
+    return h;
+}
+
+
+static inline uint32_t
+hash_string(uint32_t h, const char *s)
+{
+    for (; *s; s++) {
+        h = (h ^ (unsigned char)*s) * 16777619u;
+    }
+
+    return h;
+}
 
 #endif
\ No newline at end of file
@@ -0,0 +1,179 @@
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <err.h>
+
+#include "vhost.h"
+#include "utils.h"
+#include "config.h"
+
+
+/* Hosts are looked up by the Host header, lowercased and without its
+ * port. Every name of a host points to the same root fd, opened before a
+ * chroot; paths are resolved beneath it like beneath the main root.
+ */
+
+struct vhost_name {
+    const struct vhost *host;
+    size_t size;
+    struct vhost_name *next;
+    char name[];
+};
+
+
+static struct vhost default_host = {-1, INDEX_PAGE};
+static const struct vhost *fallback = &default_host;
+static struct vhost_name *names[VHOST_SLOTS];
+static int names_count = 0;
+
+
+/* the name part of a Host header: up to the port, IPv6 literals kept in
+ * their brackets, a trailing dot dropped
+ */
+static size_t
+host_size(const char *host)
+{
+    const char *end;
+
+    if (*host == '[') {
+        end = strchr(host, ']');
+        return end ? (size_t)(end - host + 1) : strlen(host);
+    }
+
+    end = strchr(host, ':');
+    end = end ? end : host + strlen(host);
+    if (end > host && end[-1] == '.') {
+        end--;
+    }
+
+    return end - host;
+}
+
+
+static uint32_t
+hash_host(const char *host, size_t size)
+{
+    uint32_t h = HASH_INIT;
+    unsigned char c;
+
+    /* names are case insensitive */
+    while (size--) {
+        c = tolower((unsigned char)*host++);
+        h = hash_bytes(h, &c, 1);
+    }
+
+    return h;
+}
+
+
+static void
+add_name(const struct vhost *host, const char *name, size_t size)
+{
+    struct vhost_name *n, **slot;
+
+    if (!size) {
+        errx(1, "empty virtual host name");
+    }
+
+    slot = &names[hash_host(name, size) & (VHOST_SLOTS - 1)];
+    for (n = *slot; n; n = n->next) {
+        if (n->size == size && !strncasecmp(n->name, name, size)) {
+            errx(1, "virtual host `%.*s' given twice", (int)size, name);
+        }
+    }
+
+    n = xmalloc(sizeof(struct vhost_name) + size + 1);
+    n->host = host;
+    n->size = size;
+    memcpy(n->name, name, size);
+    n->name[size] = '\0';
+    n->next = *slot;
+    *slot = n;
+    names_count++;
+}
+
+
+/* name=path[,alias=name]...[,index=page][,default], the root is opened
+ * right away, relative to the directory rockepoll was started in
+ */
+void
+vhost_add(const char *spec)
+{
+    char *buf, *path, *opt, *save;
+    struct vhost *host;
+
+    buf = xmalloc(strlen(spec) + 1);
+    strcpy(buf, spec);
+
+    if (!(path = strchr(buf, '=')) || path == buf || !path[1]) {
+        errx(1, "invalid virtual host `%s'", spec);
+    }
+    *path++ = '\0';
+
+    path = strtok_r(path, ",", &save);
+    host = xmalloc(sizeof(struct vhost));
+    strcpy(host->index, INDEX_PAGE);
+    if ((host->root_fd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        err(1, "open(), `%s'", path);
+    }
+
+    add_name(host, buf, host_size(buf));
+
+    while ((opt = strtok_r(NULL, ",", &save))) {
+        if (!strncmp(opt, "alias=", sizeof("alias=") - 1)) {
+            opt += sizeof("alias=") - 1;
+            add_name(host, opt, host_size(opt));
+        } else if (!strncmp(opt, "index=", sizeof("index=") - 1)) {
+            opt += sizeof("index=") - 1;
+            if (!*opt || strchr(opt, '/') || strlen(opt) >= VHOST_INDEX_SIZE) {
+                errx(1, "invalid index page `%s'", opt);
+            }
+            strcpy(host->index, opt);
+        } else if (!strcmp(opt, "default")) {
+            fallback = host;
+        } else {
+            errx(1, "unknown virtual host option `%s'", opt);
+        }
+    }
+
+    free(buf);
+}
+
+
+/* the main root serves every other name unless a host is the default */
+void
+init_vhosts(int root_fd)
+{
+    default_host.root_fd = root_fd;
+}
+
+
+int
+vhosts_enabled(void)
+{
+    return names_count != 0;
+}
+
+
+const struct vhost *
+vhost_lookup(const char *host)
+{
+    size_t size;
+    const struct vhost_name *n;
+
+    if (!host || !names_count) {
+        return fallback;
+    }
+
+    size = host_size(host);
+    for (n = names[hash_host(host, size) & (VHOST_SLOTS - 1)]; n; n = n->next) {
+        if (n->size == size && !strncasecmp(n->name, host, size)) {
+            return n->host;
+        }
+    }
+
+    return fallback;
+}
@@ -0,0 +1,21 @@
+#ifndef VHOST_H
+#define VHOST_H
+
+#include <stddef.h>
+
+
+#define VHOST_INDEX_SIZE 64
+
+
+struct vhost {
+    int root_fd;
+    char index[VHOST_INDEX_SIZE];
+};
+
+
+void vhost_add(const char *spec);
+void init_vhosts(int root_fd);
+int vhosts_enabled(void);
+const struct vhost *vhost_lookup(const char *host);
+
+#endif